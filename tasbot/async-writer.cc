@@ -0,0 +1,83 @@
+
+#include "async-writer.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+AsyncWriter::AsyncWriter() : running_(false), shutdown_(false) {
+  CHECK(0 == pthread_mutex_init(&mutex_, NULL));
+  CHECK(0 == pthread_cond_init(&work_cond_, NULL));
+  CHECK(0 == pthread_cond_init(&idle_cond_, NULL));
+  if (0 != pthread_create(&thread_, NULL, &AsyncWriter::ThreadMain, this)) {
+    fprintf(stderr, "Couldn't start writer thread.\n");
+    abort();
+  }
+}
+
+AsyncWriter::~AsyncWriter() {
+  pthread_mutex_lock(&mutex_);
+  shutdown_ = true;
+  pthread_cond_signal(&work_cond_);
+  pthread_mutex_unlock(&mutex_);
+  pthread_join(thread_, NULL);
+
+  CHECK(queue_.empty());
+  pthread_cond_destroy(&idle_cond_);
+  pthread_cond_destroy(&work_cond_);
+  pthread_mutex_destroy(&mutex_);
+}
+
+void AsyncWriter::Enqueue(const string &key, Job *job) {
+  CHECK(job != NULL);
+  pthread_mutex_lock(&mutex_);
+  for (deque< pair<string, Job *> >::iterator it = queue_.begin();
+       it != queue_.end(); ++it) {
+    if (it->first == key) {
+      delete it->second;
+      queue_.erase(it);
+      break;
+    }
+  }
+  queue_.push_back(make_pair(key, job));
+  pthread_cond_signal(&work_cond_);
+  pthread_mutex_unlock(&mutex_);
+}
+
+void AsyncWriter::Wait() {
+  pthread_mutex_lock(&mutex_);
+  while (running_ || !queue_.empty()) {
+    pthread_cond_wait(&idle_cond_, &mutex_);
+  }
+  pthread_mutex_unlock(&mutex_);
+}
+
+void *AsyncWriter::ThreadMain(void *self) {
+  ((AsyncWriter *)self)->Loop();
+  return NULL;
+}
+
+void AsyncWriter::Loop() {
+  pthread_mutex_lock(&mutex_);
+  for (;;) {
+    while (queue_.empty() && !shutdown_) {
+      pthread_cond_wait(&work_cond_, &mutex_);
+    }
+
+    // Drain the queue before honoring shutdown.
+    if (queue_.empty()) break;
+
+    Job *job = queue_.front().second;
+    queue_.pop_front();
+    running_ = true;
+
+    // Don't hold the lock while doing the actual work.
+    pthread_mutex_unlock(&mutex_);
+    job->Run();
+    delete job;
+    pthread_mutex_lock(&mutex_);
+
+    running_ = false;
+    pthread_cond_broadcast(&idle_cond_);
+  }
+  pthread_mutex_unlock(&mutex_);
+}
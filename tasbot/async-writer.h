@@ -0,0 +1,56 @@
+/* Runs jobs (like writing diagnostic files) on a single background
+   thread, so that the caller doesn't have to wait for them. */
+
+#ifndef __ASYNC_WRITER_H
+#define __ASYNC_WRITER_H
+
+#include <pthread.h>
+#include <deque>
+#include <string>
+#include <utility>
+
+#include "tasbot.h"
+
+using namespace std;
+
+struct AsyncWriter {
+  // A unit of work. It should own a snapshot of everything it reads,
+  // since the caller keeps modifying its own copies while it runs.
+  struct Job {
+    virtual ~Job() {}
+    virtual void Run() = 0;
+  };
+
+  // Starts the background thread.
+  AsyncWriter();
+  // Runs everything still queued, then stops the thread.
+  ~AsyncWriter();
+
+  // Takes ownership of the job. If a job with the same key is
+  // queued but hasn't started yet, it is stale: it gets deleted
+  // without being run, and this one takes its place in line. So
+  // if writing falls behind, the queue doesn't grow.
+  void Enqueue(const string &key, Job *job);
+
+  // Blocks until the queue is empty and no job is running.
+  void Wait();
+
+ private:
+  static void *ThreadMain(void *self);
+  void Loop();
+
+  pthread_t thread_;
+  pthread_mutex_t mutex_;
+  // Signaled when there's a new job or we're shutting down.
+  pthread_cond_t work_cond_;
+  // Signaled when a job finishes.
+  pthread_cond_t idle_cond_;
+  // Jobs owned.
+  deque< pair<string, Job *> > queue_;
+  bool running_;
+  bool shutdown_;
+
+  NOT_COPYABLE(AsyncWriter);
+};
+
+#endif
@@ -1,9 +1,12 @@
 
 #include "basis-util.h"
 
+#include "movie-index.h"
+
 vector<uint8> BasisUtil::LoadOrComputeBasis(const vector<uint8> &inputs,
 					      int frame,
-					      const string &basisfile) {
+					      const string &basisfile,
+					      MovieIndex *index) {
   if (Util::ExistsFile(basisfile)) {
     fprintf(stderr, "Loading basis file %s.\n", basisfile.c_str());
     return Util::ReadFileBytes(basisfile);
@@ -12,8 +15,12 @@ vector<uint8> BasisUtil::LoadOrComputeBasis(const vector<uint8> &inputs,
   fprintf(stderr, "Computing basis file %s.\n", basisfile.c_str());
   vector<uint8> start;
   Emulator::Save(&start);
-  for (int i = 0; i < frame && i < inputs.size(); i++) {
-    Emulator::Step(inputs[i]);
+  if (index != NULL) {
+    index->Seek(min((size_t)frame, inputs.size()));
+  } else {
+    for (int i = 0; i < frame && i < inputs.size(); i++) {
+      Emulator::Step(inputs[i]);
+    }
   }
   vector<uint8> basis;
   Emulator::GetBasis(&basis);
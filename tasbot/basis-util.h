@@ -12,14 +12,19 @@
 
 using namespace std;
 
+struct MovieIndex;
+
 struct BasisUtil {
   // Emulator::Initialize must have been called and we must be
   // on the first frame (or the one you want). Inputs gives the
   // inputs to play, and the basis is captured at the given frame
   // (0 indexed). If we already have a file, we just load that.
+  // If index is non-NULL, it must be an index of inputs, and is
+  // used to seek to the frame instead of playing up to it.
   static vector<uint8> LoadOrComputeBasis(const vector<uint8> &inputs,
                                           int frame,
-                                          const string &basisfile);
+                                          const string &basisfile,
+                                          MovieIndex *index = NULL);
 };
 
 #endif
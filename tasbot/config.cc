@@ -6,10 +6,18 @@ int Config::InitConfig(int argc, char *argv[]) {
     {"fastforward", required_argument, NULL, 'f'},
     {"game", required_argument, NULL, 'g'},
   #ifdef MARIONET
+    {"backtrack-helpers", required_argument, NULL, 'b'},
+    {"fork-helpers", no_argument, NULL, 'k'},
     {"helper", required_argument, NULL, 'h'},
     {"master", required_argument, NULL, 'm'},
   #endif
-    {"movie", required_argument, NULL, 'i'}
+    {"max-next", required_argument, NULL, 'x'},
+    {"min-next", required_argument, NULL, 'n'},
+    {"movie", required_argument, NULL, 'i'},
+    {"prune", required_argument, NULL, 'p'},
+    {"search", required_argument, NULL, 's'},
+    {"watch", required_argument, NULL, 'w'},
+    {NULL, 0, NULL, 0}
   };
   char ch;
   while ((ch = getopt_long(argc, argv, "", long_options, NULL)) != -1) {
@@ -18,12 +26,34 @@ int Config::InitConfig(int argc, char *argv[]) {
       game = optarg;
       break;
     case 'i':
-      movie = optarg;
+      if (movies.empty()) movie = optarg;
+      movies.push_back(optarg);
       break;
     case 'f':
       fastforward = atoi(optarg);
       break;
+    case 'p':
+      prune = atof(optarg);
+      break;
+    case 'n':
+      min_next = atoi(optarg);
+      break;
+    case 'x':
+      max_next = atoi(optarg);
+      break;
+    case 'w':
+      watch = optarg;
+      break;
+    case 's':
+      search = optarg;
+      break;
   #ifdef MARIONET
+    case 'b':
+      backtrack_helpers = atof(optarg);
+      break;
+    case 'k':
+      fork_helpers = true;
+      break;
     case 'h':
       port = atoi(optarg);
       if (!port) {
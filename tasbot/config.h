@@ -15,9 +15,38 @@ struct Config {
   int port;
   vector<int> helpers;
   string game, movie;
+  // Every --movie given, in order. movie is the first.
+  vector<string> movies;
   size_t fastforward;
+  // If positive, playfun prunes redundant objectives with this
+  // tolerance (see WeightedObjectives::Prune) before starting.
+  double prune;
+  // Fraction of the helpers that playfun's master gives to
+  // backtracking, which then runs alongside the search, like 0.25.
+  // If that's no helpers or all of them (as by default), it
+  // backtracks synchronously.
+  double backtrack_helpers;
+  // If set, playfun's master forks its helpers after loading,
+  // rather than connecting to ones started separately.
+  bool fork_helpers;
+  // Bounds on the number of inputs playfun commits per round. Within
+  // them, it commits more when the choice hardly matters and fewer
+  // when it does. Zero means playfun's usual fixed length.
+  size_t min_next, max_next;
+  // If non-empty, a condition on memory (see Watch) under which a
+  // state is hopeless, like the player having died. Rollouts stop
+  // there rather than playing on.
+  string watch;
+  // For showfun: filters for a RamSearch (see ParseFilters) to run
+  // over the movie's memories.
+  string search;
   MD5DATA romchecksum;
-  Config(int argc, char *argv[]) {
+  Config() : port(0), fastforward(0), prune(0.0), backtrack_helpers(0.0),
+             fork_helpers(false), min_next(0), max_next(0) {}
+  Config(int argc, char *argv[]) : port(0), fastforward(0), prune(0.0),
+                                   backtrack_helpers(0.0),
+                                   fork_helpers(false),
+                                   min_next(0), max_next(0) {
     InitConfig(argc, argv);
   }
   int InitConfig(int argc, char *argv[]);
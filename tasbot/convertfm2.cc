@@ -0,0 +1,28 @@
+/* Converts between FM2 and the binary input log format (inputlog.h),
+   in whichever direction makes sense for the input file. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+
+#include "tasbot.h"
+
+#include "inputlog.h"
+
+int main(int argc, char *argv[]) {
+  if (argc < 3) {
+    fprintf(stderr,
+	    "Usage: convertfm2 movie.fm2 movie.inputs\n"
+	    "       convertfm2 movie.inputs movie.fm2 [romfilename]\n");
+    return -1;
+  }
+
+  const string infile = argv[1], outfile = argv[2];
+  if (InputLogReader::IsInputLog(infile)) {
+    const string romfilename = argc > 3 ? argv[3] : "unknown.nes";
+    InputLog::ToFM2(infile, outfile, romfilename);
+  } else {
+    InputLog::FromFM2(infile, outfile);
+  }
+  return 0;
+}
@@ -1,6 +1,8 @@
 
 #include "emulator.h"
 
+#include "watch.h"
+
 // Joystick data. I think used for both controller 0 and 1. Part of
 // the "API".
 static uint32 joydata = 0;
@@ -156,6 +158,36 @@ void Emulator::GetMemory(vector<uint8> *mem) {
   memcpy(&((*mem)[0]), RAM, 0x800);
 }
 
+static const Watch *watch = NULL;
+// What the watch said last time, if watch_known. It stays right
+// until a state is loaded or one of the bytes it reads (which are
+// watched by FCEU_WatchRAM) is written.
+static bool watch_known = false, watch_value = false;
+static uint64 watch_writes = 0ULL;
+
+void Emulator::SetWatch(const Watch *w) {
+  watch = w;
+  watch_known = false;
+  FCEU_UnwatchAllRAM();
+  vector<int> addrs;
+  if (watch != NULL && watch->Addresses(&addrs)) {
+    for (int i = 0; i < addrs.size(); i++) {
+      FCEU_WatchRAM(addrs[i], true);
+    }
+  }
+}
+
+bool Emulator::Watched() {
+  if (watch == NULL) return false;
+  if (!watch_known || RAMWatchedWrites != watch_writes) {
+    watch_value = watch->Check(RAM);
+    // Without write watches we can't tell when it changes.
+    watch_known = RAMWatching > 0;
+    watch_writes = RAMWatchedWrites;
+  }
+  return watch_value;
+}
+
 /**
  * Initialize all of the subsystem drivers: video, audio, and joystick.
  */
@@ -219,6 +251,23 @@ void Emulator::Shutdown() {
   CloseGame();
 }
 
+bool Emulator::SwitchGame(Config &config) {
+  CHECK(initialized);
+  string romfile = config.game + ".nes";
+  if (1 != LoadGame(romfile.c_str())) {
+    fprintf(stderr, "Couldn't load [%s]\n", romfile.c_str());
+    return false;
+  }
+  newppu = 0;
+
+  config.romchecksum = GameInfo->MD5;
+  watch_known = false;
+  cache->Resize(cache->limit, cache->slop);
+  fprintf(stderr, "Switched to ROM checksum %s\n",
+	  BytesToString(config.romchecksum.data, MD5DATA::size).c_str());
+  return true;
+}
+
 bool Emulator::Initialize(Config &config) {
   if (initialized) {
     fprintf(stderr, "Already initialized.\n");
@@ -325,6 +374,35 @@ void Emulator::Step(uint8 inputs) {
   FCEUI_Emulate(NULL, &sound, &ssize, SKIP_VIDEO_AND_SOUND);
 }
 
+void Emulator::EnableSound(int rate) {
+  FCEUI_SetSoundQuality(1);
+  FCEUI_Sound(rate);
+}
+
+void Emulator::StepFull(uint8 inputs, vector<uint8> *rgb,
+			vector<int16> *sound) {
+  uint8 *xbuf;
+  int32 *samples;
+  int32 ssize;
+
+  joydata = (uint32) inputs;
+  FCEUI_Emulate(&xbuf, &samples, &ssize, 0);
+
+  // The picture is palette indices, in rows of 256.
+  rgb->resize(256 * 240 * 3);
+  uint8 *out = &(*rgb)[0];
+  for (int i = 0; i < 256 * 240; i++) {
+    FCEUD_GetPalette(xbuf[i], &out[0], &out[1], &out[2]);
+    out += 3;
+  }
+
+  // Same as wave.cpp does.
+  sound->resize(ssize);
+  for (int i = 0; i < ssize; i++) {
+    (*sound)[i] = (int16)samples[i];
+  }
+}
+
 void Emulator::Save(vector<uint8> *out) {
   SaveEx(out, NULL);
 }
@@ -342,6 +420,7 @@ void Emulator::LoadUncompressed(vector<uint8> *in) {
     fprintf(stderr, "Couldn't restore from state\n");
     abort();
   }
+  watch_known = false;
 }
 
 void Emulator::Load(vector<uint8> *state) {
@@ -440,6 +519,7 @@ void Emulator::LoadEx(vector<uint8> *state, const vector<uint8> *basis) {
     fprintf(stderr, "Couldn't restore from state\n");
     abort();
   }
+  watch_known = false;
 }
 
 #else
@@ -455,6 +535,7 @@ void Emulator::LoadEx(vector<uint8> *state, const vector<uint8> *basis) {
     fprintf(stderr, "Couldn't restore from state\n");
     abort();
   }
+  watch_known = false;
 }
 
 
@@ -501,3 +582,12 @@ void Emulator::PrintCacheStats() {
   CHECK(cache != NULL);
   cache->PrintStats();
 }
+
+void Emulator::GetCacheStats(uint64 *hits, uint64 *misses) {
+  if (cache == NULL) {
+    *hits = *misses = 0ULL;
+  } else {
+    *hits = cache->hits;
+    *misses = cache->misses;
+  }
+}
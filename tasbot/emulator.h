@@ -28,12 +28,20 @@ using std::tr1::unordered_map;
 
 using namespace std;
 
+struct Watch;
+
 struct Emulator {
   // Returns false upon error. Only initialize once.
   static bool Initialize(Config &config);
   // Calls some internal FCEUX stuff, probably not necessary.
   static void Shutdown();
 
+  // After Initialize, replaces the loaded ROM with config.game's,
+  // at power-on, and sets config.romchecksum. Clears the state
+  // cache, since different games' states could look alike. Returns
+  // false upon error, and then no game is loaded.
+  static bool SwitchGame(Config &config);
+
   static void Save(vector<uint8> *out);
   // Doesn't modify its argument.
   static void Load(vector<uint8> *in);
@@ -43,9 +51,27 @@ struct Emulator {
   //    RLDUTSBA (Right, Left, Down, Up, sTart, Select, B, A)
   static void Step(uint8 inputs);
 
+  // For rendering. Turns on sound emulation, which Step skips, at
+  // the given sample rate.
+  static void EnableSound(int rate);
+
+  // Like Step, but also gets the frame's picture, as 256x240 RGB
+  // pixels, and the sound it made, as 16-bit mono samples (none
+  // unless EnableSound was called). Much slower.
+  static void StepFull(uint8 inputs, vector<uint8> *rgb,
+                       vector<int16> *sound);
+
   // Copy the 0x800 bytes of RAM.
   static void GetMemory(vector<uint8> *mem);
 
+  // Rollouts can stop early once the game reaches a state that's no
+  // use, like the player having died. Sets the condition for that,
+  // or NULL for none. Not owned; must outlast its use.
+  static void SetWatch(const Watch *watch);
+  // Whether the watch condition holds in the current state. Always
+  // false if there's no watch.
+  static bool Watched();
+
   // Fancy stuff.
 
   // Reset the state cache. Set the maximum number of states that can
@@ -61,6 +87,8 @@ struct Emulator {
   static void CachingStep(uint8 input);
 
   static void PrintCacheStats();
+  // Cumulative lookups in the state cache since it was last reset.
+  static void GetCacheStats(uint64 *hits, uint64 *misses);
 
   // States often only differ by a small amount, so a way to reduce
   // their entropy is to diff them against a representative savestate.
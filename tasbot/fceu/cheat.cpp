@@ -783,6 +783,20 @@ void FCEUI_CheatSearchBegin(void)
 }
 
 
+void FCEUI_CheatSearchExclude(uint32 a)
+{
+	if(!CheatComp)
+	{
+		if(!InitCheatComp())
+		{
+			CheatMemErr();
+			return;
+		}
+	}
+	CheatComp[a&0xFFFF]|=CHEATC_EXCLUDED;
+}
+
+
 static int INLINE CAbs(int x)
 {
 	if(x<0)
@@ -362,8 +362,49 @@ static void FreeBuffers()
 
 uint8 PAL=0;
 
+int RAMWatching = 0;
+uint64 RAMWatchedWrites = 0;
+static uint8 RAMWatchBits[0x800 / 8];
+static std::vector<RAMWrite> RAMWriteLog;
+
+void FCEU_WatchRAM(uint32 addr, bool watch)
+{
+	addr &= 0x7FF;
+	const uint8 bit = 1 << (addr & 7);
+	if (!(RAMWatchBits[addr >> 3] & bit) == !watch) return;
+	RAMWatchBits[addr >> 3] ^= bit;
+	RAMWatching += watch ? 1 : -1;
+}
+
+void FCEU_UnwatchAllRAM(void)
+{
+	memset(RAMWatchBits, 0, sizeof (RAMWatchBits));
+	RAMWatching = 0;
+	RAMWriteLog.clear();
+}
+
+const std::vector<RAMWrite> &FCEU_RAMWrites(void)
+{
+	return RAMWriteLog;
+}
+
+void FCEU_LogRAMWrite(uint32 A, uint8 V)
+{
+	if (RAMWatchBits[A >> 3] & (1 << (A & 7)))
+	{
+		RAMWrite w;
+		w.addr = A;
+		w.old_value = RAM[A];
+		w.new_value = V;
+		w.cycle = timestamp;
+		RAMWriteLog.push_back(w);
+		RAMWatchedWrites++;
+	}
+}
+
 static DECLFW(BRAML)
 {
+	RAMWATCH_WRITE(A, V);
 	RAM[A]=V;
 	#ifdef _S9XLUA_H
 	CallRegisteredLuaMemHook(A, 1, V, LUAMEMHOOK_WRITE);
@@ -372,6 +413,7 @@ static DECLFW(BRAML)
 
 static DECLFW(BRAMH)
 {
+	RAMWATCH_WRITE(A&0x7FF, V);
 	RAM[A&0x7FF]=V;
 	#ifdef _S9XLUA_H
 	CallRegisteredLuaMemHook(A&0x7FF, 1, V, LUAMEMHOOK_WRITE);
@@ -677,6 +719,7 @@ void FCEUI_Emulate(uint8 **pXBuf, int32 **SoundBuf, int32 *SoundBufSize, int ski
 
   FCEU_UpdateInput();
   lagFlag = 1;
+  RAMWriteLog.clear();
 
   // if(geniestage!=1) FCEU_ApplyPeriodicCheats();
 
@@ -1,6 +1,8 @@
 #ifndef _FCEUH
 #define _FCEUH
 
+#include <vector>
+
 extern int fceuindbg;
 extern int newppu;
 void ResetGameLoaded(void);
@@ -50,6 +52,29 @@ extern  uint8  *RAM;            //shared memory modifications
 extern  uint8  *GameMemBlock;   //shared memory modifications
 extern int EmulationPaused;
 
+// Write watches on RAM, like hardware watchpoints. Each frame logs
+// the CPU's writes to the watched bytes. When none are, the cost is
+// one test of RAMWatching per write to RAM.
+struct RAMWrite {
+	// 0 to 0x7FF, after mirroring.
+	uint16 addr;
+	uint8 old_value, new_value;
+	// CPU cycles into the frame (timestamp).
+	uint32 cycle;
+};
+// Number of bytes watched.
+extern int RAMWatching;
+// Writes to watched bytes ever, including earlier frames.
+extern uint64 RAMWatchedWrites;
+void FCEU_WatchRAM(uint32 addr, bool watch);
+void FCEU_UnwatchAllRAM(void);
+// The watched writes so far in the current (or last) frame.
+const std::vector<RAMWrite> &FCEU_RAMWrites(void);
+// Use RAMWATCH_WRITE; A must be in 0 to 0x7FF.
+void FCEU_LogRAMWrite(uint32 A, uint8 V);
+#define RAMWATCH_WRITE(A, V) \
+	do { if (RAMWatching) FCEU_LogRAMWrite((A), (V)); } while (0)
+
 uint8 FCEU_ReadRomByte(uint32 i);
 
 extern readfunc ARead[0x10000];
@@ -1035,10 +1035,8 @@ void SetNESSoundMap(void)
 static int32 inbuf=0;
 int FlushEmulateSound(void)
 {
-  // not expecting to get here --tom7
-  fprintf(stderr, "How did I get to FlushEmulateSound?\n");
-  abort();
-
+  // Emulator::Step skips sound; only rendering gets here, after
+  // turning it on with FCEUI_Sound.
   int x;
   int32 end,left;
 
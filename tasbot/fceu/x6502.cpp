@@ -65,6 +65,7 @@ static INLINE uint8 RdRAM(unsigned int A)
 
 static INLINE void WrRAM(unsigned int A, uint8 V)
 {
+	RAMWATCH_WRITE(A, V);
 	RAM[A]=V;
 	#ifdef _S9XLUA_H
 	CallRegisteredLuaMemHook(A, 1, V, LUAMEMHOOK_WRITE);
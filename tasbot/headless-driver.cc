@@ -162,10 +162,22 @@ void FCEUD_NetworkClose(void) {}
 void FCEUD_NetplayText(uint8 *text) {}
 
 
-void FCEUD_SetPalette(uint8 index, uint8 r, uint8 g, uint8 b) {}
+// Kept for rendering (Emulator::StepFull); the emulator sets it
+// from palette.cpp when a game is loaded.
+static uint8 palette[256][3];
+
+void FCEUD_SetPalette(uint8 index, uint8 r, uint8 g, uint8 b) {
+  palette[index][0] = r;
+  palette[index][1] = g;
+  palette[index][2] = b;
+}
 
 // Gets the color for a particular index in the palette.
-void FCEUD_GetPalette(uint8 index, uint8 *r, uint8 *g, uint8 *b) {}
+void FCEUD_GetPalette(uint8 index, uint8 *r, uint8 *g, uint8 *b) {
+  *r = palette[index][0];
+  *g = palette[index][1];
+  *b = palette[index][2];
+}
 
 bool FCEUI_AviEnableHUDrecording() { return false; }
 void FCEUI_SetAviEnableHUDrecording(bool enable) {}
@@ -0,0 +1,112 @@
+
+#include "input-classes.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <map>
+
+#include "emulator.h"
+#include "util.h"
+
+static int NumButtons(int input) {
+  int n = 0;
+  for (; input; input >>= 1) n += input & 1;
+  return n;
+}
+
+// Orders inputs by preference for being canonical.
+static bool Simpler(int a, int b) {
+  const int na = NumButtons(a), nb = NumButtons(b);
+  return na != nb ? na < nb : a < b;
+}
+
+InputClasses::InputClasses() {
+  for (int i = 0; i < 256; i++) canonical[i] = i;
+}
+
+InputClasses *InputClasses::Learn(const vector< vector<uint8> > &states) {
+  // What each input does, over all of the states.
+  uint64 signature[256] = {0};
+  vector<uint8> mem;
+  for (int s = 0; s < states.size(); s++) {
+    // Load doesn't modify its argument.
+    vector<uint8> *state = const_cast< vector<uint8> * >(&states[s]);
+    for (int i = 0; i < 256; i++) {
+      Emulator::Load(state);
+      Emulator::Step(i);
+      // Not the memory right after the input, since most games copy
+      // the raw joypad byte into RAM, which would make every input
+      // look different.
+      for (int f = 0; f < INPUT_CLASSES_LOOKAHEAD; f++) {
+	Emulator::Step(0);
+      }
+      Emulator::GetMemory(&mem);
+      signature[i] = CityHash64WithSeed((const char *)&mem[0], mem.size(),
+					signature[i]);
+    }
+  }
+
+  InputClasses *classes = new InputClasses;
+  map<uint64, int> simplest;
+  for (int i = 0; i < 256; i++) {
+    map<uint64, int>::iterator it = simplest.find(signature[i]);
+    if (it == simplest.end()) {
+      simplest.insert(make_pair(signature[i], i));
+    } else if (Simpler(i, it->second)) {
+      it->second = i;
+    }
+  }
+  for (int i = 0; i < 256; i++) {
+    classes->canonical[i] = simplest[signature[i]];
+  }
+  return classes;
+}
+
+InputClasses *InputClasses::LoadFromFile(const string &filename) {
+  InputClasses *classes = new InputClasses;
+  if (!Util::ExistsFile(filename)) {
+    printf("No input classes in %s; all inputs are distinct.\n",
+	   filename.c_str());
+    return classes;
+  }
+
+  vector<string> lines = Util::ReadFileToLines(filename);
+  for (int i = 0; i < lines.size(); i++) {
+    int input, canon;
+    if (2 == sscanf(lines[i].c_str(), "%d %d", &input, &canon)) {
+      CHECK(input >= 0 && input < 256 && canon >= 0 && canon < 256);
+      classes->canonical[input] = canon;
+    }
+  }
+  printf("Read %d input classes from %s.\n",
+	 classes->NumClasses(), filename.c_str());
+  return classes;
+}
+
+void InputClasses::SaveToFile(const string &filename) const {
+  string out;
+  for (int i = 0; i < 256; i++) {
+    if (canonical[i] != i) {
+      out += StringPrintf("%d %d\n", i, (int)canonical[i]);
+    }
+  }
+  if (!Util::WriteFile(filename, out)) {
+    printf("Failed writing input classes to %s.\n", filename.c_str());
+  } else {
+    printf("Wrote %d input classes to %s.\n", NumClasses(), filename.c_str());
+  }
+}
+
+void InputClasses::Canonicalize(vector<uint8> *inputs) const {
+  for (int i = 0; i < inputs->size(); i++) {
+    (*inputs)[i] = canonical[(*inputs)[i]];
+  }
+}
+
+int InputClasses::NumClasses() const {
+  int n = 0;
+  for (int i = 0; i < 256; i++) {
+    if (canonical[i] == i) n++;
+  }
+  return n;
+}
@@ -0,0 +1,55 @@
+/* Inputs that do the same thing in a particular game. Many games
+   ignore some buttons (Select in Mario) or combinations of them, so
+   of the 256 possible inputs, far fewer are actually different.
+   Mapping each input to a canonical member of its class means that
+   equivalent candidates collapse together and are only emulated once.
+
+   The classes are learned by stepping every input from a sample of
+   states along the example movies and comparing the memory a few
+   frames later. Inputs that agree on every sample are taken to be
+   equivalent, so this can only be as good as the sample. */
+
+#ifndef __INPUT_CLASSES_H
+#define __INPUT_CLASSES_H
+
+#include <string>
+#include <vector>
+
+#include "fceu/types.h"
+#include "tasbot.h"
+
+using namespace std;
+
+// After stepping each input, compare the memory after this many more
+// frames of no input, by which point the game's copies of the joypad
+// (this frame's and last frame's) have been overwritten, and effects
+// that take a frame to land have landed.
+#define INPUT_CLASSES_LOOKAHEAD 2
+
+struct InputClasses {
+  // Every input in its own class.
+  InputClasses();
+
+  // The emulator must be initialized, with the states' game. Steps
+  // every input from each savestate. Clobbers the emulator state.
+  static InputClasses *Learn(const vector< vector<uint8> > &states);
+
+  // If the file doesn't exist, every input is in its own class.
+  static InputClasses *LoadFromFile(const string &filename);
+  // Text, one line per input that isn't canonical: the input and
+  // then its canonical one.
+  void SaveToFile(const string &filename) const;
+
+  // The member of input's class with the fewest buttons pressed.
+  uint8 Canonical(uint8 input) const { return canonical[input]; }
+  void Canonicalize(vector<uint8> *inputs) const;
+
+  int NumClasses() const;
+
+ private:
+  uint8 canonical[256];
+
+  NOT_COPYABLE(InputClasses);
+};
+
+#endif
@@ -0,0 +1,170 @@
+
+#include "inputlog.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "simplefm2.h"
+#include "util.h"
+
+static string SubtitleFile(const string &filename) {
+  return filename + ".subs";
+}
+
+bool InputLogReader::IsInputLog(const string &filename) {
+  return MappedFile::HasMagic(filename, INPUTLOG_MAGIC);
+}
+
+InputLogReader::InputLogReader(const string &filename)
+  : filename(filename), file(filename), inputs(NULL), size(0) {
+  if (file.Size() < INPUTLOG_HEADER_SIZE ||
+      0 != memcmp(file.Data(), INPUTLOG_MAGIC, strlen(INPUTLOG_MAGIC))) {
+    fprintf(stderr, "%s is not an input log.\n", filename.c_str());
+    abort();
+  }
+
+  const uint8 *bytes = file.Data();
+  memcpy(romchecksum.data, bytes + strlen(INPUTLOG_MAGIC), MD5DATA::size);
+  inputs = bytes + INPUTLOG_HEADER_SIZE;
+  size = file.Size() - INPUTLOG_HEADER_SIZE;
+}
+
+vector<uint8> InputLogReader::ToVector() const {
+  return vector<uint8>(inputs, inputs + size);
+}
+
+vector<string> InputLogReader::ReadSubtitles() const {
+  vector<string> out(size, "");
+  const string subfile = SubtitleFile(filename);
+  if (!Util::ExistsFile(subfile))
+    return out;
+
+  vector<string> lines = Util::ReadFileToLines(subfile);
+  size_t frame = 0;
+  string current;
+  for (int i = 0; i < lines.size(); i++) {
+    const string &line = lines[i];
+    if (line.empty()) continue;
+    size_t space = line.find(' ');
+    size_t next = atoll(line.substr(0, space).c_str());
+    CHECK(next >= frame);
+    for (; frame < next && frame < size; frame++) {
+      out[frame] = current;
+    }
+    current = (space == string::npos) ? "" : line.substr(space + 1);
+  }
+  for (; frame < size; frame++) {
+    out[frame] = current;
+  }
+  return out;
+}
+
+InputLogWriter::InputLogWriter(const string &filename,
+			       const MD5DATA &romchecksum)
+  : filename(filename), size(0) {
+  f = fopen(filename.c_str(), "wb");
+  subs = fopen(SubtitleFile(filename).c_str(), "wb");
+  if (f == NULL || subs == NULL) {
+    fprintf(stderr, "Couldn't open input log %s for writing.\n",
+	    filename.c_str());
+    abort();
+  }
+
+  uint8 header[INPUTLOG_HEADER_SIZE] = {0};
+  memcpy(header, INPUTLOG_MAGIC, strlen(INPUTLOG_MAGIC));
+  memcpy(header + strlen(INPUTLOG_MAGIC), romchecksum.data, MD5DATA::size);
+  CHECK(INPUTLOG_HEADER_SIZE == fwrite(header, 1, INPUTLOG_HEADER_SIZE, f));
+  Flush();
+}
+
+InputLogWriter::~InputLogWriter() {
+  fclose(subs);
+  fclose(f);
+}
+
+void InputLogWriter::Append(uint8 input, const string &subtitle) {
+  if (subtitles.empty() ? !subtitle.empty() :
+      subtitles.back().text != subtitle) {
+    subtitles.push_back(Subtitle(size, ftell(subs), subtitle));
+    fprintf(subs, "%zu %s\n", size, subtitle.c_str());
+  }
+  CHECK(EOF != fputc(input, f));
+  size++;
+}
+
+void InputLogWriter::Truncate(size_t movenum) {
+  if (movenum >= size)
+    return;
+
+  Flush();
+  size = movenum;
+  CHECK(0 == ftruncate(fileno(f), INPUTLOG_HEADER_SIZE + size));
+  CHECK(0 == fseek(f, 0, SEEK_END));
+
+  if (!subtitles.empty() && subtitles.back().frame >= movenum) {
+    while (!subtitles.empty() && subtitles.back().frame >= movenum) {
+      long offset = subtitles.back().offset;
+      subtitles.pop_back();
+      CHECK(0 == ftruncate(fileno(subs), offset));
+    }
+    CHECK(0 == fseek(subs, 0, SEEK_END));
+  }
+}
+
+void InputLogWriter::Flush() {
+  fflush(f);
+  fflush(subs);
+}
+
+MD5DATA InputLog::ReadFM2Checksum(const string &fm2file) {
+  MD5DATA md5;
+  memset(md5.data, 0, MD5DATA::size);
+  vector<string> lines = Util::ReadFileToLines(fm2file);
+  static const string key = "romChecksum ";
+  for (int i = 0; i < lines.size(); i++) {
+    if (lines[i].compare(0, key.size(), key) == 0) {
+      StringToBytes(lines[i].substr(key.size()), md5.data, MD5DATA::size);
+      break;
+    }
+  }
+  return md5;
+}
+
+void InputLog::FromFM2(const string &fm2file, const string &logfile) {
+  vector<uint8> inputs = SimpleFM2::ReadInputs(fm2file);
+
+  // Subtitle lines are "subtitle frame text", and the text lasts
+  // until the next one.
+  vector<string> subtitles(inputs.size(), "");
+  vector<string> lines = Util::ReadFileToLines(fm2file);
+  static const string key = "subtitle ";
+  for (int i = 0; i < lines.size(); i++) {
+    if (lines[i].compare(0, key.size(), key) == 0) {
+      const string rest = lines[i].substr(key.size());
+      size_t space = rest.find(' ');
+      const string text = (space == string::npos) ? "" : rest.substr(space + 1);
+      for (size_t frame = atoll(rest.c_str());
+	   frame < subtitles.size(); frame++) {
+	subtitles[frame] = text;
+      }
+    }
+  }
+
+  InputLogWriter writer(logfile, ReadFM2Checksum(fm2file));
+  for (int i = 0; i < inputs.size(); i++) {
+    writer.Append(inputs[i], subtitles[i]);
+  }
+  printf("Wrote %zu inputs to %s.\n", inputs.size(), logfile.c_str());
+}
+
+void InputLog::ToFM2(const string &logfile, const string &fm2file,
+		     const string &romfilename) {
+  InputLogReader reader(logfile);
+  Config config;
+  config.romchecksum = reader.RomChecksum();
+  SimpleFM2::WriteInputsWithSubtitles(fm2file, romfilename, config,
+				      reader.ToVector(),
+				      reader.ReadSubtitles());
+  printf("Wrote %zu inputs to %s.\n", reader.Size(), fm2file.c_str());
+}
@@ -0,0 +1,106 @@
+/* Compact binary companion to FM2, for long movies that are read
+   often or written as they're played. The file is a 32-byte header
+   (magic, then the ROM checksum) followed by one byte per frame, in
+   the same RLDUTSBA format that SimpleFM2 uses. It can be memory-
+   mapped and read without any parsing.
+
+   Subtitles go in a text side table, the filename plus ".subs", with
+   a "frame text" line each time the subtitle changes. Both files are
+   only ever appended to or truncated, so a running program can keep
+   them current without rewriting the whole movie. */
+
+#ifndef __INPUTLOG_H
+#define __INPUTLOG_H
+
+#include <stdio.h>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "config.h"
+#include "fceu/types.h"
+#include "mapped-file.h"
+#include "tasbot.h"
+
+using namespace std;
+
+#define INPUTLOG_MAGIC "tasbot-inputs-1\n"
+#define INPUTLOG_HEADER_SIZE 32
+
+// A read-only, memory-mapped input log.
+struct InputLogReader {
+  // Aborts if the file can't be read or isn't an input log.
+  explicit InputLogReader(const string &filename);
+
+  // Does the file start with INPUTLOG_MAGIC?
+  static bool IsInputLog(const string &filename);
+
+  size_t Size() const { return size; }
+  // Valid as long as this object is.
+  const uint8 *Inputs() const { return inputs; }
+  vector<uint8> ToVector() const;
+
+  const MD5DATA &RomChecksum() const { return romchecksum; }
+
+  // One subtitle per frame (empty if none), as for
+  // SimpleFM2::WriteInputsWithSubtitles.
+  vector<string> ReadSubtitles() const;
+
+ private:
+  const string filename;
+  MD5DATA romchecksum;
+  MappedFile file;
+  const uint8 *inputs;
+  size_t size;
+
+  NOT_COPYABLE(InputLogReader);
+};
+
+// Appends to an input log as a movie is played.
+struct InputLogWriter {
+  // Truncates the file (and its subtitles) and writes the header.
+  InputLogWriter(const string &filename, const MD5DATA &romchecksum);
+  ~InputLogWriter();
+
+  void Append(uint8 input, const string &subtitle);
+
+  // Forget frame movenum and everything after, e.g. when
+  // backtracking.
+  void Truncate(size_t movenum);
+
+  // Make everything appended so far visible to readers.
+  void Flush();
+
+  size_t Size() const { return size; }
+
+ private:
+  const string filename;
+  FILE *f;
+  FILE *subs;
+  size_t size;
+  // Frame, offset in the subtitle file, and text of each line
+  // written to it, so that we can truncate.
+  struct Subtitle {
+    Subtitle(size_t frame, long offset, const string &text)
+      : frame(frame), offset(offset), text(text) {}
+    size_t frame;
+    long offset;
+    string text;
+  };
+  vector<Subtitle> subtitles;
+
+  NOT_COPYABLE(InputLogWriter);
+};
+
+struct InputLog {
+  // Converters. The FM2 side uses SimpleFM2, so it has the same
+  // limitations (one gamepad, power-on start).
+  static void FromFM2(const string &fm2file, const string &logfile);
+  static void ToFM2(const string &logfile, const string &fm2file,
+                    const string &romfilename);
+
+  // Read the romChecksum line from an FM2 header, or zeroes.
+  static MD5DATA ReadFM2Checksum(const string &fm2file);
+};
+
+#endif
@@ -5,13 +5,39 @@
 
 #include "learnfun.h"
 
-static void SaveMemory(vector< vector<uint8> > *memories) {
-  memories->resize(memories->size() + 1);
-  vector<uint8> *v = &memories->back();
-  for (int i = 0; i < 0x800; i++) {
-    v->push_back((uint8)RAM[i]);
+static void SaveMemory(vector<uint8> *mem) {
+  mem->assign(RAM, RAM + 0x800);
+}
+
+#ifndef __MINGW32__
+static void WriteMemory(int fd) {
+  const uint8 *p = (const uint8 *)RAM;
+  size_t left = 0x800;
+  while (left > 0) {
+    ssize_t n = write(fd, p, left);
+    CHECK(n > 0);
+    p += n;
+    left -= n;
+  }
+}
+
+static void ReadFully(int fd, uint8 *p, size_t len) {
+  while (len > 0) {
+    ssize_t n = read(fd, p, len);
+    CHECK(n > 0);
+    p += n;
+    len -= n;
   }
 }
+#else
+static void WriteMemory(int fd) {
+  // Only used by workers.
+  abort();
+}
+#endif
+
+// Fraction of transitions where pruning may change Evaluate's sign.
+static const double PRUNE_TOLERANCE = 0.01;
 
 static vector< vector<int> > *objectives = NULL;
 static void PrintAndSave(const vector<int> &ordering) {
@@ -25,14 +51,14 @@ static void PrintAndSave(const vector<int> &ordering) {
 }
 
 // With e.g. an divisor of 3, generate slices covering
-// the first third, middle third, and last third.
-static void GenerateNthSlices(int divisor, int num, 
-			      const vector< vector<uint8> > &memories,
+// the first third, middle third, and last third of the span.
+static void GenerateNthSlices(int divisor, int num,
+			      const pair<int, int> &span,
 			      Objective *obj) {
-  const size_t onenth = memories.size() / divisor;
+  const size_t onenth = (span.second - span.first) / divisor;
   for (int slicenum = 0; slicenum < divisor; slicenum++) {
     vector<int> look;
-    size_t low = slicenum * onenth;
+    size_t low = span.first + slicenum * onenth;
     for (int i = 0; i < onenth; i++) {
       look.push_back(low + i);
     }
@@ -44,121 +70,279 @@ static void GenerateNthSlices(int divisor, int num,
 }
 
 static void GenerateOccasional(int stride, int offsets, int num,
-			       const vector< vector<uint8> > &memories,
+			       const pair<int, int> &span,
 			       Objective *obj) {
-  int span = stride / offsets;
-  int start = rand() % span;
+  int span_len = stride / offsets;
+  int start = span.first + rand() % span_len;
   for (int off = 0; off < offsets; off++) {
     vector<int> look;
     // Consider starting at various places throughout the first stride?
-    for (int frame = start; frame < memories.size(); frame += stride) {
+    for (int frame = start; frame < span.second; frame += stride) {
       look.push_back(frame);
     }
     printf("For occasional @%d (every %d):\n", off, stride);
     for (int i = 0; i < num; i++) {
       obj->EnumerateFull(look, PrintAndSave, 1, off * 0xF00D + i);
     }
-    start += span;
+    start += span_len;
   }
 }
 
-static void MakeObjectives(const string &game, const vector< vector<uint8> > &memories) {
+// Each span is the [begin, end) of one movie's memories. Objectives
+// are only enumerated within a movie, since the memories at the end
+// of one and the start of the next are unrelated.
+static void MakeObjectives(const string &game,
+			   const vector< vector<uint8> > &memories,
+			   const vector< pair<int, int> > &spans) {
   printf("Now generating objectives.\n");
   objectives = new vector< vector<int> >;
   Objective obj(memories);
 
-  // Going to generate a bunch of objective functions.
-  // Some things will never violate the objective, like
-  // [world number, stage number] or [score]. So generate
-  // a handful of whole-game objectives.
+  for (int s = 0; s < spans.size(); s++) {
+    const pair<int, int> &span = spans[s];
+    printf("From movie %d (memories %d-%d):\n",
+	   s, span.first, span.second - 1);
 
-  // TODO: In Mario, all 50 appear to be effectively the same
-  // when graphed. Are they all equivalent, and should we be
-  // accounting for that e.g. in weighting or deduplication?
-  for (int i = 0; i < 50; i++)
-    obj.EnumerateFullAll(PrintAndSave, 1, i);
+    // Going to generate a bunch of objective functions.
+    // Some things will never violate the objective, like
+    // [world number, stage number] or [score]. So generate
+    // a handful of whole-game objectives.
 
-  // XXX Not sure how I feel about these, based on the
-  // graphics. They are VERY noisy.
+    // In Mario, all 50 appear to be effectively the same when
+    // graphed. WeightByExamples removes the ones that order the
+    // memories exactly the same way.
+    for (int i = 0; i < 50; i++)
+      obj.EnumerateFullSpan(span.first, span.second, PrintAndSave, 1, i);
 
-  // Next, generate objectives for each slice of the game:
-  // each half, third, fourth, etc.
-  for (int divisor=2; divisor<=10; divisor++)
-    GenerateNthSlices(divisor, 3, memories, &obj);
+    // XXX Not sure how I feel about these, based on the
+    // graphics. They are VERY noisy.
 
-  // And for each 1/50th.
-  GenerateNthSlices(50, 2, memories, &obj);
+    // Next, generate objectives for each slice of the game:
+    // each half, third, fourth, etc.
+    for (int divisor=2; divisor<=10; divisor++)
+      GenerateNthSlices(divisor, 3, span, &obj);
 
-  // And for each 1/100th.
-  GenerateNthSlices(100, 1, memories, &obj);
+    // And for each 1/50th.
+    GenerateNthSlices(50, 2, span, &obj);
 
-  // Now, for individual frames spread throughout the whole movie.
-  // This one looks great.
-  GenerateOccasional(100, 10, 20, memories, &obj);
+    // And for each 1/100th.
+    GenerateNthSlices(100, 1, span, &obj);
 
-  GenerateOccasional(250, 10, 10, memories, &obj);
+    // Now, for individual frames spread throughout the whole movie.
+    // This one looks great.
+    GenerateOccasional(100, 10, 20, span, &obj);
 
-  // This one looks okay; noisy at times.
-  GenerateOccasional(1000, 10, 5, memories, &obj);
+    GenerateOccasional(250, 10, 10, span, &obj);
 
-  // Weight them. Currently this is just removing duplicates.
+    // This one looks okay; noisy at times.
+    GenerateOccasional(1000, 10, 5, span, &obj);
+  }
+
+  // Weight them. Duplicates are removed, and objectives that make
+  // progress in every movie are preferred.
   printf("There are %zu objectives\n", objectives->size());
   WeightedObjectives weighted(*objectives);
-  printf("And %zu example memories\n", memories.size());
-  weighted.WeightByExamples(memories);
+  printf("And %zu example memories from %zu movie(s)\n",
+	 memories.size(), spans.size());
+  weighted.WeightByExamples(memories, spans);
   printf("And %zu unique objectives\n", weighted.Size());
+  weighted.SaveToFile((game+ "-unpruned.objectives").c_str());
 
-  weighted.SaveToFile((game+ ".objectives").c_str());
+  // playfun evaluates every objective many times per frame, so
+  // only keep ones that make a difference.
+  weighted.Prune(memories, spans, PRUNE_TOLERANCE);
+  // playfun and its helpers load the binary one; the text is for
+  // people.
+  weighted.SaveBinary((game+ ".objectives").c_str());
+  weighted.SaveToFile((game+ ".objectives.txt").c_str());
 
   weighted.SaveSVG(memories, (game+ ".svg").c_str());
 }
 
-int main(int argc, char *argv[]) {
-  Config config(argc, argv);
-  Emulator::Initialize(config);
-  vector<uint8> movie = SimpleFM2::ReadInputs(config.movie.c_str());
-  CHECK(!movie.empty());
+// Replays the movie from power-on, saving the memory after the
+// skipped frames and after each frame thereafter, so that there are
+// movie.size() - start + 1 of them. They're either written to
+// mems[0], mems[1], ..., or if that's NULL, to fd.
+static void ReplayMovie(const vector<uint8> &movie, size_t start,
+			vector<uint8> *mems, int fd) {
+  for (int i = 0; i < start; i++) {
+    Emulator::Step(movie[i]);
+  }
+  if (mems != NULL) SaveMemory(mems++);
+  else WriteMemory(fd);
 
-  vector< vector<uint8> > memories;
-  memories.reserve(movie.size() + 1);
-  vector<uint8> inputs;
+  for (int i = start; i < movie.size(); i++) {
+    if (i % 1000 == 0) {
+      printf("  [% 5.1f%%] %6d/%ld\n", 
+	     ((100.0 * i) / movie.size()), i, movie.size());
+    }
+    Emulator::Step(movie[i]);
+    if (mems != NULL) SaveMemory(mems++);
+    else WriteMemory(fd);
+  }
+}
 
-  // The very beginning of most games start with RAM initialization,
-  // which we really should ignore for building an objective function.
-  // So skip until there's a button press in the movie.
-  size_t start = 0;
-  printf("Skipping frames without argument.\n");
-  while (start < movie.size() && movie[start] == 0) {
-    Emulator::Step(movie[start]);
-    start++;
+// Number of states along the movies to learn input classes from.
+static const int INPUT_CLASS_SAMPLES = 100;
+
+// Replays the movie from power-on, saving count states evenly
+// spaced from start on.
+static void SampleStates(const vector<uint8> &movie, size_t start,
+			 int count, vector< vector<uint8> > *states) {
+  const size_t every = max((size_t)1, (movie.size() - start) / count);
+  for (size_t i = 0; i < movie.size(); i++) {
+    if (i >= start && (i - start) % every == 0) {
+      states->resize(states->size() + 1);
+      Emulator::Save(&states->back());
+    }
+    Emulator::Step(movie[i]);
   }
-  while (start < config.fastforward && start < movie.size()) {
-    Emulator::Step(movie[start]);
-    start++;
+}
+
+#ifndef __MINGW32__
+// Reads one movie's memories from a worker, into the preallocated
+// memories[begin, end).
+struct ReadTrace {
+  int fd;
+  vector< vector<uint8> > *memories;
+  int begin, end;
+};
+
+static void *ReadTraceThread(void *arg) {
+  ReadTrace *rt = (ReadTrace *)arg;
+  for (int i = rt->begin; i < rt->end; i++) {
+    vector<uint8> *v = &(*rt->memories)[i];
+    v->resize(0x800);
+    ReadFully(rt->fd, &(*v)[0], 0x800);
   }
-  CHECK(start < movie.size());
+  close(rt->fd);
+  return NULL;
+}
 
-  printf("Skipped %ld frames until first keypress/ffwd.\n"
-	 "Playing %ld frames...\n", start, movie.size() - start);
+// The emulator is global, so each movie is replayed in its own
+// worker process, forked from this one once the game is loaded.
+// Workers stream each frame's RAM back through a pipe, and a thread
+// per worker reads it into place.
+static void ReplayInWorkers(const vector< vector<uint8> > &movies,
+			    const vector<size_t> &starts,
+			    const vector< pair<int, int> > &spans,
+			    const vector<int> &replay,
+			    vector< vector<uint8> > *memories) {
+  // Fork everything before starting any threads.
+  vector<pid_t> pids;
+  vector<ReadTrace> traces(replay.size());
+  for (int r = 0; r < replay.size(); r++) {
+    const int m = replay[r];
+    int fds[2];
+    CHECK(0 == pipe(fds));
+    fflush(stdout);
+    pid_t pid = fork();
+    CHECK(pid >= 0);
+    if (pid == 0) {
+      close(fds[0]);
+      ReplayMovie(movies[m], starts[m], NULL, fds[1]);
+      close(fds[1]);
+      _exit(0);
+    }
+    close(fds[1]);
+    pids.push_back(pid);
+    traces[r].fd = fds[0];
+    traces[r].memories = memories;
+    traces[r].begin = spans[m].first;
+    traces[r].end = spans[m].second;
+  }
 
-  SaveMemory(&memories);
+  vector<pthread_t> threads(replay.size());
+  for (int r = 0; r < replay.size(); r++) {
+    CHECK(0 == pthread_create(&threads[r], NULL,
+			      ReadTraceThread, &traces[r]));
+  }
+  for (int r = 0; r < replay.size(); r++) {
+    CHECK(0 == pthread_join(threads[r], NULL));
+    int status = 0;
+    CHECK(pids[r] == waitpid(pids[r], &status, 0));
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+      fprintf(stderr, "Worker for movie %d failed.\n", replay[r]);
+      abort();
+    }
+  }
+}
+#endif
 
-  {
-    vector<uint8> save;
-    Emulator::Save(&save);
-    printf("Save states are %ld bytes.\n", save.size());
+int main(int argc, char *argv[]) {
+  Config config(argc, argv);
+  CHECK(!config.movies.empty());
+  Emulator::Initialize(config);
+
+  // Memories from all movies go in one list, with each movie's
+  // span recorded.
+  vector< vector<uint8> > movies;
+  vector<size_t> starts;
+  vector< pair<int, int> > spans;
+  int total = 0;
+  for (int m = 0; m < config.movies.size(); m++) {
+    movies.push_back(SimpleFM2::ReadInputs(config.movies[m].c_str()));
+    CHECK(!movies.back().empty());
+    // The very beginning of most games start with RAM initialization,
+    // which we really should ignore for building an objective function.
+    starts.push_back(RamTrace::MovieStart(movies.back(), config.fastforward));
+    CHECK(starts.back() < movies.back().size());
+    const int count = movies.back().size() - starts.back() + 1;
+    spans.push_back(make_pair(total, total + count));
+    total += count;
+    printf("%s: skipping %ld frames until first keypress/ffwd.\n"
+	   "Playing %ld frames...\n", config.movies[m].c_str(),
+	   starts.back(), movies.back().size() - starts.back());
   }
 
+  vector<uint8> poweron;
+  Emulator::Save(&poweron);
+  printf("Save states are %ld bytes.\n", poweron.size());
+
+  vector< vector<uint8> > memories(total);
   uint64 time_start = time(NULL);
-  for (int i = start; i < movie.size(); i++) {
-    if (i % 1000 == 0) {
-      printf("  [% 5.1f%%] %6d/%ld\n", 
-	     ((100.0 * i) / movie.size()), i, movie.size());
-      // exit(0);
+
+  // Movies that have been learned from before have their memories
+  // in a trace file; only replay the others.
+  vector<int> replay;
+  for (int m = 0; m < movies.size(); m++) {
+    const uint64 hash = RamTrace::MovieHash(movies[m]);
+    const string filename =
+      RamTrace::Filename(config.game, config.romchecksum, hash, starts[m]);
+    RamTrace *trace =
+      RamTrace::Open(filename, config.romchecksum, hash, starts[m]);
+    const int count = spans[m].second - spans[m].first;
+    if (trace != NULL && trace->Size() == count) {
+      trace->Read(0, count, &memories[spans[m].first]);
+      printf("Read %d memories from %s.\n", count, filename.c_str());
+    } else {
+      replay.push_back(m);
     }
-    Emulator::Step(movie[i]);
-    inputs.push_back(movie[i]);
-    SaveMemory(&memories);
+    delete trace;
+  }
+
+  #ifndef __MINGW32__
+  if (replay.size() > 1) {
+    ReplayInWorkers(movies, starts, spans, replay, &memories);
+  } else
+  #endif
+  {
+    // One at a time, rewinding to power-on between them.
+    for (int r = 0; r < replay.size(); r++) {
+      const int m = replay[r];
+      if (r > 0) Emulator::Load(&poweron);
+      ReplayMovie(movies[m], starts[m], &memories[spans[m].first], -1);
+    }
+  }
+
+  for (int r = 0; r < replay.size(); r++) {
+    const int m = replay[r];
+    const uint64 hash = RamTrace::MovieHash(movies[m]);
+    RamTrace::Write(RamTrace::Filename(config.game, config.romchecksum,
+				       hash, starts[m]),
+		    config.romchecksum, hash, starts[m],
+		    &memories[spans[m].first],
+		    spans[m].second - spans[m].first);
   }
   uint64 time_end = time(NULL);
 
@@ -166,10 +350,30 @@ int main(int argc, char *argv[]) {
          memories.size(),
          time_end - time_start);
 
-  MakeObjectives(config.game, memories);
+  MakeObjectives(config.game, memories, spans);
+
+  // Learn which inputs are interchangeable, so that playfun only
+  // tries one of each.
+  vector< vector<uint8> > samples;
+  for (int m = 0; m < movies.size(); m++) {
+    Emulator::Load(&poweron);
+    SampleStates(movies[m], starts[m],
+		 max(1, INPUT_CLASS_SAMPLES / (int)movies.size()), &samples);
+  }
+  InputClasses *classes = InputClasses::Learn(samples);
+  classes->SaveToFile(config.game + ".inputclasses");
+
   Motifs motifs;
-  motifs.AddInputs(inputs, config.fastforward);
-  motifs.SaveToFile((config.game+ ".motifs").c_str());
+  for (int m = 0; m < movies.size(); m++) {
+    // From the movie as played, since the classes are only a guess
+    // from a sample; playfun canonicalizes what it makes from them.
+    vector<uint8> inputs(movies[m].begin() + starts[m], movies[m].end());
+    if (inputs.size() > config.fastforward)
+      motifs.AddInputs(inputs, config.fastforward);
+  }
+  motifs.SaveBinary((config.game+ ".motifs").c_str());
+  motifs.SaveToFile((config.game+ ".motifs.txt").c_str());
+  delete classes;
 
   Emulator::Shutdown();
 
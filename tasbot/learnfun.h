@@ -3,6 +3,7 @@
 #define __LEARNFUN_H
 
 #include <map>
+#include <utility>
 #include <vector>
 
 #include <unistd.h>
@@ -10,11 +11,17 @@
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
+#ifndef __MINGW32__
+#include <pthread.h>
+#include <sys/wait.h>
+#endif
 
 #include "config.h"
 #include "emulator.h"
+#include "input-classes.h"
 #include "simplefm2.h"
 #include "objective.h"
+#include "ram-trace.h"
 #include "weighted-objectives.h"
 
 #ifdef MARIONET
@@ -22,20 +29,22 @@
 #include "netutil.h"
 #endif
 
-static void SaveMemory(vector< vector<uint8> > *memories);
+static void SaveMemory(vector<uint8> *mem);
 
 static void PrintAndSave(const vector<int> &ordering);
 
 // With e.g. an divisor of 3, generate slices covering
-// the first third, middle third, and last third.
-static void GenerateNthSlices(int divisor, int num, 
-			      const vector< vector<uint8> > &memories,
+// the first third, middle third, and last third of the span.
+static void GenerateNthSlices(int divisor, int num,
+			      const pair<int, int> &span,
 			      Objective *obj);
 
 static void GenerateOccasional(int stride, int offsets, int num,
-			       const vector< vector<uint8> > &memories,
+			       const pair<int, int> &span,
 			       Objective *obj);
 
-static void MakeObjectives(const string &game, const vector< vector<uint8> > &memories);
+static void MakeObjectives(const string &game,
+			   const vector< vector<uint8> > &memories,
+			   const vector< pair<int, int> > &spans);
 
 #endif
@@ -0,0 +1,101 @@
+
+#include "mapped-file.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifndef __MINGW32__
+#include <fcntl.h>
+#include <sys/mman.h>
+#endif
+
+#include "util.h"
+
+bool MappedFile::HasMagic(const string &filename, const char *magic) {
+  FILE *f = fopen(filename.c_str(), "rb");
+  if (f == NULL) return false;
+  const size_t len = strlen(magic);
+  string buf(len, '\0');
+  bool ok = (len == fread(&buf[0], 1, len, f) &&
+	     0 == memcmp(buf.data(), magic, len));
+  fclose(f);
+  return ok;
+}
+
+MappedFile::MappedFile(const string &filename) : data(NULL), length(0) {
+#ifdef __MINGW32__
+  // No mmap; just read the whole thing.
+  vector<uint8> bytes = Util::ReadFileBytes(filename);
+  length = bytes.size();
+  data = malloc(length + 1);
+  CHECK(data != NULL);
+  if (length > 0) memcpy(data, &bytes[0], length);
+#else
+  int fd = open(filename.c_str(), O_RDONLY);
+  if (fd < 0) {
+    fprintf(stderr, "Couldn't open %s\n", filename.c_str());
+    abort();
+  }
+  struct stat st;
+  CHECK(0 == fstat(fd, &st));
+  length = st.st_size;
+  if (length > 0) {
+    data = mmap(NULL, length, PROT_READ, MAP_SHARED, fd, 0);
+    if (data == MAP_FAILED) {
+      fprintf(stderr, "Couldn't map %s\n", filename.c_str());
+      abort();
+    }
+  }
+  close(fd);
+#endif
+}
+
+MappedFile::~MappedFile() {
+#ifdef __MINGW32__
+  free(data);
+#else
+  if (data != NULL) munmap(data, length);
+#endif
+}
+
+bool WeightedPool::Write(const string &filename, const char *magic,
+			 const vector<Entry> &entries, const string &pool) {
+  Header header;
+  memset(&header, 0, sizeof (Header));
+  CHECK(strlen(magic) <= sizeof header.magic);
+  memcpy(header.magic, magic, strlen(magic));
+  header.count = entries.size();
+  header.poolsize = pool.size();
+
+  string out((const char *)&header, sizeof (Header));
+  if (!entries.empty()) {
+    out.append((const char *)&entries[0], entries.size() * sizeof (Entry));
+  }
+  out += pool;
+  return Util::WriteFile(filename, out);
+}
+
+void WeightedPool::Read(const MappedFile &file, const char *magic,
+			const Entry **entries, uint32 *count,
+			const uint8 **pool) {
+  const Header *header = (const Header *)file.Data();
+  CHECK(file.Size() >= sizeof (Header));
+  CHECK(0 == memcmp(header->magic, magic, strlen(magic)));
+  const size_t expected = sizeof (Header) +
+    header->count * sizeof (Entry) + header->poolsize;
+  if (file.Size() != expected) {
+    fprintf(stderr, "Binary file has %zu bytes, but expected %zu.\n",
+	    file.Size(), expected);
+    abort();
+  }
+  *count = header->count;
+  *entries = (const Entry *)(file.Data() + sizeof (Header));
+  *pool = file.Data() + sizeof (Header) + header->count * sizeof (Entry);
+  for (uint32 i = 0; i < *count; i++) {
+    CHECK((uint64)(*entries)[i].offset + (*entries)[i].length <=
+	  header->poolsize);
+  }
+}
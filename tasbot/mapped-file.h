@@ -0,0 +1,61 @@
+/* A whole file, memory-mapped read-only. Processes that map the
+   same file share its pages through the page cache. */
+
+#ifndef __MAPPED_FILE_H
+#define __MAPPED_FILE_H
+
+#include <string>
+#include <vector>
+
+#include "fceu/types.h"
+#include "tasbot.h"
+
+using namespace std;
+
+struct MappedFile {
+  // Aborts if the file can't be read.
+  explicit MappedFile(const string &filename);
+  ~MappedFile();
+
+  // Does the file exist and start with these bytes?
+  static bool HasMagic(const string &filename, const char *magic);
+
+  // Valid as long as this object is. NULL if the file is empty.
+  const uint8 *Data() const { return (const uint8 *)data; }
+  size_t Size() const { return length; }
+
+ private:
+  void *data;
+  size_t length;
+
+  NOT_COPYABLE(MappedFile);
+};
+
+// Binary layout shared by the objectives and motifs files: a
+// header, a flat array of entries, then a pool of the elements
+// (locations or inputs) that the entries point into. Native byte
+// order, so it's meant for the machine that wrote it.
+struct WeightedPool {
+  struct Header {
+    char magic[16];
+    uint32 count;
+    uint32 poolsize;
+  };
+  struct Entry {
+    // In bytes, within the pool.
+    uint32 offset;
+    uint32 length;
+    double weight;
+  };
+
+  // Returns false if the file couldn't be written.
+  static bool Write(const string &filename, const char *magic,
+                    const vector<Entry> &entries, const string &pool);
+
+  // Points into the file. Aborts if it's malformed.
+  static void Read(const MappedFile &file, const char *magic,
+                   const Entry **entries, uint32 *count,
+                   const uint8 **pool);
+};
+
+#endif
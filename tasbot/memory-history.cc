@@ -0,0 +1,65 @@
+
+#include "memory-history.h"
+
+MemoryHistory::MemoryHistory(int num_recent, int num_older)
+  : num_recent(num_recent), num_older(num_older), stride(1), evicted(0) {
+  CHECK(num_recent > 0);
+  CHECK(num_older > 1);
+}
+
+void MemoryHistory::Add(size_t movenum, const vector<uint8> &mem) {
+  const deque<Entry> &last = recent.empty() ? older : recent;
+  CHECK(last.empty() || last.back().movenum < movenum);
+  recent.push_back(Entry(movenum, mem));
+  if (recent.size() <= num_recent)
+    return;
+
+  if (evicted % stride == 0) {
+    older.push_back(recent.front());
+  }
+  evicted++;
+  recent.pop_front();
+
+  if (older.size() > num_older) {
+    // Keep every other one, starting with the oldest.
+    deque<Entry> thinned;
+    for (int i = 0; i < older.size(); i += 2) {
+      thinned.push_back(older[i]);
+    }
+    older.swap(thinned);
+    stride *= 2;
+  }
+}
+
+void MemoryHistory::Truncate(size_t movenum) {
+  while (!recent.empty() && recent.back().movenum > movenum) {
+    recent.pop_back();
+  }
+  if (recent.empty()) {
+    while (!older.empty() && older.back().movenum > movenum) {
+      older.pop_back();
+    }
+  }
+}
+
+void MemoryHistory::GetAll(vector<size_t> *movenums,
+			   vector< vector<uint8> > *mems) const {
+  movenums->clear();
+  mems->clear();
+  movenums->reserve(Size());
+  mems->reserve(Size());
+  for (deque<Entry>::const_iterator it = older.begin();
+       it != older.end(); ++it) {
+    movenums->push_back(it->movenum);
+    mems->push_back(it->mem);
+  }
+  for (deque<Entry>::const_iterator it = recent.begin();
+       it != recent.end(); ++it) {
+    movenums->push_back(it->movenum);
+    mems->push_back(it->mem);
+  }
+}
+
+size_t MemoryHistory::Size() const {
+  return older.size() + recent.size();
+}
@@ -0,0 +1,52 @@
+/* A bounded history of RAM snapshots along the current path, for
+   drawing. Recent snapshots are kept at full resolution. Older ones
+   are thinned out by half whenever there are too many, so the history
+   always spans the whole run but takes a fixed amount of memory. */
+
+#ifndef __MEMORY_HISTORY_H
+#define __MEMORY_HISTORY_H
+
+#include <deque>
+#include <vector>
+
+#include "fceu/types.h"
+#include "tasbot.h"
+
+using namespace std;
+
+struct MemoryHistory {
+  // Keeps up to num_recent snapshots at full resolution, preceded
+  // by up to num_older thinned-out ones.
+  MemoryHistory(int num_recent, int num_older);
+
+  // movenum must be greater than in any call since the last
+  // Truncate.
+  void Add(size_t movenum, const vector<uint8> &mem);
+
+  // Forget everything after movenum, e.g. when backtracking.
+  void Truncate(size_t movenum);
+
+  // Oldest first, as parallel arrays.
+  void GetAll(vector<size_t> *movenums,
+              vector< vector<uint8> > *mems) const;
+
+  size_t Size() const;
+
+ private:
+  struct Entry {
+    Entry(size_t movenum, const vector<uint8> &mem)
+      : movenum(movenum), mem(mem) {}
+    size_t movenum;
+    vector<uint8> mem;
+  };
+
+  const int num_recent, num_older;
+  deque<Entry> recent, older;
+  // Of the entries that fall out of recent, one in every stride
+  // is kept in older. Doubles every time older is thinned.
+  int stride;
+  // Number that have fallen out of recent so far.
+  uint64 evicted;
+};
+
+#endif
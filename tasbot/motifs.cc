@@ -1,6 +1,8 @@
 
 #include "motifs.h"
 
+#include "input-classes.h"
+
 // Cheat by masking inputs to reduce search tree width
 // #define INPUTMASK (~(INPUT_T | INPUT_S))
 #define INPUTMASK 0xFF
@@ -37,7 +39,31 @@ void Motifs::Checkpoint(int framenum) {
   }
 }
 
+Motifs *Motifs::LoadBinary(const string &filename) {
+  MappedFile file(filename);
+  const WeightedPool::Entry *entries;
+  uint32 count;
+  const uint8 *pool;
+  WeightedPool::Read(file, MOTIFS_MAGIC, &entries, &count, &pool);
+
+  Motifs *mm = new Motifs;
+  for (uint32 i = 0; i < count; i++) {
+    vector<uint8> inputs(pool + entries[i].offset,
+			 pool + entries[i].offset + entries[i].length);
+    for (int j = 0; j < inputs.size(); j++) {
+      inputs[j] &= INPUTMASK;
+    }
+    mm->motifs.insert(make_pair(inputs, Info(entries[i].weight)));
+  }
+  printf("Read %zu motifs from %s.\n", mm->motifs.size(), filename.c_str());
+  return mm;
+}
+
 Motifs *Motifs::LoadFromFile(const string &filename) {
+  if (MappedFile::HasMagic(filename, MOTIFS_MAGIC)) {
+    return LoadBinary(filename);
+  }
+
   Motifs *mm = new Motifs;
   vector<string> lines = Util::ReadFileToLines(filename);
   for (int i = 0; i < lines.size(); i++) {
@@ -74,6 +100,28 @@ void Motifs::SaveToFile(const string &filename) const {
   }
 }
 
+void Motifs::SaveBinary(const string &filename) const {
+  vector<WeightedPool::Entry> entries;
+  string pool;
+  for (Weighted::const_iterator it = motifs.begin();
+       it != motifs.end(); ++it) {
+    const vector<uint8> &inputs = it->first;
+    WeightedPool::Entry entry;
+    entry.offset = pool.size();
+    entry.length = inputs.size();
+    entry.weight = it->second.weight;
+    entries.push_back(entry);
+    if (!inputs.empty())
+      pool.append((const char *)&inputs[0], inputs.size());
+  }
+  if (!WeightedPool::Write(filename, MOTIFS_MAGIC, entries, pool)) {
+    printf("Failed writing %zu motifs to %s.\n",
+	   motifs.size(), filename.c_str());
+  } else {
+    printf("Wrote %zu motifs to %s.\n", motifs.size(), filename.c_str());
+  }
+}
+
 void Motifs::AddInputs(const vector<uint8> &inputs, const size_t &fastforward) {
   vector<uint8> current;
   for (vector<uint8>::const_iterator it = inputs.begin() + fastforward;
@@ -86,6 +134,17 @@ void Motifs::AddInputs(const vector<uint8> &inputs, const size_t &fastforward) {
   }
 }
 
+void Motifs::Canonicalize(const InputClasses &classes) {
+  Weighted canon;
+  for (Weighted::const_iterator it = motifs.begin();
+       it != motifs.end(); ++it) {
+    vector<uint8> inputs = it->first;
+    classes.Canonicalize(&inputs);
+    canon[inputs].weight += it->second.weight;
+  }
+  motifs.swap(canon);
+}
+
 vector< vector<uint8> > Motifs::AllMotifs() const {
   vector< vector<uint8> > motifvec;
   for (Weighted::const_iterator it = motifs.begin();
@@ -9,6 +9,7 @@
 #include <sstream>
 #include <vector>
 
+#include "mapped-file.h"
 #include "motifs-style.h"
 #include "simplefm2.h"
 #include "tasbot.h"
@@ -17,17 +18,29 @@
 // Right now, segment into 10-input chunks.
 static const int MOTIF_SIZE = 10;
 
+#define MOTIFS_MAGIC "tasbot-motifs-1\n"
+
+struct InputClasses;
+
 struct Motifs {
   // Create empty.
   Motifs();
 
+  // Reads either the text or the binary format; binary files are
+  // mapped rather than parsed.
   static Motifs *LoadFromFile(const std::string &filename);
 
-  // Does not save checkpoints.
+  // Does not save checkpoints. Text, one motif per line.
   void SaveToFile(const std::string &filename) const;
+  // Same, in the binary format: a WeightedPool of input bytes.
+  void SaveBinary(const std::string &filename) const;
 
   void AddInputs(const vector<uint8> &inputs, const size_t &fastforward);
 
+  // Replaces each input with its canonical one. Motifs that become
+  // the same are merged, adding their weights.
+  void Canonicalize(const InputClasses &classes);
+
   // Returns a motif uniformly at random.
   // Linear time.
   const vector<uint8> &RandomMotif();
@@ -77,6 +90,8 @@ private:
     vector< pair<int, double> > history;
   };
 
+  static Motifs *LoadBinary(const std::string &filename);
+
   struct Resorted;
   static bool WeightDescending(const Resorted &a, const Resorted &b);
 
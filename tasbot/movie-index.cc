@@ -0,0 +1,140 @@
+
+#include "movie-index.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../cc-lib/base/stringprintf.h"
+#include "ram-trace.h"
+
+// Header of the index file. Then each keyframe follows as its
+// length (uint32) and bytes. The first keyframe is power-on, saved
+// with Emulator::Save; the rest are saved with SaveEx against it.
+struct IndexHeader {
+  char magic[16];
+  uint8 romchecksum[16];
+  uint64 moviehash;
+  uint64 frames;
+  uint64 every;
+  uint64 keyframes;
+};
+
+static void MakeHeader(const MD5DATA &romchecksum,
+		       const vector<uint8> &movie, int every,
+		       IndexHeader *header) {
+  memset(header, 0, sizeof (IndexHeader));
+  memcpy(header->magic, MOVIE_INDEX_MAGIC, strlen(MOVIE_INDEX_MAGIC));
+  memcpy(header->romchecksum, romchecksum.data, MD5DATA::size);
+  header->moviehash = RamTrace::MovieHash(movie);
+  header->frames = movie.size();
+  header->every = every;
+  header->keyframes = movie.size() / every + 1;
+}
+
+MovieIndex::MovieIndex(const vector<uint8> &movie, int every)
+  : movie(movie), every(every) {
+  CHECK(every > 0);
+}
+
+string MovieIndex::IndexFile(const string &moviefile) {
+  return moviefile + ".seek";
+}
+
+MovieIndex *MovieIndex::LoadOrCompute(const vector<uint8> &movie,
+				      const MD5DATA &romchecksum,
+				      const string &indexfile,
+				      int every) {
+  MovieIndex *index = new MovieIndex(movie, every);
+  if (index->Read(indexfile, romchecksum)) {
+    fprintf(stderr, "Loaded movie index %s.\n", indexfile.c_str());
+    index->Seek(0);
+    return index;
+  }
+
+  fprintf(stderr, "Computing movie index %s.\n", indexfile.c_str());
+  index->keyframes.resize(movie.size() / every + 1);
+  Emulator::Save(&index->keyframes[0]);
+  Emulator::GetBasis(&index->basis);
+  for (size_t i = 0; i < movie.size(); i++) {
+    Emulator::Step(movie[i]);
+    if ((i + 1) % every == 0) {
+      Emulator::SaveEx(&index->keyframes[(i + 1) / every], &index->basis);
+    }
+  }
+  index->Write(indexfile, romchecksum);
+  index->Seek(0);
+  return index;
+}
+
+void MovieIndex::Seek(size_t frame) {
+  CHECK(frame <= movie.size());
+  const size_t key = frame / every;
+  if (key == 0) {
+    Emulator::Load(&keyframes[0]);
+  } else {
+    Emulator::LoadEx(&keyframes[key], &basis);
+  }
+  for (size_t i = key * every; i < frame; i++) {
+    Emulator::Step(movie[i]);
+  }
+}
+
+bool MovieIndex::Read(const string &indexfile, const MD5DATA &romchecksum) {
+  FILE *f = fopen(indexfile.c_str(), "rb");
+  if (f == NULL) return false;
+
+  IndexHeader header, expected;
+  MakeHeader(romchecksum, movie, every, &expected);
+  if (1 != fread(&header, sizeof (IndexHeader), 1, f) ||
+      0 != memcmp(&header, &expected, sizeof (IndexHeader))) {
+    fclose(f);
+    return false;
+  }
+
+  keyframes.resize(header.keyframes);
+  for (int i = 0; i < keyframes.size(); i++) {
+    uint32 len = 0;
+    if (1 != fread(&len, sizeof (uint32), 1, f)) {
+      fclose(f);
+      return false;
+    }
+    keyframes[i].resize(len);
+    if (len != fread(&keyframes[i][0], 1, len, f)) {
+      fclose(f);
+      return false;
+    }
+  }
+  fclose(f);
+
+  // The basis is the power-on state, uncompressed.
+  Emulator::Load(&keyframes[0]);
+  Emulator::GetBasis(&basis);
+  return true;
+}
+
+void MovieIndex::Write(const string &indexfile,
+		       const MD5DATA &romchecksum) const {
+  // Several processes (e.g. playfun helpers) may build the same
+  // index at once, so write it elsewhere and then rename it.
+  const string tmpfile = StringPrintf("%s.%d.tmp", indexfile.c_str(),
+				      (int)getpid());
+  FILE *f = fopen(tmpfile.c_str(), "wb");
+  if (f == NULL) {
+    fprintf(stderr, "Couldn't write movie index %s.\n", indexfile.c_str());
+    return;
+  }
+  IndexHeader header;
+  MakeHeader(romchecksum, movie, every, &header);
+  CHECK(1 == fwrite(&header, sizeof (IndexHeader), 1, f));
+  for (int i = 0; i < keyframes.size(); i++) {
+    uint32 len = keyframes[i].size();
+    CHECK(1 == fwrite(&len, sizeof (uint32), 1, f));
+    CHECK(len == fwrite(&keyframes[i][0], 1, len, f));
+  }
+  fclose(f);
+  if (0 != rename(tmpfile.c_str(), indexfile.c_str())) {
+    fprintf(stderr, "Couldn't rename %s.\n", tmpfile.c_str());
+    remove(tmpfile.c_str());
+  }
+}
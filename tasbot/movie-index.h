@@ -0,0 +1,57 @@
+/* Random access into a movie. The index keeps a savestate every
+   few frames, so getting to any frame of the movie takes at most
+   that many emulator steps rather than a replay from power-on.
+
+   Keyframes are encoded with Emulator::SaveEx against the power-on
+   state, so each one is small and can be loaded on its own. The
+   index is written to a sidecar file and reused as long as the ROM
+   and movie match. */
+
+#ifndef __MOVIE_INDEX_H
+#define __MOVIE_INDEX_H
+
+#include <string>
+#include <vector>
+
+#include "fceu/types.h"
+#include "tasbot.h"
+
+using namespace std;
+
+#define MOVIE_INDEX_MAGIC "tasbot-seek-1\n"
+// Default keyframe spacing, in frames.
+#define MOVIE_INDEX_EVERY 100
+
+struct MovieIndex {
+  // The emulator must be initialized and at power-on. Reads the
+  // index from indexfile if it's for this ROM and movie, or else
+  // replays the movie to build it and writes it there. Either way
+  // the emulator is left at power-on.
+  static MovieIndex *LoadOrCompute(const vector<uint8> &movie,
+                                   const MD5DATA &romchecksum,
+                                   const string &indexfile,
+                                   int every = MOVIE_INDEX_EVERY);
+
+  // Puts the emulator in the state after the first frame inputs
+  // of the movie have been played; 0 is power-on.
+  void Seek(size_t frame);
+
+  // The usual place for a movie's index.
+  static string IndexFile(const string &moviefile);
+
+ private:
+  MovieIndex(const vector<uint8> &movie, int every);
+  bool Read(const string &indexfile, const MD5DATA &romchecksum);
+  void Write(const string &indexfile, const MD5DATA &romchecksum) const;
+
+  const vector<uint8> movie;
+  const int every;
+  // Uncompressed power-on state; the basis for keyframes.
+  vector<uint8> basis;
+  // keyframes[i] is the state after every * i frames.
+  vector< vector<uint8> > keyframes;
+
+  NOT_COPYABLE(MovieIndex);
+};
+
+#endif
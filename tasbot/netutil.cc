@@ -1,6 +1,18 @@
 
 #include "netutil.h"
 
+#include <map>
+#ifndef __MINGW32__
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
 using namespace std;
 
 string IPString(const IPaddress &ip) {
@@ -34,7 +46,9 @@ TCPsocket ConnectLocal(int port) {
   return tcpsock;
 }
 
-void BlockOnSocket(TCPsocket sock) {
+// Returns whether sock became ready within timeout milliseconds.
+// With a timeout of -1, waits until it does.
+static bool WaitOnSocket(TCPsocket sock, Uint32 timeout) {
   SDLNet_SocketSet sockset = SDLNet_AllocSocketSet(1);
   if (!sockset) {
     fprintf(stderr, "SDLNet_AllocSocketSet: %s\n", SDLNet_GetError());
@@ -43,8 +57,9 @@ void BlockOnSocket(TCPsocket sock) {
 
   CHECK(-1 != SDLNet_TCP_AddSocket(sockset, sock));
 
+  bool ready = false;
   for (;;) {
-    int numready = SDLNet_CheckSockets(sockset, -1);
+    int numready = SDLNet_CheckSockets(sockset, timeout);
     if (numready == -1) {
       fprintf(stderr, "SDLNet_CheckSockets: %s\n", SDLNet_GetError());
       perror("SDLNet_CheckSockets");
@@ -52,17 +67,27 @@ void BlockOnSocket(TCPsocket sock) {
     }
 
     if (numready > 0) {
+      // Just one socket in the set, so it should be ready.
+      CHECK(SDLNet_SocketReady(sock));
+      ready = true;
       break;
     }
-  }
 
-  // Just one socket in the set, so it should be ready.
-  CHECK(SDLNet_SocketReady(sock));
+    if (timeout != (Uint32)-1) {
+      break;
+    }
+  }
 
   SDLNet_FreeSocketSet(sockset);
+  return ready;
 }
 
-SingleServer::SingleServer(int port) : port_(port), state_(LISTENING) {
+void BlockOnSocket(TCPsocket sock) {
+  WaitOnSocket(sock, (Uint32)-1);
+}
+
+SingleServer::SingleServer(int port) : port_(port), state_(LISTENING),
+                                       peer_shared_(false), next_parked_(0) {
   peer_ = NULL;
   if (SDLNet_ResolveHost(&localhost_, NULL, port_) == -1) {
     fprintf(stderr, "SDLNet_ResolveHost: %s\n", SDLNet_GetError());
@@ -74,6 +99,10 @@ SingleServer::SingleServer(int port) : port_(port), state_(LISTENING) {
     fprintf(stderr, "SDLNet_TCP_Open: %s\n", SDLNet_GetError());
     abort();
   }
+
+  // Only once the port is ours, since this replaces the area of
+  // any helper that had it before.
+  shared_ = SharedArea::Create(port);
 }
 
 void SingleServer::Listen() {
@@ -81,22 +110,57 @@ void SingleServer::Listen() {
 
   for (;;) {
     BlockOnSocket(server_);
-    if ((peer_ = SDLNet_TCP_Accept(server_))) {
-      IPaddress *peer_ip_ptr = SDLNet_TCP_GetPeerAddress(peer_);
-      if (peer_ip_ptr == NULL) {
-        printf("SDLNet_TCP_GetPeerAddress: %s\n", SDLNet_GetError());
-        abort();
-      }
+    if (Accept()) return;
+
+    fprintf(stderr, "Socket was ready but couldn't accept?\n");
+    SDL_Delay(1000);
+  }
+}
 
-      peer_ip_ = *peer_ip_ptr;
+bool SingleServer::TryListen() {
+  CHECK(state_ == LISTENING);
+  return WaitOnSocket(server_, 0) && Accept();
+}
 
-      state_ = ACTIVE;
-      return;
+bool SingleServer::Accept() {
+  if ((peer_ = SDLNet_TCP_Accept(server_))) {
+    IPaddress *peer_ip_ptr = SDLNet_TCP_GetPeerAddress(peer_);
+    if (peer_ip_ptr == NULL) {
+      printf("SDLNet_TCP_GetPeerAddress: %s\n", SDLNet_GetError());
+      abort();
     }
 
-    fprintf(stderr, "Socket was ready but couldn't accept?\n");
-    SDL_Delay(1000);
+    peer_ip_ = *peer_ip_ptr;
+
+    state_ = ACTIVE;
+    return true;
   }
+  return false;
+}
+
+int SingleServer::Park() {
+  CHECK(state_ == ACTIVE);
+  const int handle = next_parked_++;
+  Parked &parked = parked_[handle];
+  parked.peer = peer_;
+  parked.peer_ip = peer_ip_;
+  parked.peer_shared = peer_shared_;
+
+  peer_ = NULL;
+  peer_shared_ = false;
+  state_ = LISTENING;
+  return handle;
+}
+
+void SingleServer::Resume(int handle) {
+  CHECK(state_ == LISTENING);
+  map<int, Parked>::iterator it = parked_.find(handle);
+  CHECK(it != parked_.end());
+  peer_ = it->second.peer;
+  peer_ip_ = it->second.peer_ip;
+  peer_shared_ = it->second.peer_shared;
+  parked_.erase(it);
+  state_ = ACTIVE;
 }
 
 string SingleServer::PeerString() {
@@ -104,11 +168,16 @@ string SingleServer::PeerString() {
   return IPString(peer_ip_);
 }
 
+uint64 SingleServer::SharedAreaId() const {
+  return shared_ == NULL ? 0 : shared_->Id();
+}
+
 void SingleServer::Hangup() {
   if (state_ == ACTIVE) {
     SDLNet_TCP_Close(peer_);
     peer_ = NULL;
   }
+  peer_shared_ = false;
 
   state_ = LISTENING;
 }
@@ -118,7 +187,265 @@ bool RecvErrorRetry() {
   return false;
 }
 
-RequestCache::RequestCache(int size) : size(size), num(0) {}
+RequestCache::RequestCache(size_t maxbytes)
+  : maxbytes(maxbytes), bytes(0), lookups(0), hits(0) {}
+
+RequestCache::~RequestCache() {
+  for (list<Entry>::iterator it = recent.begin(); it != recent.end(); ++it) {
+    delete it->response;
+  }
+}
+
+const RequestCache::Message *RequestCache::Lookup(const Key &key) {
+  lookups++;
+  map<Key, list<Entry>::iterator>::iterator it = index.find(key);
+  if (it == index.end()) return NULL;
+
+  hits++;
+  // Now the most recently used.
+  recent.splice(recent.begin(), recent, it->second);
+  return it->second->response;
+}
+
+void RequestCache::Insert(const Key &key, Message *response, size_t size) {
+  map<Key, list<Entry>::iterator>::iterator it = index.find(key);
+  if (it != index.end()) {
+    bytes -= it->second->size;
+    delete it->second->response;
+    recent.erase(it->second);
+    index.erase(it);
+  }
+
+  Entry entry;
+  entry.key = key;
+  entry.response = response;
+  entry.size = size;
+  recent.push_front(entry);
+  index[key] = recent.begin();
+  bytes += size;
+
+  // Always keep the newest, even if it's too big by itself.
+  while (bytes > maxbytes && recent.size() > 1) {
+    const Entry &old = recent.back();
+    bytes -= old.size;
+    index.erase(old.key);
+    delete old.response;
+    recent.pop_back();
+  }
+}
+
+#ifndef __MINGW32__
+static string SharedAreaName(int port) {
+  return StringPrintf("/tasbot-marionet-%d", port);
+}
+#endif
+
+// Maps the shared area for the port, or returns NULL. If create,
+// it must not exist yet. Sets id to its inode number, which no
+// other area can have while we have it open. If fd is non-NULL,
+// it's left open and returned there.
+static uint8 *MapSharedArea(int port, bool create, int *fd, uint64 *id) {
+#ifdef __MINGW32__
+  return NULL;
+#else
+  const string name = SharedAreaName(port);
+  const size_t size = 2 * SHARED_AREA_SIZE;
+  int f = shm_open(name.c_str(),
+                   create ? (O_RDWR | O_CREAT | O_EXCL) : O_RDWR, 0600);
+  if (f < 0) return NULL;
+
+  struct stat st;
+  if ((create && 0 != ftruncate(f, size)) ||
+      0 != fstat(f, &st) || st.st_size < size) {
+    close(f);
+    return NULL;
+  }
+
+  void *data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, f, 0);
+  if (data == MAP_FAILED) {
+    close(f);
+    return NULL;
+  }
+  *id = st.st_ino;
+  if (fd != NULL) *fd = f;
+  else close(f);
+  return (uint8 *)data;
+#endif
+}
+
+#ifndef __MINGW32__
+// The helper's area, removed on the way out. A fixed buffer, since
+// the signal handler can't allocate.
+static char created_area[64];
+
+static void RemoveCreatedArea() {
+  shm_unlink(created_area);
+}
+
+static void RemoveCreatedAreaAndDie(int sig) {
+  RemoveCreatedArea();
+  signal(sig, SIG_DFL);
+  raise(sig);
+}
+#endif
+
+SharedArea *SharedArea::Create(int port) {
+#ifndef __MINGW32__
+  // One left by an earlier helper on this port is no use to anyone.
+  const string name = SharedAreaName(port);
+  shm_unlink(name.c_str());
+#endif
+  uint64 id = 0;
+  uint8 *data = MapSharedArea(port, true, NULL, &id);
+  if (data == NULL) {
+    fprintf(stderr, "No shared memory for port %d; using TCP only.\n", port);
+    return NULL;
+  }
+#ifndef __MINGW32__
+  CHECK(created_area[0] == 0 && name.size() < sizeof (created_area));
+  strcpy(created_area, name.c_str());
+  atexit(RemoveCreatedArea);
+  signal(SIGINT, RemoveCreatedAreaAndDie);
+  signal(SIGTERM, RemoveCreatedAreaAndDie);
+  signal(SIGHUP, RemoveCreatedAreaAndDie);
+  signal(SIGABRT, RemoveCreatedAreaAndDie);
+#endif
+  return new SharedArea(data, -1, id);
+}
+
+#ifndef __MINGW32__
+// The master's areas, by port. GetAnswers can run in several threads.
+static pthread_mutex_t shared_areas_mutex = PTHREAD_MUTEX_INITIALIZER;
+static map<int, SharedArea *> shared_areas;
+// What each helper last said its area was.
+static map<int, uint64> offered_areas;
+#endif
+
+void SharedArea::Offered(int port, uint64 id) {
+#ifndef __MINGW32__
+  pthread_mutex_lock(&shared_areas_mutex);
+  offered_areas[port] = id;
+  pthread_mutex_unlock(&shared_areas_mutex);
+#endif
+}
+
+void SharedArea::Unmap() {
+#ifndef __MINGW32__
+  CHECK(!busy_);
+  munmap(data_, 2 * SHARED_AREA_SIZE);
+  close(fd_);
+#endif
+}
+
+SharedArea *SharedArea::Acquire(int port) {
+#ifdef __MINGW32__
+  return NULL;
+#else
+  pthread_mutex_lock(&shared_areas_mutex);
+  map<int, uint64>::const_iterator offered = offered_areas.find(port);
+  const uint64 id = offered == offered_areas.end() ? 0 : offered->second;
+
+  SharedArea *area = NULL;
+  map<int, SharedArea *>::iterator it = shared_areas.find(port);
+  if (it != shared_areas.end()) {
+    area = it->second;
+    // The helper has started over with a new area since we mapped
+    // this one. Drop it, unless another thread is still using it.
+    if (id != 0 && area->id_ != id && !area->busy_) {
+      area->Unmap();
+      delete area;
+      shared_areas.erase(it);
+      area = NULL;
+    }
+  }
+  if (area == NULL && id != 0) {
+    int fd = -1;
+    uint64 mapped = 0;
+    if (uint8 *data = MapSharedArea(port, false, &fd, &mapped)) {
+      area = new SharedArea(data, fd, mapped);
+      shared_areas[port] = area;
+    }
+  }
+
+  if (area != NULL) {
+    // The lock is dropped if the holder dies, so a crashed master
+    // doesn't take the area with it.
+    if (area->id_ != id || area->busy_ ||
+        0 != flock(area->fd_, LOCK_EX | LOCK_NB)) area = NULL;
+    else area->busy_ = true;
+  }
+  pthread_mutex_unlock(&shared_areas_mutex);
+  return area;
+#endif
+}
+
+void SharedArea::Release() {
+#ifndef __MINGW32__
+  pthread_mutex_lock(&shared_areas_mutex);
+  CHECK(busy_);
+  CHECK(0 == flock(fd_, LOCK_UN));
+  busy_ = false;
+  pthread_mutex_unlock(&shared_areas_mutex);
+#endif
+}
+
+ObservationLog::ObservationLog() : first(0) {
+  CHECK(0 == pthread_mutex_init(&mutex, NULL));
+}
+
+ObservationLog::~ObservationLog() {
+  pthread_mutex_destroy(&mutex);
+}
+
+void ObservationLog::SetHelpers(const vector<int> &ports) {
+  pthread_mutex_lock(&mutex);
+  for (int i = 0; i < ports.size(); i++) {
+    // Keeps what's already known.
+    acknowledged[ports[i]];
+  }
+  pthread_mutex_unlock(&mutex);
+}
+
+void ObservationLog::Add(const string &compact) {
+  pthread_mutex_lock(&mutex);
+  log.push_back(compact);
+  pthread_mutex_unlock(&mutex);
+}
+
+bool ObservationLog::Get(int port, ObservationsProto *obs) {
+  pthread_mutex_lock(&mutex);
+  // A helper that has somehow lost some that were forgotten (it
+  // restarted, say) gets what there is, and will complain.
+  const int64 from = max(first, acknowledged[port]);
+  const int64 end = first + (int64)log.size();
+  if (from < end) {
+    obs->set_first(from);
+    for (int64 i = from; i < end; i++) {
+      obs->add_memories(log[i - first]);
+    }
+  }
+  pthread_mutex_unlock(&mutex);
+  return from < end;
+}
+
+void ObservationLog::Acknowledge(int port, int64 observations) {
+  pthread_mutex_lock(&mutex);
+  // Responses from a helper's cache may be older than ones it has
+  // already sent.
+  int64 &acked = acknowledged[port];
+  acked = max(acked, observations);
+
+  int64 all = acked;
+  for (map<int, int64>::const_iterator it = acknowledged.begin();
+       it != acknowledged.end(); ++it) {
+    all = min(all, it->second);
+  }
+  while (first < all && !log.empty()) {
+    log.pop_front();
+    first++;
+  }
+  pthread_mutex_unlock(&mutex);
+}
 
 extern int sdlnet_recvall(TCPsocket sock, void *buffer, int len) {
   int alreadyread = 0;
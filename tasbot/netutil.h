@@ -4,6 +4,10 @@
 
 #include <vector>
 #include <string>
+#include <list>
+#include <map>
+#include <deque>
+#include <pthread.h>
 
 #include "SDL.h"
 #include "SDL_net.h"
@@ -16,9 +20,14 @@
 #include "util.h"
 #include "errno.h"
 
-// You can change this, but it must be less than 2^32 since
-// we only send 4 bytes.
+// You can change this, but it must be less than 2^31 since
+// we only send 4 bytes, and the top bit is SHARED_MESSAGE.
 #define MAX_MESSAGE (1<<30)
+// Set in the length header when the message is in the SharedArea
+// rather than following on the socket.
+#define SHARED_MESSAGE 0x80000000
+// Size of each of the request and response halves of a SharedArea.
+#define SHARED_AREA_SIZE (16<<20)
 
 #if !MARIONET
 #error You should only include net utils when MARIONET is defined.
@@ -46,17 +55,71 @@ extern bool RecvErrorRetry();
 // SDL_Net, at least on win32.
 extern int sdlnet_recvall(TCPsocket sock, void *buffer, int len);
 
-// Blocks until the entire proto can be read.
+// Memory shared by a helper and the master on the same host, named
+// after the helper's port. Protos are serialized straight into it
+// and only the length goes over the socket, so savestates aren't
+// copied through the kernel. A request and its response have it to
+// themselves; anything else sent to the helper meanwhile, or that
+// doesn't fit, goes over the socket as usual.
+//
+// The master only uses an area once the helper on that port has
+// said (in HelperStats::shared_area) that it's the helper's, so a
+// segment left by some earlier helper is never mistaken for it.
+struct SharedArea {
+  // For helpers. Creates a new area for the port, replacing any
+  // left from before, or returns NULL. The area is removed when
+  // the process exits or is killed.
+  static SharedArea *Create(int port);
+
+  // For the master. Notes the Id that the helper on port gave for
+  // its area, or 0 if it has none.
+  static void Offered(int port, uint64 id);
+
+  // For the master. Returns the area of the helper on port, or NULL
+  // if it hasn't offered one, it's already in use (by this process
+  // or another master), or it isn't the one offered. Release it
+  // after reading the response.
+  static SharedArea *Acquire(int port);
+  void Release();
+
+  // Distinguishes this area from any other that has had the same
+  // name. Never 0.
+  uint64 Id() const { return id_; }
+
+  uint8 *Request() { return data_; }
+  uint8 *Response() { return data_ + SHARED_AREA_SIZE; }
+
+ private:
+  SharedArea(uint8 *data, int fd, uint64 id)
+    : data_(data), fd_(fd), id_(id), busy_(false) {}
+  void Unmap();
+  // Mapped until the master finds that the helper has a new area,
+  // or for the life of the process.
+  uint8 *data_;
+  // For the master, the open area, which is locked while it's busy
+  // so that other masters on the host keep out. Otherwise -1.
+  int fd_;
+  uint64 id_;
+  bool busy_;
+};
+
+// Blocks until the entire proto can be read. If shared is non-NULL,
+// the peer may have put the message there. If shared_used is non-NULL,
+// it's set to whether it did.
 // If this returns false, you probably want to close the socket.
 template <class T>
-bool ReadProto(TCPsocket sock, T *t);
+bool ReadProto(TCPsocket sock, T *t, const uint8 *shared = NULL,
+               bool *shared_used = NULL);
 
+// If shared is non-NULL and the message fits, it's written there
+// instead of to the socket.
 // If this returns false, you probably want to close the socket.
 template <class T>
-bool WriteProto(TCPsocket sock, const T &t);
+bool WriteProto(TCPsocket sock, const T &t, uint8 *shared = NULL);
 
-// Listens on a single port for a single connection at a time,
-// blocking.
+// Listens on a single port and answers a single connection at a
+// time, blocking. Other connections can be accepted and parked
+// meanwhile.
 struct SingleServer {
   // Aborts if listening fails.
   explicit SingleServer(int port);
@@ -70,12 +133,26 @@ struct SingleServer {
   // Must be in LISTENING state. Blocks until ACTIVE.
   void Listen();
 
+  // Must be in LISTENING state. Like Listen, but returns false
+  // (still LISTENING) rather than blocking if no one is connecting.
+  bool TryListen();
+
+  // Must be in ACTIVE state. Sets the connection aside and
+  // transitions to LISTENING, so that others can be accepted before
+  // this one is answered. Returns a handle for Resume.
+  int Park();
+
+  // Must be in LISTENING state. Makes a parked connection ACTIVE
+  // again.
+  void Resume(int handle);
+
   // Must be in ACTIVE state.
   // On error, returns false and transitions to LISTENING state.
   template <class T>
   bool ReadProto(T *t);
 
-  // Must be in ACTIVE state.
+  // Must be in ACTIVE state. Responds through the SharedArea if
+  // the request came that way.
   // On error, returns false and transitions to LISTENING state.
   template <class T>
   bool WriteProto(const T &t);
@@ -86,6 +163,9 @@ struct SingleServer {
   // Must be in ACTIVE state.
   string PeerString();
 
+  // The Id of our SharedArea, or 0 if we don't have one.
+  uint64 SharedAreaId() const;
+
  private:
   const int port_;
   IPaddress localhost_;
@@ -93,31 +173,104 @@ struct SingleServer {
   State state_;
   TCPsocket peer_;
   IPaddress peer_ip_;
+  // May be NULL.
+  SharedArea *shared_;
+  // Whether the peer's request came through shared_.
+  bool peer_shared_;
+
+  struct Parked {
+    TCPsocket peer;
+    IPaddress peer_ip;
+    bool peer_shared;
+  };
+  map<int, Parked> parked_;
+  int next_parked_;
+
+  // Accepts a waiting connection, if any, becoming ACTIVE.
+  bool Accept();
+};
+
+// The master's objective observations, for its helpers to make too
+// (see ObservationsProto). Each request carries only the ones that
+// the helper it's sent to hasn't said it has made, and those that
+// every helper has made are forgotten. GetAnswers may be looping in
+// other threads while the master observes, hence the lock.
+struct ObservationLog {
+  ObservationLog();
+  ~ObservationLog();
+
+  // The helpers that will be sent observations. Each is assumed
+  // to have made none until it says otherwise.
+  void SetHelpers(const vector<int> &ports);
+
+  void Add(const string &compact);
+
+  // Sets obs to the observations that the helper on port may not
+  // have made yet. Returns false if there aren't any.
+  bool Get(int port, ObservationsProto *obs);
+
+  // Notes that the helper on port has made this many.
+  void Acknowledge(int port, int64 observations);
+
+ private:
+  pthread_mutex_t mutex;
+  // The number of observations before log.front().
+  int64 first;
+  deque<string> log;
+  // By port.
+  map<int, int64> acknowledged;
+
+  NOT_COPYABLE(ObservationLog);
 };
 
 // Manages multiple outstanding requests to servers (e.g.
 // SingleServers, running in other processes.).
+//
+// Helpers cache states and responses, so related requests are
+// cheaper on the helper that saw the last one. If affinity keys are
+// given (parallel to the requests), each request prefers the helper
+// key % number of helpers, and idle helpers only steal work that
+// prefers someone else when they have none of their own. Response
+// must have a HelperStats stats field. A helper that answers with
+// an error there can never do the work, so that's fatal.
 template <class Request, class Response>
 struct GetAnswers {
 
-  // Request vector must outlast the object.
+  // Request vector must outlast the object. So must affinity,
+  // if non-NULL.
   GetAnswers(const vector<int> &ports,
-             const vector<Request> &requests)
+             const vector<Request> &requests,
+             const vector<uint64> *affinity = NULL)
   : workdone_(0),
-    workqueued_(0) {
+    workqueued_(0),
+    stolen_(0),
+    quiet_(false),
+    observations_(NULL) {
 
     for (int i = 0; i < ports.size(); i++) {
       helpers_.push_back(Helper(ports[i]));
     }
 
+    CHECK(affinity == NULL || affinity->size() == requests.size());
     for (int i = 0; i < requests.size(); i++) {
       work_.push_back(Work(&requests[i]));
-      // everything is queued if it's less than workqueued_.
-      // queued_.push_back(false);
+      queued_.push_back(false);
       done_.push_back(false);
+      preferred_.push_back(affinity == NULL || helpers_.empty() ? -1 :
+                           (int)((*affinity)[i] % helpers_.size()));
     }
   }
 
+  // Don't draw the progress meter, e.g. because another
+  // GetAnswers is running at the same time.
+  void SetQuiet() { quiet_ = true; }
+
+  // Sends each helper the observations from log that it hasn't
+  // made, with whatever request it gets next, and notes how many
+  // it has. Request must have an ObservationsProto observations
+  // field. The log must outlast the object.
+  void SetObservations(ObservationLog *log) { observations_ = log; }
+
   void Loop() {
     InPlaceTerminal term(1);
     for (;;) {
@@ -146,7 +299,7 @@ struct GetAnswers {
           } else {
             meter += "#";
           }
-        } else if (i < workqueued_) {
+        } else if (queued_[i]) {
           int helper = -1;
           // PERF...
           for (int h = 0; h < helpers_.size(); h++) {
@@ -165,10 +318,12 @@ struct GetAnswers {
         }
       }
       meter += StringPrintf("%c\n", (high == work_.size()) ? ']' : '>');
-      term.Output(meter);
+      if (!quiet_) term.Output(meter);
 
       // Are we done?
       if (workdone_ == work_.size()) {
+        term.Advance();
+        PrintStats();
         return;
       }
 
@@ -225,13 +380,36 @@ struct GetAnswers {
           // because there's data to read. Maybe should stream
           // data into the helper; it's not too hard.
           int workidx = helper->workidx;
-          if (ReadProto(helper->sock,
-                        &work_[workidx].res)) {
+          const bool ok = ReadProto(helper->sock, &work_[workidx].res,
+                                    helper->area == NULL ? NULL :
+                                    helper->area->Response());
+          if (helper->area != NULL) {
+            helper->area->Release();
+            helper->area = NULL;
+          }
+          if (ok && work_[workidx].res.stats().has_error()) {
+            term.Advance();
+            fprintf(stderr, "Helper on port %d can't do work #%d: %s\n",
+                    helper->port, workidx,
+                    work_[workidx].res.stats().error().c_str());
+            abort();
+          }
+          if (ok) {
             CHECK(done_[workidx] == false);
             // fprintf(stderr, "Got result from port %d for work #%d\n",
             // helper->port,
             // workidx);
             done_[workidx] = true;
+            // Cached responses carry the counters from when they
+            // were computed, so keep the latest.
+            const HelperStats &stats = work_[workidx].res.stats();
+            SharedArea::Offered(helper->port, stats.shared_area());
+            if (observations_ != NULL && stats.has_observations()) {
+              observations_->Acknowledge(helper->port, stats.observations());
+            }
+            if (stats.requests() >= helper->stats.requests()) {
+              helper->stats = stats;
+            }
             SDLNet_TCP_Close(helper->sock);
             helper->sock = NULL;
             helper->state = DISCONNECTED;
@@ -281,40 +459,91 @@ struct GetAnswers {
     explicit Helper(int port)
     : port(port),
       state(DISCONNECTED),
-      workidx(-1) {}
+      workidx(-1),
+      area(NULL) {}
     // Host assumed to be localhost.
     int port;
     State state;
+    // Latest counters reported by the helper.
+    HelperStats stats;
 
     // Index of the work we're doing, if in state WORKING.
     int workidx;
     // Current connection, if in state WORKING.
     TCPsocket sock;
+    // Acquired for the current request, if in state WORKING.
+    // May be NULL.
+    SharedArea *area;
   };
 
   // Work must already be assigned (marked as queued).
   void FetchWork(Helper *helper, int workidx) {
-    CHECK(workidx < workqueued_);
+    CHECK(queued_[workidx]);
     CHECK(helper->state == DISCONNECTED);
     helper->state = WORKING;
     helper->workidx = workidx;
     helper->sock = ConnectLocal(helper->port);
     CHECK(helper->sock);
+    helper->area = SharedArea::Acquire(helper->port);
+
+    const Request *req = work_[workidx].req;
+    Request withobs;
+    ObservationsProto obs;
+    if (observations_ != NULL && observations_->Get(helper->port, &obs)) {
+      withobs = *req;
+      withobs.mutable_observations()->Swap(&obs);
+      req = &withobs;
+    }
+
     // PERF -- could parallelize this with other writes,
     // by waiting until the socket is actually ready.
-    WriteProto(helper->sock, *work_[workidx].req);
+    WriteProto(helper->sock, *req,
+               helper->area == NULL ? NULL : helper->area->Request());
     // fprintf(stderr, "Doing work #%d on port %d.\n",
     // workidx,
     // helper->port);
   }
 
+  // Starts the first unqueued work that prefers this helper (or
+  // has no preference), or else steals the first unqueued work.
   void DoNextWork(int helperidx) {
     CHECK(workqueued_ < work_.size());
-    int workidx = workqueued_;
+    int workidx = -1, steal = -1;
+    for (int i = workdone_; i < work_.size(); i++) {
+      if (queued_[i]) continue;
+      if (preferred_[i] == -1 || preferred_[i] == helperidx) {
+        workidx = i;
+        break;
+      }
+      if (steal == -1) steal = i;
+    }
+    if (workidx == -1) {
+      CHECK(steal != -1);
+      workidx = steal;
+      stolen_++;
+    }
+    queued_[workidx] = true;
     workqueued_++;
     FetchWork(&helpers_[helperidx], workidx);
   }
 
+  // Prints how much work ran away from its preferred helper,
+  // and each helper's cache hit rates so far.
+  void PrintStats() const {
+    string line = StringPrintf("%d/%zu stolen. Hits (req/state):",
+                               stolen_, work_.size());
+    for (int i = 0; i < helpers_.size(); i++) {
+      const HelperStats &stats = helpers_[i].stats;
+      const int64 lookups = stats.state_hits() + stats.state_misses();
+      line += StringPrintf(" %d:%.0f/%.0f%%", helpers_[i].port,
+                           stats.requests() == 0 ? 0.0 :
+                           (100.0 * stats.request_hits()) / stats.requests(),
+                           lookups == 0 ? 0.0 :
+                           (100.0 * stats.state_hits()) / lookups);
+    }
+    fprintf(stderr, "%s\n", line.c_str());
+  }
+
   // Get the index of an idle helper, or -1 if none.
   int GetIdleHelper() {
     for (int i = 0; i < helpers_.size(); i++) {
@@ -327,67 +556,83 @@ struct GetAnswers {
 
   vector<Helper> helpers_;
   vector<Work> work_;
-  vector<bool> done_;
+  vector<bool> queued_, done_;
+  // Index of the preferred helper for each work, or -1.
+  vector<int> preferred_;
   // All entries with index strictly less than workdone_
-  // are done and have results. All entries with index
-  // strictly less than workqueued_ have been enqueued.
+  // are done and have results. workqueued_ entries have
+  // been enqueued (not necessarily a prefix).
   int workdone_, workqueued_;
+  // Number of works that ran on a helper they didn't prefer.
+  int stolen_;
+  bool quiet_;
+  // Not owned. May be NULL.
+  ObservationLog *observations_;
 
   // IPaddress localhost_;
 };
 
-// Small exact cache of protos.
+// Cache of responses to recent requests. Requests are only kept as
+// a 128-bit fingerprint of their serialized bytes, and the responses
+// are limited to a total number of bytes, evicting the least
+// recently used.
 struct RequestCache {
-  explicit RequestCache(int size);
+  explicit RequestCache(size_t maxbytes);
+  ~RequestCache();
   typedef ::google::protobuf::Message Message;
-
-  template<class Req, class Res>
-  void Save(const Req &request, const Res &response);
+  typedef uint128 Key;
 
   template<class Req>
-  const Message *Lookup(const Req &req) const;
+  static Key Fingerprint(const Req &req);
+
+  // Returns the response saved for the key, or NULL.
+  const Message *Lookup(const Key &key);
+
+  template<class Res>
+  void Save(const Key &key, const Res &response);
+
+  int64 Lookups() const { return lookups; }
+  int64 Hits() const { return hits; }
+  size_t Bytes() const { return bytes; }
 
  private:
-  int size, num;
-  // Pointers owned.
-  deque< pair<string, Message*> > recent;
+  struct Entry {
+    Key key;
+    // Owned.
+    Message *response;
+    size_t size;
+  };
+  void Insert(const Key &key, Message *response, size_t size);
+
+  const size_t maxbytes;
+  size_t bytes;
+  int64 lookups, hits;
+  // Most recently used first.
+  list<Entry> recent;
+  map<Key, list<Entry>::iterator> index;
 };
 
 // Template implementations follow.
 
-template<class Req, class Res>
-void RequestCache::Save(const Req &request, const Res &response) {
-  while (num >= size) {
-    delete recent.back().second;
-    recent.pop_back();
-    num--;
-  }
-
-  recent.push_front(make_pair(request.SerializeAsString(),
-                              new Res(response)));
-  num++;
+template<class Req>
+RequestCache::Key RequestCache::Fingerprint(const Req &req) {
+  const string s = req.SerializeAsString();
+  return CityHash128(s.data(), s.size());
 }
 
-
-template<class Req>
-const RequestCache::Message *RequestCache::Lookup(const Req &req) const {
-  string s = req.SerializeAsString();
-  for (typename deque< pair<string, Message*> >::const_iterator
-         it = recent.begin();
-       it != recent.end(); ++it) {
-    if (it->first == s) {
-      return it->second;
-    }
-  }
-  return NULL;
+template<class Res>
+void RequestCache::Save(const Key &key, const Res &response) {
+  Insert(key, new Res(response), sizeof (Entry) + response.ByteSizeLong());
 }
 
 
 template <class T>
-bool ReadProto(TCPsocket sock, T *t) {
+bool ReadProto(TCPsocket sock, T *t, const uint8 *shared,
+               bool *shared_used) {
   // PERF probably possible without copy.
   CHECK(sock != NULL);
   CHECK(t != NULL);
+  if (shared_used != NULL) *shared_used = false;
 
   char header[4];
   int bytes = SDLNet_TCP_Recv(sock, (void *)&header, 4);
@@ -403,6 +648,22 @@ bool ReadProto(TCPsocket sock, T *t) {
   }
 
   Uint32 len = SDLNet_Read32((void *)&header);
+  if (len & SHARED_MESSAGE) {
+    len &= ~SHARED_MESSAGE;
+    if (shared == NULL || len > SHARED_AREA_SIZE) {
+      fprintf(stderr, "ReadProto: Peer sent a message in shared memory "
+              "that we can't read.\n");
+      return false;
+    }
+    if (shared_used != NULL) *shared_used = true;
+    if (t->ParseFromArray((const void *)shared, len)) {
+      return true;
+    } else {
+      fprintf(stderr, "ReadProto: Failed parse shared proto.\n");
+      return false;
+    }
+  }
+
   if (len > MAX_MESSAGE) {
     fprintf(stderr, "Peer sent header with len too big.\n");
     return false;
@@ -435,8 +696,18 @@ bool ReadProto(TCPsocket sock, T *t) {
 }
 
 template <class T>
-bool WriteProto(TCPsocket sock, const T &t) {
+bool WriteProto(TCPsocket sock, const T &t, uint8 *shared) {
   CHECK(sock != NULL);
+  if (shared != NULL) {
+    const size_t size = t.ByteSizeLong();
+    if (size <= SHARED_AREA_SIZE) {
+      CHECK(t.SerializeToArray((void *)shared, (int)size));
+      char header[4];
+      SDLNet_Write32(SHARED_MESSAGE | (Uint32)size, (void*)header);
+      return 4 == SDLNet_TCP_Send(sock, (const void *)header, 4);
+    }
+  }
+
   // PERF probably possible without copy.
   string s = t.SerializeAsString();
   if (s.size() > MAX_MESSAGE) {
@@ -469,7 +740,8 @@ bool WriteProto(TCPsocket sock, const T &t) {
 template <class T>
 bool SingleServer::WriteProto(const T &t) {
   CHECK(state_ == ACTIVE);
-  bool r = ::WriteProto(peer_, t);
+  bool r = ::WriteProto(peer_, t,
+                        peer_shared_ ? shared_->Response() : NULL);
   if (!r) {
     fprintf(stderr, "SingleServer failed writeproto.\n");
     Hangup();
@@ -480,7 +752,9 @@ bool SingleServer::WriteProto(const T &t) {
 template <class T>
 bool SingleServer::ReadProto(T *t) {
   CHECK(state_ == ACTIVE);
-  bool r = ::ReadProto(peer_, t);
+  bool r = ::ReadProto(peer_, t,
+                       shared_ == NULL ? NULL : shared_->Request(),
+                       &peer_shared_);
   if (!r) {
     fprintf(stderr, "SingleServer failed readproto.\n");
     Hangup();
@@ -286,9 +286,15 @@ void Objective::EnumerateFull(const vector<int> &look,
 
 void Objective::EnumerateFullAll(void (*f)(const vector<int> &ordering),
 				 int limit, int seed) {
+  EnumerateFullSpan(0, memories.size(), f, limit, seed);
+}
+
+void Objective::EnumerateFullSpan(int begin, int end,
+				  void (*f)(const vector<int> &ordering),
+				  int limit, int seed) {
   vector<int> look;
-  for (int i = 0; i < memories.size(); i++) {
-    if (i > 0 && memories[i] == memories[i - 1]) {
+  for (int i = begin; i < end; i++) {
+    if (i > begin && memories[i] == memories[i - 1]) {
       VPRINTF("Duplicate memory at %d-%d\n", i - 1, i);
       // PERF don't include it!
       // look.push_back(i);
@@ -86,6 +86,12 @@ struct Objective {
   void EnumerateFullAll(void (*f)(const vector<int> &ordering),
                         int limit, int seed);
 
+  // Same, but only looking at memories begin..end-1, e.g. one movie
+  // when the memories come from several.
+  void EnumerateFullSpan(int begin, int end,
+                         void (*f)(const vector<int> &ordering),
+                         int limit, int seed);
+
 private:
 
   // Look gives the memory indices to look at.
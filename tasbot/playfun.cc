@@ -9,24 +9,43 @@
 #include <vector>
 #include <string>
 #include <set>
+#include <map>
+#include <deque>
 #include <cmath>
 
 #include <sys/types.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <time.h>
 
 #include "tasbot.h"
 
+#include "async-writer.h"
 #include "config.h"
 #include "basis-util.h"
 #include "emulator.h"
+#include "input-classes.h"
+#include "inputlog.h"
+#include "memory-history.h"
+#include "movie-index.h"
+#include "ram-trace.h"
 #include "simplefm2.h"
 #include "weighted-objectives.h"
 #include "motifs.h"
+#include "report.h"
+#include "report-viewers.h"
 #include "util.h"
+#include "watch.h"
 
 #ifdef MARIONET
+#include <pthread.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <signal.h>
+#include <sys/prctl.h>
+#endif
+
 #include "marionet.pb.h"
 #include "netutil.h"
 #endif
@@ -47,6 +66,13 @@
 // below this, but don't increase to meet the fraction, either.
 #define MOTIF_MIN_FRAC 0.00001
 
+// With --min-next and --max-next, the number of inputs committed per
+// round doubles when the relative spread of the nexts' scores is
+// below NEXT_SPREAD_LOW, and halves when it's above NEXT_SPREAD_HIGH
+// or the futures disagree about the chosen next.
+#define NEXT_SPREAD_LOW 0.02
+#define NEXT_SPREAD_HIGH 0.2
+
 struct Scoredist {
   Scoredist() : startframe(0), chosen_idx() {}
   explicit Scoredist(size_t startframe) : startframe(startframe),
@@ -56,54 +82,11 @@ struct Scoredist {
   vector<double> positives;
   vector<double> negatives;
   vector<double> norms;
+  // The totals that the choice was made on.
+  vector<double> scores;
   size_t chosen_idx;
 };
 
-static void SaveDistributionSVG(const size_t totalframes,
-				const vector<Scoredist> &dists,
-				const string &filename) {
-  const double SPAN = 50;
-  const double WIDTH = totalframes * 2;
-  const double HEIGHT = 768.0;
-
-  // Add slop for radii.
-  string out = TextSVG::Header(WIDTH + 12, HEIGHT + 12);
-
-  // immediates, positives, negatives all are in same value space
-  double minval = 1.0, maxval = 0.0;
-  for (int i = 0; i < dists.size(); i++) {
-    const Scoredist &dist = dists[i];
-    minval =
-      VectorMin(VectorMin(VectorMin(minval, dist.negatives),
-			  dist.positives),
-		dist.immediates);
-    maxval =
-      VectorMax(VectorMax(VectorMax(maxval, dist.negatives),
-			  dist.positives),
-		dist.immediates);
-  }
-
-  for (int i = 0; i < dists.size(); i++) {
-    const Scoredist &dist = dists[i];
-    double xf = dist.startframe / (double)totalframes;
-    out += DrawDots(WIDTH, HEIGHT,
-		    "#33A", xf, dist.immediates, minval, maxval, dist.chosen_idx);
-    out += DrawDots(WIDTH, HEIGHT,
-		    "#090", xf, dist.positives, minval, maxval, dist.chosen_idx);
-    out += DrawDots(WIDTH, HEIGHT,
-		    "#A33", xf, dist.negatives, minval, maxval, dist.chosen_idx);
-    out += DrawDots(WIDTH, HEIGHT,
-		    "#000", xf, dist.norms, minval, maxval, dist.chosen_idx);
-  }
-
-  // XXX args?
-  out += SVGTickmarks(WIDTH, totalframes, SPAN, 20.0, 12.0);
-
-  out += TextSVG::Footer();
-  Util::WriteFile(filename, out);
-  printf("Wrote distributions to %s.\n", filename.c_str());
-}
-
 // Is a namespace necessary?
 // Why is there no playfun.h?
 namespace {
@@ -125,6 +108,9 @@ struct Future {
 // For backtracking.
 struct Replacement {
   vector<uint8> inputs;
+  // State after playing the inputs from the start of the
+  // backtrack, or empty if unknown.
+  vector<uint8> end_state;
   double score;
   string method;
 };
@@ -148,34 +134,105 @@ static void SaveFuturesHTML(const vector<Future> &futures,
   printf("Wrote futures to %s\n", filename.c_str());
 }
 
+// Writes a movie from a snapshot of the inputs, on the AsyncWriter
+// thread.
+struct MovieJob : public AsyncWriter::Job {
+  MovieJob(const string &filename, const Config &config,
+	   const vector<uint8> &movie, const vector<string> &subtitles)
+    : filename(filename), config(config),
+      movie(movie), subtitles(subtitles) {}
+
+  void Run() {
+    SimpleFM2::WriteInputsWithSubtitles(filename,
+					config.game + ".nes",
+					config,
+					movie,
+					subtitles);
+  }
+
+  const string filename;
+  const Config config;
+  const vector<uint8> movie;
+  const vector<string> subtitles;
+};
+
+// Futures are copied so that the master can keep modifying them.
+struct FuturesJob : public AsyncWriter::Job {
+  FuturesJob(const string &filename, const vector<Future> &futures)
+    : filename(filename), futures(futures) {}
+
+  void Run() {
+    SaveFuturesHTML(futures, filename);
+  }
+
+  const string filename;
+  const vector<Future> futures;
+};
+
+// Draws the objectives over a snapshot of the memory history.
+struct ObjectivesJob : public AsyncWriter::Job {
+  ObjectivesJob(const string &filename,
+		const vector< vector<int> > &objectives,
+		const MemoryHistory &history)
+    : filename(filename), objectives(objectives) {
+    history.GetAll(&movenums, &memories);
+  }
+
+  void Run() {
+    WeightedObjectives wo(objectives);
+    wo.SaveSVG(memories, movenums, filename);
+  }
+
+  const string filename;
+  const vector< vector<int> > objectives;
+  vector<size_t> movenums;
+  vector< vector<uint8> > memories;
+};
+
 struct PlayFun {
-  PlayFun(Config config) : config(config), watermark(0), log(NULL), rc("playfun") {
+  PlayFun(Config config) : history(HISTORY_RECENT, HISTORY_OLDER),
+			   config(config), watermark(0), log(NULL),
+			   writer(NULL), inputlog(NULL), scores_report(NULL),
+			   objectives_report(NULL), motifs_report(NULL),
+			   rc("playfun") {
     Emulator::Initialize(config);
-    objectives = WeightedObjectives::LoadFromFile((config.game+ ".objectives").c_str());
-    CHECK(objectives);
-    fprintf(stderr, "Loaded %zu objective functions\n", objectives->Size());
-
-    motifs = Motifs::LoadFromFile((config.game+ ".motifs").c_str());
-    CHECK(motifs);
+    // Initialize fills in the ROM checksum.
+    this->config.romchecksum = config.romchecksum;
 
     Emulator::ResetCache(100000, 10000);
 
-    motifvec = motifs->AllMotifs();
-
     // PERF basis?
 
     solution = SimpleFM2::ReadInputs(config.movie.c_str());
+    const size_t start = RamTrace::MovieStart(solution, config.fastforward);
 
-    size_t start = 0;
-    while (solution[start] == 0 && start < solution.size()) {
-      Commit(solution[start], "warmup");
-      watermark++;
-      start++;
+    LoadGameData(config, solution, start,
+		 &objectives, &motifs, &classes, &watch);
+    Emulator::SetWatch(watch);
+    motifvec = motifs->AllMotifs();
+
+    #ifdef MARIONET
+    MakeTenantProto(config, *objectives, &tenant_);
+    positions_ = ObservedPositions(*objectives);
+    #endif
+
+    // Committing a frame before the fastforward point does nothing
+    // but step, so seek past those with the movie's index.
+    const size_t seek =
+      min(start, (size_t)max(config.fastforward, (size_t)1) - 1);
+    if (seek > 0) {
+      MovieIndex *index =
+	MovieIndex::LoadOrCompute(solution, config.romchecksum,
+				  MovieIndex::IndexFile(config.movie));
+      index->Seek(seek);
+      delete index;
+      movie.insert(movie.end(), solution.begin(), solution.begin() + seek);
+      subtitles.resize(seek, "warmup");
+      watermark = seek;
     }
-    while (start < config.fastforward && start < solution.size()) {
-      Commit(solution[start], "warmup");
+    for (size_t i = seek; i < start; i++) {
+      Commit(solution[i], "warmup");
       watermark++;
-      start++;
     }
 
     CHECK(start > 0 && "Currently, there needs to be at least "
@@ -184,11 +241,50 @@ struct PlayFun {
     printf("Skipped %zu frames until first keypress/ffwd.\n", start);
   }
 
-  // PERF. Shouldn't really save every memory, but
-  // we're using it for drawing SVG for now. This saves one
-  // in OBSERVE_EVERY memories, and isn't truncated when we
-  // backtrack.
-  vector< vector<uint8> > memories;
+  // Loads config.game's objectives, motifs and input classes, and
+  // compiles config.watch (NULL if there's none). Optionally prunes
+  // objectives that are redundant on the solution's transitions
+  // from start. Helpers do the same, so everyone ends up with the
+  // same set. The emulator must be at power-on for the game, and
+  // is left there.
+  static void LoadGameData(const Config &config,
+			   const vector<uint8> &solution, size_t start,
+			   WeightedObjectives **objectives, Motifs **motifs,
+			   InputClasses **classes, Watch **watch) {
+    *objectives = WeightedObjectives::LoadFromFile((config.game+ ".objectives").c_str());
+    CHECK(*objectives);
+    fprintf(stderr, "Loaded %zu objective functions\n", (*objectives)->Size());
+
+    *motifs = Motifs::LoadFromFile((config.game+ ".motifs").c_str());
+    CHECK(*motifs);
+
+    *classes = InputClasses::LoadFromFile(config.game + ".inputclasses");
+    // The motifs are as the human played them; only try one of each
+    // class.
+    (*motifs)->Canonicalize(**classes);
+
+    *watch = NULL;
+    if (!config.watch.empty()) {
+      *watch = Watch::Compile(config.watch);
+      CHECK(*watch);
+    }
+
+    if (config.prune > 0.0 && start < solution.size()) {
+      vector<uint8> poweron;
+      Emulator::Save(&poweron);
+      vector< vector<uint8> > memories;
+      RamTrace::GetMemories(config.game, config.romchecksum,
+			    solution, start, &memories);
+      Emulator::Load(&poweron);
+      vector< pair<int, int> > spans;
+      spans.push_back(make_pair(0, (int)memories.size()));
+      (*objectives)->Prune(memories, spans, config.prune);
+    }
+  }
+
+  // Memories observed along the current path, for drawing. Takes
+  // a fixed amount of space; see OBSERVE_EVERY and HISTORY_*.
+  MemoryHistory history;
 
   // Contains the movie we record (partial solution).
   vector<uint8> movie;
@@ -226,7 +322,8 @@ struct PlayFun {
   // variants on the best future.
   static const int MUTATEFUTURES = 7;
 
-  // Note that backfill motifs are not necessarily this length.
+  // The usual length of a next. With --min-next and --max-next it
+  // varies; see AdaptNextLength.
   static const int INPUTS_PER_NEXT = 10;
 
   // Number of inputs in each future.
@@ -244,8 +341,16 @@ struct PlayFun {
   // Observe the memory (for calibrating objectives and drawing
   // SVG) this often (number of inputs).
   static const int OBSERVE_EVERY = 10;
-  // Save this often (number of inputs).
+  // Save this often (number of rounds). The input log is flushed
+  // this often too, but a numbered FM2 copy is only written every
+  // SAVE_FM2_EVERY rounds.
   static const int SAVE_EVERY = 5;
+  static const int SAVE_FM2_EVERY = 50;
+
+  // Number of observations to keep in the history at full
+  // resolution, and the number of older, thinned-out ones.
+  static const int HISTORY_RECENT = 500;
+  static const int HISTORY_OLDER = 500;
 
   // Should always be the same length as movie.
   vector<string> subtitles;
@@ -254,6 +359,7 @@ struct PlayFun {
     Emulator::CachingStep(input);
     movie.push_back(input);
     subtitles.push_back(message);
+    if (inputlog != NULL) inputlog->Append(input, message);
     if (movie.size() < watermark || movie.size() < config.fastforward)
       return;
 
@@ -268,8 +374,15 @@ struct PlayFun {
     if (inputs % OBSERVE_EVERY == 0) {
       vector<uint8> mem;
       Emulator::GetMemory(&mem);
-      memories.push_back(mem);
+      history.Add(movie.size(), mem);
       objectives->Observe(mem);
+      #ifdef MARIONET
+      observation_log_.Add(CompactMemory(positions_, mem));
+      #endif
+      // Only the master has reports, and not until warmup is done.
+      if (objectives_report != NULL) {
+	ReportObservation(mem);
+      }
     }
   }
 
@@ -281,6 +394,8 @@ struct PlayFun {
     CHECK(movie.size() == subtitles.size());
     movie.resize(movenum);
     subtitles.resize(movenum);
+    if (inputlog != NULL) inputlog->Truncate(movenum);
+    history.Truncate(movenum);
     // Pop any checkpoints since movenum.
     while (!checkpoints.empty() &&
 	   checkpoints.back().movenum > movenum) {
@@ -313,117 +428,545 @@ struct PlayFun {
     }
   }
 
-  void Helper(int port) {
+  // Limit on the size of the responses a helper keeps cached.
+  static const size_t REQUEST_CACHE_BYTES = 16 << 20;
+
+  // Counters for the HelperStats sent with every response, and
+  // the server's SharedArea.
+  void GetHelperStats(const SingleServer &server, const RequestCache &cache,
+		      HelperStats *stats) {
+    uint64 hits, misses;
+    Emulator::GetCacheStats(&hits, &misses);
+    stats->set_requests(cache.Lookups());
+    stats->set_request_hits(cache.Hits());
+    stats->set_state_hits(hits);
+    stats->set_state_misses(misses);
+    stats->set_observations(objectives->NumObservations());
+    if (server.SharedAreaId() != 0)
+      stats->set_shared_area(server.SharedAreaId());
+  }
+
+  // The memory locations that some objective looks at, ascending.
+  // These are all that observations need.
+  static vector<int> ObservedPositions(const WeightedObjectives &objectives) {
+    vector< vector<int> > objs = objectives.GetObjectives();
+    set<int> positions;
+    for (int i = 0; i < objs.size(); i++) {
+      positions.insert(objs[i].begin(), objs[i].end());
+    }
+    return vector<int>(positions.begin(), positions.end());
+  }
+
+  static string CompactMemory(const vector<int> &positions,
+			      const vector<uint8> &mem) {
+    string compact;
+    compact.reserve(positions.size());
+    for (int i = 0; i < positions.size(); i++) {
+      compact.push_back(mem[positions[i]]);
+    }
+    return compact;
+  }
+
+  // Key for routing requests to helpers, so that requests that
+  // would hit the same caches go to the same helper. It has to
+  // stay the same from round to round for that, so it can't
+  // depend on the state, which changes every time.
+  static uint64 AffinityKey(const uint8 *inputs, size_t len) {
+    return CityHash64((const char *)inputs, len);
+  }
+
+  // A game that this helper serves, loaded the way its masters
+  // loaded it.
+  struct Tenant {
+    Config config;
+    WeightedObjectives *objectives;
+    Motifs *motifs;
+    InputClasses *classes;
+    // May be NULL.
+    Watch *watch;
+    // ObservedPositions(*objectives).
+    vector<int> positions;
+    // From the TenantProto, for the log.
+    string master;
+    // When a request last used it.
+    time_t last_used;
+  };
+
+  // A request that has been read but not yet answered.
+  struct Pending {
+    HelperRequest hreq;
+    // From SingleServer::Park.
+    int connection;
+    // For the terminal.
+    string line;
+  };
+
+  // A master's waiting requests, and how much of our time it has
+  // had, in CPU seconds.
+  struct Share {
+    Share() : usage(0.0) {}
+    deque<Pending> queue;
+    double usage;
+  };
+
+  // See NextShare. Switching games clears the state cache, so it's
+  // worth being a little unfair to avoid it.
+  static const int FAIR_SHARE_SLACK = 2;
+
+  // Each master has its own tenant, even for the same game, since
+  // its objectives make the observations that master sends.
+  static string TenantKey(const TenantProto &tenant) {
+    return tenant.SerializeAsString();
+  }
+
+  // A tenant whose master hasn't sent anything for this long is
+  // unloaded. The key includes the master's pid, so once a master
+  // exits, its tenant would never be used again.
+  static const int TENANT_IDLE_SECONDS = 3600;
+
+  // Identifies a set of objectives, so that a helper can check that
+  // it has the same ones as its master.
+  static uint64 ObjectivesHash(const WeightedObjectives &objectives) {
+    vector< vector<int> > objs = objectives.GetObjectives();
+    uint64 h = objs.size();
+    for (int i = 0; i < objs.size(); i++) {
+      if (objs[i].empty()) continue;
+      h = CityHash64WithSeed((const char *)&objs[i][0],
+			     objs[i].size() * sizeof (int), h);
+    }
+    return h;
+  }
+
+  // Describes the game as loaded for config, for tagging requests.
+  static void MakeTenantProto(const Config &config,
+			      const WeightedObjectives &objectives,
+			      TenantProto *tenant) {
+    tenant->set_game(config.game);
+    tenant->set_romchecksum(config.romchecksum.data, MD5DATA::size);
+    tenant->set_movie(config.movie);
+    tenant->set_fastforward(config.fastforward);
+    tenant->set_prune(config.prune);
+    if (!config.watch.empty()) tenant->set_watch(config.watch);
+    tenant->set_objectives(ObjectivesHash(objectives));
+    char host[256] = {0};
+    gethostname(host, sizeof (host) - 1);
+    tenant->set_master(StringPrintf("%s:%d", host, (int)getpid()));
+  }
+
+  static void DeleteTenant(Tenant *tenant) {
+    delete tenant->objectives;
+    delete tenant->motifs;
+    delete tenant->classes;
+    delete tenant->watch;
+    delete tenant;
+  }
+
+  // Unloads the tenants that have been idle for TENANT_IDLE_SECONDS,
+  // other than our own game and the one in use. (That may not be
+  // loaded_, if loading another failed.)
+  void EvictIdleTenants() {
+    const time_t now = time(NULL);
+    const string own = TenantKey(tenant_);
+    for (map<string, Tenant *>::iterator it = tenants_.begin();
+	 it != tenants_.end(); ) {
+      Tenant *tenant = it->second;
+      if (it->first != own && tenant->objectives != objectives &&
+	  now - tenant->last_used > TENANT_IDLE_SECONDS) {
+	fprintf(stderr, "Unloading %s for %s, which has gone quiet.\n",
+		tenant->config.game.c_str(), tenant->master.c_str());
+	DeleteTenant(tenant);
+	tenants_.erase(it++);
+      } else {
+	++it;
+      }
+    }
+  }
+
+  // Returns the tenant for the proto, loading it the way the master
+  // did if it's new. Returns NULL if we can't get the same game.
+  // Failures aren't remembered, in case the game shows up later;
+  // the master gives up when we tell it, so it won't keep asking.
+  Tenant *GetTenant(const TenantProto &proto) {
+    const string key = TenantKey(proto);
+    map<string, Tenant *>::iterator it = tenants_.find(key);
+    if (it != tenants_.end()) return it->second;
+
+    fprintf(stderr, "Loading %s for %s.\n",
+	    proto.game().c_str(), proto.master().c_str());
+    Config tconfig(config);
+    tconfig.game = proto.game();
+    tconfig.movie = proto.movie();
+    tconfig.movies.assign(1, proto.movie());
+    tconfig.fastforward = proto.fastforward();
+    tconfig.prune = proto.prune();
+    tconfig.watch = proto.watch();
+
+    // Whatever was loaded is gone, even if this fails.
+    loaded_ = NULL;
+    if (!Emulator::SwitchGame(tconfig) ||
+	proto.romchecksum() != string((const char *)tconfig.romchecksum.data,
+				      MD5DATA::size)) {
+      fprintf(stderr, "Don't have the master's ROM for %s.\n",
+	      proto.game().c_str());
+      return NULL;
+    }
+
+    vector<uint8> tsolution = SimpleFM2::ReadInputs(tconfig.movie.c_str());
+    Tenant *tenant = new Tenant;
+    tenant->config = tconfig;
+    tenant->master = proto.master();
+    tenant->last_used = time(NULL);
+    LoadGameData(tconfig, tsolution,
+		 RamTrace::MovieStart(tsolution, tconfig.fastforward),
+		 &tenant->objectives, &tenant->motifs, &tenant->classes,
+		 &tenant->watch);
+    tenant->positions = ObservedPositions(*tenant->objectives);
+    loaded_ = tenant;
+    if (ObjectivesHash(*tenant->objectives) != proto.objectives()) {
+      fprintf(stderr, "Objectives for %s don't match the master's.\n",
+	      proto.game().c_str());
+      DeleteTenant(tenant);
+      loaded_ = NULL;
+      return NULL;
+    }
+    tenants_[key] = tenant;
+    return tenant;
+  }
+
+  // Makes the observations that the tenant's objectives haven't
+  // made yet. If some are missing from the start, we wait for the
+  // master to send them again, since they have to be made in order.
+  static void CatchUp(Tenant *tenant, const ObservationsProto &obs) {
+    if (tenant->positions.empty()) return;
+    WeightedObjectives *objectives = tenant->objectives;
+    if (obs.first() > objectives->NumObservations()) {
+      fprintf(stderr, "Missing observations %lld to %lld.\n",
+	      (long long)objectives->NumObservations(),
+	      (long long)obs.first());
+      return;
+    }
+    vector<uint8> mem(tenant->positions.back() + 1, 0);
+    for (int i = 0; i < obs.memories_size(); i++) {
+      if (obs.first() + i < objectives->NumObservations()) continue;
+      const string &compact = obs.memories(i);
+      CHECK(compact.size() == tenant->positions.size());
+      for (int p = 0; p < compact.size(); p++) {
+	mem[tenant->positions[p]] = compact[p];
+      }
+      objectives->Observe(mem);
+    }
+  }
+
+  // Switches to the request's game, making its ROM, objectives and
+  // motifs the current ones, and makes the observations that came
+  // with it. Returns false if we can't.
+  bool UseTenant(const HelperRequest &hreq) {
+    EvictIdleTenants();
+    Tenant *tenant = GetTenant(hreq.has_tenant() ? hreq.tenant() : tenant_);
+    if (tenant == NULL) return false;
+    tenant->last_used = time(NULL);
+
+    if (loaded_ == NULL ||
+	0 != memcmp(loaded_->config.romchecksum.data,
+		    tenant->config.romchecksum.data, MD5DATA::size)) {
+      CHECK(Emulator::SwitchGame(tenant->config));
+    }
+    loaded_ = tenant;
+    if (hreq.has_observations()) CatchUp(tenant, hreq.observations());
+    objectives = tenant->objectives;
+    motifs = tenant->motifs;
+    classes = tenant->classes;
+    watch = tenant->watch;
+    Emulator::SetWatch(watch);
+    return true;
+  }
+
+  // Whether the request is for the game whose ROM is loaded, so
+  // that switching to it keeps the state cache.
+  bool IsLoaded(const HelperRequest &hreq) const {
+    if (loaded_ == NULL) return false;
+    const TenantProto &proto = hreq.has_tenant() ? hreq.tenant() : tenant_;
+    return proto.romchecksum() ==
+      string((const char *)loaded_->config.romchecksum.data, MD5DATA::size);
+  }
+
+  // The master with waiting requests that has had the least of
+  // our time. There must be one.
+  static Share *Neediest(map<string, Share> *shares) {
+    Share *neediest = NULL;
+    for (map<string, Share>::iterator it = shares->begin();
+	 it != shares->end(); ++it) {
+      if (!it->second.queue.empty() &&
+	  (neediest == NULL || it->second.usage < neediest->usage)) {
+	neediest = &it->second;
+      }
+    }
+    CHECK(neediest != NULL);
+    return neediest;
+  }
+
+  // The master whose request should be served next: the neediest,
+  // unless one within FAIR_SHARE_SLACK seconds of it wants the
+  // game that's loaded.
+  Share *NextShare(map<string, Share> *shares) const {
+    Share *neediest = Neediest(shares);
+    for (map<string, Share>::iterator it = shares->begin();
+	 it != shares->end(); ++it) {
+      if (!it->second.queue.empty() &&
+	  it->second.usage <= neediest->usage + FAIR_SHARE_SLACK &&
+	  IsLoaded(it->second.queue.front().hreq)) {
+	return &it->second;
+      }
+    }
+    return neediest;
+  }
+
+  // Answers with just an error, so that the master gives up
+  // rather than asking again.
+  template<class Response>
+  static bool SendError(SingleServer *server, const string &error) {
+    Response res;
+    res.mutable_stats()->set_error(error);
+    return server->WriteProto(res);
+  }
+
+  // Serves one request on the server's active connection.
+  void Serve(SingleServer *server, const HelperRequest &hreq,
+	     RequestCache *cache, InPlaceTerminal *term, string line) {
+    const RequestCache::Key key = RequestCache::Fingerprint(hreq);
+
+    if (const Message *res = cache->Lookup(key)) {
+      #ifndef NOEMUCACHE
+      line += ", " ANSI_GREEN "cached!" ANSI_RESET;
+      term->Output(line + "\n");
+      #endif
+      if (!server->WriteProto(*res)) {
+	term->Advance();
+	fprintf(stderr, "Failed to send cached result...\n");
+	// keep going...
+      }
+
+    } else if (!UseTenant(hreq)) {
+      term->Advance();
+      fprintf(stderr, "Can't load %s's game; telling it so.\n",
+	      hreq.tenant().master().c_str());
+      // Not cached, in case the game shows up later (nor is the
+      // failure; see GetTenant).
+      const string error =
+	StringPrintf("The helper doesn't have the same ROM and objectives "
+		     "for %s (see its log).", hreq.tenant().game().c_str());
+      const bool ok = hreq.has_playfun() ?
+	SendError<PlayFunResponse>(server, error) :
+	SendError<TryImproveResponse>(server, error);
+      if (!ok) {
+	term->Advance();
+	fprintf(stderr, "Failed to send error...\n");
+      }
+
+    } else if (hreq.has_playfun()) {
+      const PlayFunRequest &req = hreq.playfun();
+      #ifndef NOEMUCACHE
+      line += ", " ANSI_YELLOW "playfun" ANSI_RESET;
+      term->Output(line + "\n");
+      #endif
+      vector<uint8> next, current_state, next_state;
+      ReadBytesFromProto(req.current_state(), &current_state);
+      ReadBytesFromProto(req.next(), &next);
+      if (req.has_next_state())
+	ReadBytesFromProto(req.next_state(), &next_state);
+      if (req.has_prefix()) {
+	vector<uint8> prefix;
+	ReadBytesFromProto(req.prefix(), &prefix);
+	PlayPrefix(prefix, &current_state);
+      }
+      vector<Future> futures;
+      for (int i = 0; i < req.futures_size(); i++) {
+	Future f;
+	ReadBytesFromProto(req.futures(i).inputs(), &f.inputs);
+	futures.push_back(f);
+      }
+
+      double immediate_score, normalized_score,
+	best_future_score, worst_future_score, future_score;
+      vector<double> futurescores(futures.size(), 0.0);
+
+      // Do the work.
+      InnerLoop(next, futures, &current_state,
+		next_state.empty() ? NULL : &next_state,
+		&immediate_score, &normalized_score,
+		&best_future_score, &worst_future_score,
+		&future_score, &futurescores);
+
+      PlayFunResponse res;
+      res.set_immediate_score(immediate_score);
+      res.set_normalized_score(normalized_score);
+      res.set_best_future_score(best_future_score);
+      res.set_worst_future_score(worst_future_score);
+      res.set_futures_score(future_score);
+      for (int i = 0; i < futurescores.size(); i++) {
+	res.add_futurescores(futurescores[i]);
+      }
+      GetHelperStats(*server, *cache, res.mutable_stats());
+
+      // fprintf(stderr, "Result: %s\n", res.DebugString().c_str());
+      cache->Save(key, res);
+      if (!server->WriteProto(res)) {
+	term->Advance();
+	fprintf(stderr, "Failed to send playfun result...\n");
+	// But just keep going.
+      }
+    } else if (hreq.has_tryimprove()) {
+      const TryImproveRequest &req = hreq.tryimprove();
+      #ifndef NOEMUCACHE
+      line += ", " ANSI_PURPLE "tryimprove " +
+	TryImproveRequest::Approach_Name(req.approach()) +
+	ANSI_RESET;
+      term->Advance();
+      term->Output(line + "\n");
+      #endif
+
+      // This thing prints.
+      TryImproveResponse res;
+      DoTryImprove(req, &res);
+      GetHelperStats(*server, *cache, res.mutable_stats());
+
+      cache->Save(key, res);
+      if (!server->WriteProto(res)) {
+	term->Advance();
+	fprintf(stderr, "Failed to send tryimprove result...\n");
+	// Keep going...
+      }
+    } else {
+      term->Advance();
+      fprintf(stderr, ".. unknown request??\n");
+    }
+  }
+
+  // Forks a helper for each port. They start with the emulator,
+  // objectives and motifs that we've already loaded, including the
+  // warm state cache, and share those pages with us until someone
+  // writes to them. Returns once they're all listening.
+  void ForkHelpers(const vector<int> &ports) {
+    #ifdef __MINGW32__
+    fprintf(stderr, "Can't fork helpers on this platform.\n");
+    abort();
+    #else
+    for (int i = 0; i < ports.size(); i++) {
+      int ready[2];
+      CHECK(0 == pipe(ready));
+      fflush(stdout);
+      fflush(stderr);
+      const pid_t pid = fork();
+      CHECK(pid >= 0);
+      if (pid == 0) {
+	close(ready[0]);
+	#ifdef __linux__
+	// Don't outlive the master.
+	prctl(PR_SET_PDEATHSIG, SIGTERM);
+	#endif
+	Helper(ports[i], ready[1]);
+	_exit(0);
+      }
+
+      close(ready[1]);
+      char c;
+      if (1 != read(ready[0], &c, 1)) {
+	fprintf(stderr, "Forked helper for port %d didn't start.\n",
+		ports[i]);
+	abort();
+      }
+      close(ready[0]);
+    }
+    fprintf(stderr, "Forked %zu helpers.\n", ports.size());
+    #endif
+  }
+
+  // Serves requests from any number of masters, each of which may
+  // be playing a different game. Requests that arrive together are
+  // read and set aside, and then answered so that each master gets
+  // a fair share of our time. If ready_fd isn't -1, writes a byte
+  // to it and closes it once we're listening.
+  void Helper(int port, int ready_fd = -1) {
     SingleServer server(port);
+    if (ready_fd != -1) {
+      CHECK(1 == write(ready_fd, "!", 1));
+      close(ready_fd);
+    }
 
     fprintf(stderr, "[%d] " ANSI_CYAN " Ready." ANSI_RESET "\n",
 	    port);
 
-    // Cache the last few request/responses, so that we don't
-    // recompute if there are connection problems. The master
-    // prefers to ask the same helper again on failure.
-    RequestCache cache(8);
+    // Our own game is already loaded.
+    Tenant *own = new Tenant;
+    own->config = config;
+    own->objectives = objectives;
+    own->motifs = motifs;
+    own->classes = classes;
+    own->watch = watch;
+    own->positions = positions_;
+    own->master = tenant_.master();
+    own->last_used = time(NULL);
+    tenants_[TenantKey(tenant_)] = own;
+    loaded_ = own;
+
+    // Cache recent responses, so that we don't recompute if there
+    // are connection problems. The master prefers to ask the same
+    // helper again on failure.
+    RequestCache cache(REQUEST_CACHE_BYTES);
+
+    // By TenantProto::master, or the peer's address for untagged
+    // requests.
+    map<string, Share> shares;
+    int waiting = 0;
 
     InPlaceTerminal term(1);
     int connections = 0;
     for (;;) {
-      server.Listen();
-
-      connections++;
-      string line = StringPrintf("[%d] Connection #%d from %s",
-				 port,
-				 connections,
-				 server.PeerString().c_str());
-      #ifdef NOEMUCACHE
-      term.Output(line + "\n");
-      #endif
-
-      HelperRequest hreq;
-      if (server.ReadProto(&hreq)) {
-
-	if (const Message *res = cache.Lookup(hreq)) {
-	  #ifndef NOEMUCACHE
-	  line += ", " ANSI_GREEN "cached!" ANSI_RESET;
-	  term.Output(line + "\n");
-	  #endif
-	  if (!server.WriteProto(*res)) {
-	    term.Advance();
-	    fprintf(stderr, "Failed to send cached result...\n");
-	    // keep going...
-	  }
-
-	} else if (hreq.has_playfun()) {
-	  const PlayFunRequest &req = hreq.playfun();
-	  #ifndef NOEMUCACHE
-	  line += ", " ANSI_YELLOW "playfun" ANSI_RESET;
-	  term.Output(line + "\n");
-	  #endif
-	  vector<uint8> next, current_state;
-	  ReadBytesFromProto(req.current_state(), &current_state);
-	  ReadBytesFromProto(req.next(), &next);
-	  vector<Future> futures;
-	  for (int i = 0; i < req.futures_size(); i++) {
-	    Future f;
-	    ReadBytesFromProto(req.futures(i).inputs(), &f.inputs);
-	    futures.push_back(f);
-	  }
-
-	  double immediate_score, normalized_score,
-            best_future_score, worst_future_score, future_score;
-	  vector<double> futurescores(futures.size(), 0.0);
-
-	  // Do the work.
-	  InnerLoop(next, futures, &current_state,
-		    &immediate_score, &normalized_score,
-		    &best_future_score, &worst_future_score,
-		    &future_score, &futurescores);
-
-	  PlayFunResponse res;
-	  res.set_immediate_score(immediate_score);
-	  res.set_normalized_score(normalized_score);
-	  res.set_best_future_score(best_future_score);
-	  res.set_worst_future_score(worst_future_score);
-	  res.set_futures_score(future_score);
-	  for (int i = 0; i < futurescores.size(); i++) {
-	    res.add_futurescores(futurescores[i]);
-	  }
-
-	  // fprintf(stderr, "Result: %s\n", res.DebugString().c_str());
-	  cache.Save(hreq, res);
-	  if (!server.WriteProto(res)) {
-	    term.Advance();
-	    fprintf(stderr, "Failed to send playfun result...\n");
-	    // But just keep going.
-	  }
-	} else if (hreq.has_tryimprove()) {
-	  const TryImproveRequest &req = hreq.tryimprove();
-	  #ifndef NOEMUCACHE
-	  line += ", " ANSI_PURPLE "tryimprove " +
-	    TryImproveRequest::Approach_Name(req.approach()) +
-	    ANSI_RESET;
-	  term.Advance();
-	  term.Output(line + "\n");
-	  #endif
-
-	  // This thing prints.
-	  TryImproveResponse res;
-	  DoTryImprove(req, &res);
-
-	  cache.Save(hreq, res);
-	  if (!server.WriteProto(res)) {
-	    term.Advance();
-	    fprintf(stderr, "Failed to send tryimprove result...\n");
-	    // Keep going...
-	  }
-	} else {
+      // Read everything that's arrived. Only block if there's
+      // nothing else to do.
+      while (waiting == 0 ? (server.Listen(), true) : server.TryListen()) {
+	connections++;
+	const string peer = server.PeerString();
+	string line = StringPrintf("[%d] Connection #%d from %s",
+				   port,
+				   connections,
+				   peer.c_str());
+	#ifdef NOEMUCACHE
+	term.Output(line + "\n");
+	#endif
+
+	Pending pending;
+	if (!server.ReadProto(&pending.hreq)) {
 	  term.Advance();
-	  fprintf(stderr, ".. unknown request??\n");
+	  fprintf(stderr, "Failed to read request...\n");
+	  server.Hangup();
+	  continue;
 	}
-      } else {
-	term.Advance();
-	fprintf(stderr, "Failed to read request...\n");
+	pending.line = line;
+	pending.connection = server.Park();
+
+	const string master = pending.hreq.has_tenant() ?
+	  pending.hreq.tenant().master() : peer;
+	Share *share = &shares[master];
+	if (share->queue.empty() && waiting > 0) {
+	  // Time spent idle isn't saved up as credit; start no
+	  // further behind than the least served waiting master.
+	  share->usage = max(share->usage, Neediest(&shares)->usage);
+	}
+	share->queue.push_back(pending);
+	waiting++;
       }
+
+      Share *share = NextShare(&shares);
+      Pending pending = share->queue.front();
+      share->queue.pop_front();
+      waiting--;
+
+      const clock_t start = clock();
+      server.Resume(pending.connection);
+      Serve(&server, pending.hreq, &cache, &term, pending.line);
       server.Hangup();
+      share->usage += (double)(clock() - start) / CLOCKS_PER_SEC;
     }
   }
 
@@ -498,6 +1041,8 @@ struct PlayFun {
 	  random_shuffle(begin, begin + len);
 	  break;
 	}
+	// So that equivalent attempts count as already tried.
+	classes->Canonicalize(&inputs);
 	double score = 0.0;
 	// If we already tried this or it isn't an improvement,
 	// try something else.
@@ -528,9 +1073,20 @@ struct PlayFun {
       repls.resize(req.maxbest());
     }
 
+    // Send back the end states too, so that the master can score
+    // these without replaying them. The steps were just taken while
+    // scoring, so this replay comes from the emulator cache.
     for (int i = 0; i < repls.size(); i++) {
-      res->add_inputs(&repls[i].second[0], repls[i].second.size());
+      const vector<uint8> &inputs = repls[i].second;
+      Emulator::Load(&start_state);
+      for (int j = 0; j < inputs.size(); j++)
+	Emulator::CachingStep(inputs[j]);
+      vector<uint8> state;
+      Emulator::Save(&state);
+
+      res->add_inputs(&inputs[0], inputs.size());
       res->add_score(repls[i].first);
+      res->add_end_state(&state[0], state.size());
     }
 
     // XXX I think that some can produce more than iters outputs,
@@ -573,6 +1129,7 @@ struct PlayFun {
 			    bool keepreversed) {
 
     Dualize(inputs, startidx, len);
+    classes->Canonicalize(inputs);
     double score = 0.0;
     if (IsImprovement(frac,
 		      start_state,
@@ -643,11 +1200,15 @@ struct PlayFun {
   // Computes the score as the sum of the scores of each step over the
   // input. You might want to normalize the score by the input length,
   // if comparing inputs of different length. Also swaps in the
-  // final memory if non-NULL.
+  // final memory if non-NULL. If the watch condition comes true,
+  // stops there (that's the final memory), and each step not taken
+  // scores as though every objective went down. If it's already true
+  // at the start, there's nothing worse to avoid, so it's ignored.
   double ScoreIntegral(vector<uint8> *start_memory,
 		       const vector<uint8> &inputs,
 		       vector<uint8> *final_memory) {
     Emulator::Load(start_memory);
+    const bool watching = !Emulator::Watched();
     vector<uint8> previous_memory;
     Emulator::GetMemory(&previous_memory);
     double sum = 0.0;
@@ -663,6 +1224,10 @@ struct PlayFun {
       // only if new - start > end - start) right?
       sum += objectives->Evaluate(previous_memory, new_memory);
       previous_memory.swap(new_memory);
+      if (watching && Emulator::Watched()) {
+	sum -= objectives->TotalWeight() * (inputs.end() - it - 1);
+	break;
+      }
     }
     if (final_memory != NULL) {
       final_memory->swap(previous_memory);
@@ -725,9 +1290,12 @@ struct PlayFun {
     return inputs;
   }
 
+  // If next_state is non-NULL, it's the state after playing next
+  // from current_state, and next isn't replayed.
   void InnerLoop(const vector<uint8> &next,
 		 const vector<Future> &futures_orig,
 		 vector<uint8> *current_state,
+		 const vector<uint8> *next_state,
 		 double *immediate_score,
 		 double *normalized_score,
 		 double *best_future_score,
@@ -743,16 +1311,20 @@ struct PlayFun {
     vector<uint8> current_memory;
     Emulator::GetMemory(&current_memory);
 
-    // Take steps.
-    for (int j = 0; j < next.size(); j++)
-      Emulator::CachingStep(next[j]);
+    vector<uint8> new_state;
+    if (next_state != NULL) {
+      new_state = *next_state;
+      Emulator::Load(&new_state);
+    } else {
+      // Take steps.
+      for (int j = 0; j < next.size(); j++)
+	Emulator::CachingStep(next[j]);
+      Emulator::Save(&new_state);
+    }
 
     vector<uint8> new_memory;
     Emulator::GetMemory(&new_memory);
 
-    vector<uint8> new_state;
-    Emulator::Save(&new_state);
-
     // Used to be BuggyEvaluate = WeightedLess? XXX
     *immediate_score = objectives->Evaluate(current_memory, new_memory);
 
@@ -827,32 +1399,88 @@ struct PlayFun {
     // futures.resize(futures.size() - NUM_FAKE_FUTURES);
   }
 
-  // The parallel step. We either run it in serial locally
-  // (without MARIONET) or as jobs on helpers, via TCP.
-  void ParallelStep(const vector< vector<uint8> > &nexts,
+  // Plays prefix from state, replacing state with the result.
+  static void PlayPrefix(const vector<uint8> &prefix, vector<uint8> *state) {
+    if (prefix.empty()) return;
+    Emulator::Load(state);
+    for (int j = 0; j < prefix.size(); j++)
+      Emulator::CachingStep(prefix[j]);
+    state->clear();
+    Emulator::Save(state);
+  }
+
+  // A parallel step whose work may still be out with the helpers.
+  // See StartRound and FinishRound.
+  struct Round {
+    vector< vector<uint8> > nexts;
+    // For the caller's use.
+    vector<string> nextplanations;
+    uint64 start_time;
+#ifdef MARIONET
+    vector<HelperRequest> requests;
+    vector<uint64> affinity;
+    GetAnswers<HelperRequest, PlayFunResponse> *getanswers;
+    // If true, getanswers is looping in thread.
+    bool background;
+    pthread_t thread;
+#else
+    vector< vector<uint8> > next_states;
+    vector<Future> futures;
+    vector<uint8> current_state;
+#endif
+  };
+
+#ifdef MARIONET
+  static void *RoundThread(void *arg) {
+    Round *round = (Round *)arg;
+    round->getanswers->Loop();
+    return NULL;
+  }
+#endif
+
+  // Starts scoring each of the nexts, played from current_state
+  // after prefix (which can be empty), against the futures. If
+  // next_states is non-NULL, it's parallel to nexts, and each
+  // non-empty entry is the state after playing that next; then
+  // there can't be a prefix. With MARIONET and background set, the
+  // helpers are working on it when this returns. Pass the result
+  // to FinishRound or DiscardRound.
+  Round *StartRound(const vector< vector<uint8> > &nexts,
+		    const vector< vector<uint8> > *next_states,
 		    const vector<Future> &futures,
-		    // morally const
-		    vector<uint8> &current_state,
-		    const vector<uint8> &current_memory,
-		    vector<double> *futuretotals,
-		    int *best_next_idx) {
-    uint64 start_time = time(NULL);
-    fprintf(stderr, "Parallel step with %zu nexts, %zu futures.\n",
-	    nexts.size(), futures.size());
+		    const vector<uint8> &current_state,
+		    const vector<uint8> &prefix,
+		    bool background) {
+    fprintf(stderr, "Parallel step with %zu nexts, %zu futures%s.\n",
+	    nexts.size(), futures.size(),
+	    prefix.empty() ? "" : " (after the last choice)");
     CHECK(nexts.size() > 0);
-    *best_next_idx = 0;
+    CHECK(next_states == NULL || next_states->size() == nexts.size());
+    CHECK(next_states == NULL || prefix.empty());
 
-    double best_score = 0.0;
-    Scoredist distribution(movie.size());
+    Round *round = new Round;
+    round->nexts = nexts;
+    round->start_time = time(NULL);
 
 #ifdef MARIONET
     // One piece of work per request.
-    vector<HelperRequest> requests;
-    requests.resize(nexts.size());
+    round->requests.resize(nexts.size());
+    // Route by the start of the next, which is usually a motif, so
+    // each helper keeps playing the same few.
     for (int i = 0; i < nexts.size(); i++) {
-      PlayFunRequest *req = requests[i].mutable_playfun();
+      round->affinity.push_back(AffinityKey(&nexts[i][0],
+					    min((size_t)INPUTS_PER_NEXT,
+						nexts[i].size())));
+      round->requests[i].mutable_tenant()->CopyFrom(tenant_);
+      PlayFunRequest *req = round->requests[i].mutable_playfun();
       req->set_current_state(&(current_state[0]), current_state.size());
       req->set_next(&nexts[i][0], nexts[i].size());
+      if (!prefix.empty()) {
+	req->set_prefix(&prefix[0], prefix.size());
+      }
+      if (next_states != NULL && !(*next_states)[i].empty()) {
+	req->set_next_state(&(*next_states)[i][0], (*next_states)[i].size());
+      }
       for (int f = 0; f < futures.size(); f++) {
 	FutureProto *fp = req->add_futures();
 	fp->set_inputs(&futures[f].inputs[0],
@@ -860,12 +1488,61 @@ struct PlayFun {
       }
       // if (!i) fprintf(stderr, "REQ: %s\n", req->DebugString().c_str());
     }
+    round->getanswers =
+      new GetAnswers<HelperRequest, PlayFunResponse>(forward_ports_,
+						      round->requests,
+						      &round->affinity);
+    round->getanswers->SetObservations(&observation_log_);
+    round->background = background;
+    if (background) {
+      CHECK(0 == pthread_create(&round->thread, NULL, RoundThread, round));
+    }
+#else
+    // Local version just does the work in FinishRound.
+    if (next_states != NULL) round->next_states = *next_states;
+    round->futures = futures;
+    round->current_state = current_state;
+    PlayPrefix(prefix, &round->current_state);
+#endif
+    return round;
+  }
 
-    GetAnswers<HelperRequest, PlayFunResponse> getanswers(ports_, requests);
-    getanswers.Loop();
+  // Waits for the round and deletes it without looking at the results,
+  // e.g. because it started from a state that we backtracked away from.
+  void DiscardRound(Round *round) {
+#ifdef MARIONET
+    if (round->background) {
+      CHECK(0 == pthread_join(round->thread, NULL));
+    }
+    delete round->getanswers;
+#endif
+    fprintf(stderr, "Discarded a parallel step.\n");
+    delete round;
+  }
+
+  // Gets the results of the round (doing the work now if it isn't
+  // in the background) and deletes it. The score for each future
+  // is added into futuretotals, and the index of the best next is
+  // returned in best_next_idx. If dist is non-NULL, the scores are
+  // copied there. The emulator state is not preserved.
+  void FinishRound(Round *round,
+		   vector<double> *futuretotals,
+		   int *best_next_idx,
+		   Scoredist *dist = NULL) {
+    *best_next_idx = 0;
+
+    double best_score = 0.0;
+    Scoredist distribution(movie.size());
+
+#ifdef MARIONET
+    if (round->background) {
+      CHECK(0 == pthread_join(round->thread, NULL));
+    } else {
+      round->getanswers->Loop();
+    }
 
     const vector<GetAnswers<HelperRequest, PlayFunResponse>::Work> &work =
-      getanswers.GetWork();
+      round->getanswers->GetWork();
 
     for (int i = 0; i < work.size(); i++) {
       const PlayFunResponse &res = work[i].res;
@@ -879,23 +1556,29 @@ struct PlayFun {
       distribution.immediates.push_back(res.immediate_score());
       distribution.positives.push_back(res.best_future_score());
       distribution.negatives.push_back(res.worst_future_score());
-      // Even if it's not globally accurate, data is better than no data
-      // XXX norm score can't be computed in a distributed fashion.
+      // Helpers make the master's observations too (ObservationLog),
+      // though they may be a round behind.
       distribution.norms.push_back(res.normalized_score());
+      distribution.scores.push_back(score);
 
       if (score > best_score) {
 	best_score = score;
 	*best_next_idx = i;
       }
     }
+    delete round->getanswers;
 
 #else
     // Local version.
-    for (int i = 0; i < nexts.size(); i++) {
+    for (int i = 0; i < round->nexts.size(); i++) {
       double immediate_score, normalized_score,
 	     best_future_score, worst_future_score, future_score;
       vector<double> futurescores(NFUTURES, 0.0);
-      InnerLoop(nexts[i], futures, &current_state,
+      const vector<uint8> *next_state =
+	(!round->next_states.empty() && !round->next_states[i].empty()) ?
+	&round->next_states[i] : NULL;
+      InnerLoop(round->nexts[i], round->futures, &round->current_state,
+		next_state,
 		&immediate_score, &normalized_score,
 		&best_future_score, &worst_future_score,
 		&future_score, &futurescores);
@@ -908,9 +1591,8 @@ struct PlayFun {
       distribution.immediates.push_back(immediate_score);
       distribution.positives.push_back(best_future_score);
       distribution.negatives.push_back(worst_future_score);
-      // Even if it's not globally accurate, data is better than no data
-      // XXX norm score can't be computed in a distributed fashion.
       distribution.norms.push_back(normalized_score);
+      distribution.scores.push_back(score);
 
       if (score > best_score) {
 	best_score = score;
@@ -919,11 +1601,37 @@ struct PlayFun {
     }
 #endif
     distribution.chosen_idx = *best_next_idx;
-    distributions.push_back(distribution);
+    scores_report->Append(
+	StringPrintf("S(%zu,%zu,%s,%s,%s,%s);",
+		     distribution.startframe,
+		     distribution.chosen_idx,
+		     AppendReport::Array(distribution.immediates).c_str(),
+		     AppendReport::Array(distribution.positives).c_str(),
+		     AppendReport::Array(distribution.negatives).c_str(),
+		     AppendReport::Array(distribution.norms).c_str()));
+
+    if (dist != NULL) *dist = distribution;
 
     uint64 end_time = time(NULL);
     fprintf(stderr, "Parallel step took %d seconds, score %f.\n",
-	    (int)(end_time - start_time), best_score);
+	    (int)(end_time - round->start_time), best_score);
+    delete round;
+  }
+
+  // The parallel step. We either run it in serial locally
+  // (without MARIONET) or as jobs on helpers, via TCP.
+  // See StartRound for next_states.
+  void ParallelStep(const vector< vector<uint8> > &nexts,
+		    const vector< vector<uint8> > *next_states,
+		    const vector<Future> &futures,
+		    // morally const
+		    vector<uint8> &current_state,
+		    const vector<uint8> &current_memory,
+		    vector<double> *futuretotals,
+		    int *best_next_idx) {
+    Round *round = StartRound(nexts, next_states, futures, current_state,
+			      vector<uint8>(), false);
+    FinishRound(round, futuretotals, best_next_idx);
   }
 
   void PopulateFutures(vector<Future> *futures) {
@@ -1001,6 +1709,7 @@ struct PlayFun {
     // Occasionally, try something very different.
     if ((rc.Byte() & 7) == 0) {
       Dualize(&out.inputs, 0, out.inputs.size());
+      classes->Canonicalize(&out.inputs);
     }
     // TODO: More interesting mutations here (chop, ablate, reverse..)
 
@@ -1011,7 +1720,10 @@ struct PlayFun {
   // future. Commit to the step that has the best score among
   // those futures. Remove the futures that didn't perform well
   // overall, and replace them. Reweight motifs according... XXX
+  // next_states can give the end states of the nexts; see
+  // ParallelStep.
   void TakeBestAmong(const vector< vector<uint8> > &nexts,
+		     const vector< vector<uint8> > *next_states,
 		     const vector<string> &nextplanations,
 		     vector<Future> *futures,
 		     bool chopfutures) {
@@ -1032,17 +1744,31 @@ struct PlayFun {
 
     // Most of the computation happens here.
     int best_next_idx = -1;
-    ParallelStep(nexts, *futures,
+    ParallelStep(nexts, next_states, *futures,
 		 current_state, current_memory,
 		 &futuretotals,
 		 &best_next_idx);
     CHECK(best_next_idx >= 0);
     CHECK(best_next_idx < nexts.size());
 
+    UpdateFutures(futuretotals, nexts[best_next_idx].size(), chopfutures,
+		  futures);
+    CommitBest(current_state, current_memory,
+	       nexts[best_next_idx], nextplanations[best_next_idx]);
+    PopulateFutures(futures);
+  }
+
+  // After a parallel step, chops the chosen next's length off the
+  // head of each future (if chopfutures), drops the futures with the
+  // worst totals and adds mutants of the best one. PopulateFutures
+  // fills in the rest.
+  void UpdateFutures(vector<double> futuretotals,
+		     size_t choplength,
+		     bool chopfutures,
+		     vector<Future> *futures) {
     if (chopfutures) {
       // Chop the head off each future.
       LOG("Chop futures.\n");
-      const int choplength = nexts[best_next_idx].size();
       for (vector<Future>::iterator it = futures->begin();
            it != futures->end(); it++) {
 	vector<uint8> newf(it->inputs.begin() + choplength, it->inputs.end());
@@ -1100,13 +1826,20 @@ struct PlayFun {
     for (int t = 0; t < MUTATEFUTURES; t++) {
       futures->push_back(MutateFuture((*futures)[best_future_idx]));
     }
+  }
 
+  // Commits the chosen next from current_state, whose memory is
+  // current_memory, and reweights it if it's a motif.
+  void CommitBest(vector<uint8> &current_state,
+		  const vector<uint8> &current_memory,
+		  const vector<uint8> &next,
+		  const string &explanation) {
     // If in single mode, this is probably cached, but with
     // MARIONET this is usually a full replay.
-    // fprintf(stderr, "Replay %d moves\n", nexts[best_next_idx].size());
+    // fprintf(stderr, "Replay %d moves\n", next.size());
     Emulator::Load(&current_state);
-    for (int j = 0; j < nexts[best_next_idx].size(); j++) {
-      Commit(nexts[best_next_idx][j], nextplanations[best_next_idx]);
+    for (int j = 0; j < next.size(); j++) {
+      Commit(next[j], explanation);
     }
 
     // Now, if the motif we used was a local improvement to the
@@ -1114,14 +1847,14 @@ struct PlayFun {
     // This should be a motif in the normal case where we're trying
     // each motif, but when we use this to implement the best
     // backtrack plan, it usually won't be.
-    if (motifs->IsMotif(nexts[best_next_idx])) {
+    if (motifs->IsMotif(next)) {
       double total = motifs->GetTotalWeight();
-      motifs->Pick(nexts[best_next_idx]);
+      motifs->Pick(next);
       vector<uint8> new_memory;
       Emulator::GetMemory(&new_memory);
       double oldval = objectives->GetNormalizedValue(current_memory);
       double newval = objectives->GetNormalizedValue(new_memory);
-      double *weight = motifs->GetWeightPtr(nexts[best_next_idx]);
+      double *weight = motifs->GetWeightPtr(next);
       // Already checked it's a motif.
       CHECK(weight != NULL);
       if (newval > oldval) {
@@ -1141,9 +1874,117 @@ struct PlayFun {
 	  fprintf(stderr, "motif is already at min frac: %f\n", d);
 	}
       }
+      ReportMotif(next, *weight);
     }
+  }
 
-    PopulateFutures(futures);
+  // Like TakeBestAmong for a round that was started from the current
+  // state, with its futures. If pipeline is true, the following
+  // round is started before we commit, so that the helpers work on
+  // it (playing this round's choice first) while we do. It's
+  // returned, and must be passed back here or to DiscardRound. Its
+  // futures are populated before the chosen motif is reweighted, so
+  // then reweighting only affects the round after that.
+  Round *FinishAndCommit(Round *round,
+			 vector<Future> *futures,
+			 bool pipeline) {
+    if (futures->size() != NFUTURES) {
+      fprintf(stderr, "?? Expected futures to have size %d but "
+	      "it has %zu.\n", NFUTURES, futures->size());
+    }
+
+    vector<uint8> current_state;
+    vector<uint8> current_memory;
+    Emulator::Save(&current_state);
+    Emulator::GetMemory(&current_memory);
+
+    // FinishRound deletes it.
+    const vector< vector<uint8> > nexts = round->nexts;
+    const vector<string> nextplanations = round->nextplanations;
+
+    vector<double> futuretotals(futures->size(), 0.0);
+    int best_next_idx = -1;
+    Scoredist dist;
+    FinishRound(round, &futuretotals, &best_next_idx, &dist);
+    CHECK(best_next_idx >= 0);
+    CHECK(best_next_idx < nexts.size());
+    const vector<uint8> &next = nexts[best_next_idx];
+    AdaptNextLength(dist);
+
+    UpdateFutures(futuretotals, next.size(), true, futures);
+
+    Round *following = NULL;
+    if (pipeline) {
+      PopulateFutures(futures);
+      vector< vector<uint8> > nextnexts;
+      vector<string> nextnextplanations;
+      MakeNexts(*futures, &nextnexts, &nextnextplanations);
+      following = StartRound(nextnexts, NULL, *futures,
+			     current_state, next, true);
+      following->nextplanations = nextnextplanations;
+    }
+
+    CommitBest(current_state, current_memory,
+	       next, nextplanations[best_next_idx]);
+    if (!pipeline) {
+      PopulateFutures(futures);
+    }
+    return following;
+  }
+
+  // Backtracking is every TRY_BACKTRACK_EVERY inputs, roughly, but
+  // counted in rounds.
+  int RoundsPerBacktrack() const {
+    return max(1, (int)(TRY_BACKTRACK_EVERY / next_length_));
+  }
+
+  // Picks the length of the nexts in the following rounds from how
+  // much the choice mattered in this one. See NEXT_SPREAD_LOW.
+  void AdaptNextLength(const Scoredist &dist) {
+    if (min_next_ == max_next_ || dist.scores.empty()) return;
+
+    const size_t chosen = dist.chosen_idx;
+    const double best = dist.scores[chosen];
+    double mean = 0.0;
+    for (int i = 0; i < dist.scores.size(); i++) {
+      mean += dist.scores[i];
+    }
+    mean /= dist.scores.size();
+    const double spread = (best - mean) / (fabs(best) + fabs(mean) + 1e-9);
+    // The worst future after the chosen next loses more than the
+    // best one gains.
+    const bool disagree = -dist.negatives[chosen] > dist.positives[chosen];
+
+    size_t length = next_length_;
+    if (spread > NEXT_SPREAD_HIGH || disagree) {
+      length = max(min_next_, length / 2);
+    } else if (spread < NEXT_SPREAD_LOW) {
+      length = min(max_next_, length * 2);
+    }
+
+    if (length != next_length_) {
+      fprintf(stderr, "Spread %.3f%s; nexts now have %zu inputs.\n",
+	      spread, disagree ? " and futures disagree" : "", length);
+      next_length_ = length;
+    }
+  }
+
+  // Whether FinishAndCommit should start the next round early. Not
+  // without helpers, since there's nothing to overlap with, nor if
+  // MaybeBacktrack may be about to rewind, which would waste it, or
+  // start a job on some of the helpers.
+  bool CanPipeline(int rounds_until_backtrack) {
+    #ifdef MARIONET
+    if (!TRY_BACKTRACK || rounds_until_backtrack > 1)
+      return true;
+    // If there's a job running, MaybeBacktrack waits for it rather
+    // than backtracking again. Otherwise it backtracks, and even if
+    // that's in the background, the next round would already be
+    // using the helpers it gives the job.
+    return backtrack_job != NULL;
+    #else
+    return false;
+    #endif
   }
 
   // Main loop for the master, or when compiled without MARIONET support.
@@ -1152,6 +1993,37 @@ struct PlayFun {
   void Master(const vector<int> &helpers) {
     // XXX
     ports_ = helpers;
+    #ifdef MARIONET
+    forward_ports_ = helpers;
+    observation_log_.SetHelpers(helpers);
+    backtrack_job = NULL;
+    #endif
+
+    // Futures are chopped by a next each round and refilled only
+    // up to their desired length, so nexts can't be longer than
+    // the shortest one.
+    min_next_ = config.min_next > 0 ? config.min_next : INPUTS_PER_NEXT;
+    max_next_ = config.max_next > 0 ? config.max_next : INPUTS_PER_NEXT;
+    max_next_ = min(max((size_t)1, max_next_), (size_t)MINFUTURELENGTH);
+    min_next_ = min(max((size_t)1, min_next_), max_next_);
+    next_length_ = min(max((size_t)INPUTS_PER_NEXT, min_next_), max_next_);
+    if (min_next_ != max_next_) {
+      fprintf(stderr, "Nexts have %zu to %zu inputs.\n",
+	      min_next_, max_next_);
+    }
+
+    // Movies and diagnostics are written in the background.
+    writer = new AsyncWriter;
+    StartReports();
+
+    // The movie so far is written all at once; after this it's
+    // streamed to the log as we commit.
+    inputlog = new InputLogWriter(config.game + "-playfun.inputs",
+				  config.romchecksum);
+    for (int i = 0; i < movie.size(); i++) {
+      inputlog->Append(movie[i], subtitles[i]);
+    }
+    inputlog->Flush();
 
     log = fopen((config.game+ "-log.html").c_str(), "w");
     CHECK(log != NULL);
@@ -1180,20 +2052,31 @@ struct PlayFun {
     // XXX recycling futures...
     vector<Future> futures;
 
-    int rounds_until_backtrack = TRY_BACKTRACK_EVERY / INPUTS_PER_NEXT;
+    int rounds_until_backtrack = RoundsPerBacktrack();
     uint64 iters = 1;
 
     PopulateFutures(&futures);
+    // The next round, if it was started early.
+    Round *round = NULL;
     for (;; iters++) {
 
       // XXX TODO this probably gets confused by backtracking.
-      motifs->Checkpoint(movie.size());
-
-      vector< vector<uint8> > nexts;
-      vector<string> nextplanations;
-      MakeNexts(futures, &nexts, &nextplanations);
+      motifs_report->Append(StringPrintf("F(%zu);", movie.size()));
+
+      if (round == NULL) {
+	vector< vector<uint8> > nexts;
+	vector<string> nextplanations;
+	MakeNexts(futures, &nexts, &nextplanations);
+
+	vector<uint8> current_state;
+	Emulator::Save(&current_state);
+	round = StartRound(nexts, NULL, futures, current_state,
+			   vector<uint8>(), false);
+	round->nextplanations = nextplanations;
+      }
 
-      TakeBestAmong(nexts, nextplanations, &futures, true);
+      round = FinishAndCommit(round, &futures,
+			      CanPipeline(rounds_until_backtrack));
 
       fprintf(stderr, "%llu rounds, "
 	      ANSI_CYAN "%zu inputs" ANSI_RESET ". backtrack in %d. "
@@ -1213,7 +2096,12 @@ struct PlayFun {
 
       // In theory diagnostics could assist backtrack, right?
       // So do this last.
-      MaybeBacktrack(iters, &rounds_until_backtrack, &futures);
+      if (MaybeBacktrack(iters, &rounds_until_backtrack, &futures) &&
+	  round != NULL) {
+	// It was started from a state we're no longer in.
+	DiscardRound(round);
+	round = NULL;
+      }
     }
   }
 
@@ -1224,9 +2112,9 @@ struct PlayFun {
 
     map< vector<uint8>, string > todo;
     for (int i = 0; i < futures.size(); i++) {
-      if (futures[i].inputs.size() >= INPUTS_PER_NEXT) {
+      if (futures[i].inputs.size() >= next_length_) {
 	vector<uint8> nf(futures[i].inputs.begin(),
-			 futures[i].inputs.begin() + INPUTS_PER_NEXT);
+			 futures[i].inputs.begin() + next_length_);
 	if (!todo.count(nf)) {
 	  todo.insert(make_pair(nf, StringPrintf("ftr-%d", i)));
 	}
@@ -1234,15 +2122,29 @@ struct PlayFun {
     }
 
     // There may be duplicates (typical, in fact). Insert motifs
-    // as long as we can.
+    // as long as we can. Motifs that are equivalent to something
+    // we already have are skipped. If nexts are longer than motifs,
+    // the rest is more weighted motifs.
+    set< vector<uint8> > tried;
     while (todo.size() < NFUTURES) {
-      const vector<uint8> *motif = motifs->RandomWeightedMotifNotIn(todo);
+      const vector<uint8> *motif = motifs->RandomWeightedMotifNotIn(tried);
       if (motif == NULL) {
 	fprintf(stderr, "No more motifs (have %zu todo).\n", todo.size());
 	break;
       }
+      tried.insert(*motif);
 
-      todo.insert(make_pair(*motif, "backfill"));
+      vector<uint8> next(*motif);
+      while (next.size() < next_length_) {
+	const vector<uint8> &m = motifs->RandomWeightedMotif();
+	if (m.empty()) break;
+	next.insert(next.end(), m.begin(), m.end());
+      }
+      next.resize(next_length_);
+      classes->Canonicalize(&next);
+      if (!todo.count(next)) {
+	todo.insert(make_pair(next, "backfill"));
+      }
     }
 
     // Now populate nexts and explanations.
@@ -1255,25 +2157,27 @@ struct PlayFun {
     }
   }
 
-  void TryImprove(Checkpoint *start,
-		  const vector<uint8> &improveme,
-		  const vector<uint8> &current_state,
-		  vector<Replacement> *replacements,
-		  double *improvability) {
-
-    uint64 start_time = time(NULL);
-    fprintf(stderr, "TryImprove step on %zu inputs.\n",
-	    improveme.size());
-    CHECK(replacements);
-    replacements->clear();
-
+  #ifdef MARIONET
+  // Makes the helper requests for TryImprove. This uses the emulator,
+  // so it has to run on the main thread.
+  void MakeImproveRequests(Checkpoint *start,
+			   const vector<uint8> &improveme,
+			   const vector<uint8> &current_state,
+			   vector<HelperRequest> *requests,
+			   vector<uint64> *affinity) {
     const double current_integral =
       ScoreIntegral(&start->save, improveme, NULL);
+    // That stops early if the watch comes true, so it doesn't
+    // necessarily leave the emulator at the current state. Put it back.
+    {
+      vector<uint8> state(current_state);
+      Emulator::Load(&state);
+    }
 
     fprintf(log, "<li>Trying to improve frames %zu&ndash;%zu, %f</li>\n",
-	    start->movenum, movie.size(), current_integral);
+	    start->movenum, start->movenum + improveme.size(),
+	    current_integral);
 
-    #ifdef MARIONET
     static const int MAXBEST = 2;
 
     // For random, we could compute the right number of
@@ -1297,9 +2201,6 @@ struct PlayFun {
     static const bool TRY_DUALIZE = true;
     static const int DUALIZE_ITERS = 200;
 
-    // One piece of work per request.
-    vector<HelperRequest> requests;
-
     // Every request shares this stuff.
     TryImproveRequest base_req;
     base_req.set_start_state(&start->save[0], start->save.size());
@@ -1316,7 +2217,7 @@ struct PlayFun {
 
       HelperRequest hreq;
       hreq.mutable_tryimprove()->MergeFrom(req);
-      requests.push_back(hreq);
+      requests->push_back(hreq);
     }
 
     for (int i = 0; i < NUM_ABLATE; i++) {
@@ -1327,7 +2228,7 @@ struct PlayFun {
 
       HelperRequest hreq;
       hreq.mutable_tryimprove()->MergeFrom(req);
-      requests.push_back(hreq);
+      requests->push_back(hreq);
     }
 
     for (int i = 0; i < NUM_CHOP; i++) {
@@ -1338,7 +2239,7 @@ struct PlayFun {
 
       HelperRequest hreq;
       hreq.mutable_tryimprove()->MergeFrom(req);
-      requests.push_back(hreq);
+      requests->push_back(hreq);
     }
 
     for (int i = 0; i < NUM_SHUFFLE; i++) {
@@ -1349,7 +2250,7 @@ struct PlayFun {
 
       HelperRequest hreq;
       hreq.mutable_tryimprove()->MergeFrom(req);
-      requests.push_back(hreq);
+      requests->push_back(hreq);
     }
 
     for (int i = 0; i < NUM_IMPROVE_RANDOM; i++) {
@@ -1360,17 +2261,29 @@ struct PlayFun {
 
       HelperRequest hreq;
       hreq.mutable_tryimprove()->MergeFrom(req);
-      requests.push_back(hreq);
+      requests->push_back(hreq);
     }
 
-    GetAnswers<HelperRequest, TryImproveResponse>
-      getanswers(ports_, requests);
-    getanswers.Loop();
+    for (int i = 0; i < requests->size(); i++) {
+      (*requests)[i].mutable_tenant()->CopyFrom(tenant_);
+    }
+
+    // Seeds include the checkpoint, so backtracking from the same
+    // checkpoint again sends each one to the helper that has
+    // already stepped from there.
+    for (int i = 0; i < requests->size(); i++) {
+      const string &seed = (*requests)[i].tryimprove().seed();
+      affinity->push_back(AffinityKey((const uint8 *)seed.c_str(),
+				      seed.size()));
+    }
+  }
 
-    const vector<GetAnswers<HelperRequest,
-			    TryImproveResponse>::Work> &work =
-      getanswers.GetWork();
+  typedef GetAnswers<HelperRequest, TryImproveResponse> ImproveAnswers;
 
+  // Reads the replacements out of the helpers' answers.
+  void ReadImproveAnswers(const vector<ImproveAnswers::Work> &work,
+			  vector<Replacement> *replacements,
+			  double *improvability) {
     fprintf(log, "<li>Attempts at improving:\n<ul>");
     int numer = 0, denom = 0;
     for (int i = 0; i < work.size(); i++) {
@@ -1385,6 +2298,9 @@ struct PlayFun {
 		       req.iters(),
 		       req.seed().c_str());
 	ReadBytesFromProto(res.inputs(j), &r.inputs);
+	// Older helpers don't send these.
+	if (j < res.end_state_size())
+	  ReadBytesFromProto(res.end_state(j), &r.end_state);
 	r.score = res.score(j);
 	replacements->push_back(r);
       }
@@ -1400,6 +2316,33 @@ struct PlayFun {
     fprintf(log, "</ul></li><li> ... (total %d/%d = %.1f%%)</li>\n",
 	    numer, denom, (100.0 * numer) / denom);
     *improvability = (double)numer / denom;
+  }
+  #endif
+
+  void TryImprove(Checkpoint *start,
+		  const vector<uint8> &improveme,
+		  const vector<uint8> &current_state,
+		  vector<Replacement> *replacements,
+		  double *improvability) {
+
+    uint64 start_time = time(NULL);
+    fprintf(stderr, "TryImprove step on %zu inputs.\n",
+	    improveme.size());
+    CHECK(replacements);
+    replacements->clear();
+
+    #ifdef MARIONET
+    // One piece of work per request.
+    vector<HelperRequest> requests;
+    vector<uint64> affinity;
+    MakeImproveRequests(start, improveme, current_state,
+			&requests, &affinity);
+
+    ImproveAnswers getanswers(ports_, requests, &affinity);
+    getanswers.SetObservations(&observation_log_);
+    getanswers.Loop();
+
+    ReadImproveAnswers(getanswers.GetWork(), replacements, improvability);
 
     #else
     // This is optional, so if there's no MARIONET, skip for now.
@@ -1423,12 +2366,258 @@ struct PlayFun {
     return NULL;
   }
 
+  // Describes the replacements that TryImprove found. Returns false
+  // if there aren't any.
+  bool ReportReplacements(const vector<Replacement> &replacements,
+			  double improvability,
+			  size_t nmoves) {
+    if (replacements.empty()) {
+      fprintf(stderr,
+	      ANSI_GREEN "There were no superior replacements."
+	      ANSI_RESET "\n");
+      return false;
+    } else if (improvability < 0.05) {
+      fprintf(stderr,
+	      "Improvability only " ANSI_GREEN "%.2f%% :)" ANSI_RESET "\n",
+	      100.0 * improvability);
+    } else if (improvability > 0.30) {
+      fprintf(stderr,
+	      "Improvability high at " ANSI_RED "%.2f%% :(" ANSI_RESET "\n",
+	      100.0 * improvability);
+    } else {
+      fprintf(stderr, "Improvability is " ANSI_CYAN "%.2f%%" ANSI_RESET "\n",
+	      100.0 * improvability);
+    }
+
+    fprintf(stderr,
+	    "There are %zu+1 possible replacements for last %zu moves...\n",
+	    replacements.size(),
+	    nmoves);
+
+    for (int i = 0; i < replacements.size(); i++) {
+      fprintf(log,
+	      "<li>%zu inputs via %s, %.2f</li>\n",
+	      replacements[i].inputs.size(),
+	      replacements[i].method.c_str(),
+	      replacements[i].score);
+    }
+    fflush(log);
+    return true;
+  }
+
+  // The candidates to score in place of improveme (whose end state
+  // is end_state), with their end states and explanations.
+  void MakeCandidates(const vector<uint8> &improveme,
+		      const vector<uint8> &end_state,
+		      const vector<Replacement> &replacements,
+		      vector< vector<uint8> > *tryvec,
+		      vector< vector<uint8> > *trystates,
+		      vector<string> *trysplanations) {
+    set< vector<uint8> > tryme;
+    // Allow the existing sequence to be chosen if it's
+    // still better despite seeing these alternatives.
+    tryme.insert(improveme);
+    tryvec->push_back(improveme);
+    trystates->push_back(end_state);
+    // XXX better to keep whatever annotations were already there!
+    trysplanations->push_back("original");
+
+    for (int i = 0; i < replacements.size(); i++) {
+      // Currently ignores scores and methods. Make TakeBestAmong
+      // take annotated nexts so it can tell you which one it
+      // preferred. (Consider weights too..?)
+      if (!tryme.count(replacements[i].inputs)) {
+	tryme.insert(replacements[i].inputs);
+	tryvec->push_back(replacements[i].inputs);
+	trystates->push_back(replacements[i].end_state);
+	trysplanations->push_back(replacements[i].method);
+      }
+    }
+
+    if (tryvec->size() != replacements.size() + 1) {
+      fprintf(stderr, "... but there were %zu duplicates (removed).\n",
+	      (replacements.size() + 1) - tryvec->size());
+      fprintf(log, "<li><b>%zu total but there were %zu duplicates (removed)."
+	      "</b></li>\n",
+	      replacements.size() + 1,
+	      (replacements.size() + 1) - tryvec->size());
+      fflush(log);
+    }
+  }
+
+  #ifdef MARIONET
+  // A TryImprove running on some of the helpers, in its own thread,
+  // while the search goes on with the rest. Nothing else touches
+  // getanswers until done is set.
+  struct BacktrackJob {
+    Checkpoint start;
+    vector<uint8> improveme;
+    uint64 start_time;
+    vector<HelperRequest> requests;
+    vector<uint64> affinity;
+    ImproveAnswers *getanswers;
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    bool done;
+  };
+
+  static void *BacktrackThread(void *arg) {
+    BacktrackJob *job = (BacktrackJob *)arg;
+    job->getanswers->Loop();
+    pthread_mutex_lock(&job->mutex);
+    job->done = true;
+    pthread_mutex_unlock(&job->mutex);
+    return NULL;
+  }
+
+  bool BacktrackJobDone() {
+    CHECK(backtrack_job != NULL);
+    pthread_mutex_lock(&backtrack_job->mutex);
+    const bool done = backtrack_job->done;
+    pthread_mutex_unlock(&backtrack_job->mutex);
+    return done;
+  }
+
+  // Number of helpers to backtrack on in the background, or 0 if
+  // there are too few to split.
+  int BacktrackHelpers() const {
+    const int num = (int)(config.backtrack_helpers * ports_.size());
+    return (num <= 0 || num >= ports_.size()) ? 0 : num;
+  }
+
+  // Starts improving the inputs since start in the background, on
+  // BacktrackHelpers() of the helpers. Returns false if there are
+  // too few helpers to split, in which case the caller should
+  // backtrack synchronously.
+  bool StartBacktrackJob(Checkpoint *start,
+			 const vector<uint8> &improveme,
+			 const vector<uint8> &current_state) {
+    CHECK(backtrack_job == NULL);
+    const int num = BacktrackHelpers();
+    if (num == 0)
+      return false;
+
+    fprintf(stderr, "TryImprove step on %zu inputs, on %d helpers "
+	    "in the background.\n", improveme.size(), num);
+    BacktrackJob *job = new BacktrackJob;
+    job->start = *start;
+    job->improveme = improveme;
+    job->start_time = time(NULL);
+    MakeImproveRequests(start, improveme, current_state,
+			&job->requests, &job->affinity);
+    fflush(log);
+
+    vector<int> ports(ports_.end() - num, ports_.end());
+    forward_ports_.assign(ports_.begin(), ports_.end() - num);
+    job->getanswers =
+      new ImproveAnswers(ports, job->requests, &job->affinity);
+    job->getanswers->SetObservations(&observation_log_);
+    // The forward search draws its own meter.
+    job->getanswers->SetQuiet();
+    job->done = false;
+    CHECK(0 == pthread_mutex_init(&job->mutex, NULL));
+    CHECK(0 == pthread_create(&job->thread, NULL, BacktrackThread, job));
+    backtrack_job = job;
+    return true;
+  }
+
+  // Merges a finished background backtrack. The candidates are scored
+  // from its checkpoint against everything since it, including the
+  // inputs committed while the job ran, since that's what a
+  // replacement would throw away. If one of them wins, we rewind to
+  // the checkpoint and commit it; otherwise the search just carries
+  // on from where it is. Returns true if it rewound.
+  bool FinishBacktrackJob(uint64 iters, vector<Future> *futures) {
+    BacktrackJob *job = backtrack_job;
+    CHECK(0 == pthread_join(job->thread, NULL));
+    backtrack_job = NULL;
+    forward_ports_ = ports_;
 
-  void MaybeBacktrack(int iters,
+    fprintf(log,
+	    "<h2>Backtrack from frame %zu finished at iter %llu, "
+	    "end frame %zu.</h2>\n",
+	    job->start.movenum, iters, movie.size());
+    vector<Replacement> replacements;
+    double improvability = 0.0;
+    ReadImproveAnswers(job->getanswers->GetWork(),
+		       &replacements, &improvability);
+    fprintf(stderr, "TryImprove took %d seconds in the background.\n",
+	    (int)(time(NULL) - job->start_time));
+
+    const size_t nmoves = job->improveme.size();
+    // Only backtracking rewinds, so these are still in the movie.
+    CHECK(movie.size() >= job->start.movenum + nmoves);
+    bool rewound = false;
+    if (ReportReplacements(replacements, improvability, nmoves)) {
+      vector<uint8> now_state;
+      Emulator::Save(&now_state);
+
+      const vector<uint8> sofar(movie.begin() + job->start.movenum,
+				movie.end());
+      vector< vector<uint8> > tryvec, trystates;
+      vector<string> trysplanations;
+      MakeCandidates(sofar, now_state, replacements,
+		     &tryvec, &trystates, &trysplanations);
+
+      Emulator::Load(&job->start.save);
+      vector<uint8> start_memory;
+      Emulator::GetMemory(&start_memory);
+      vector<double> futuretotals(futures->size(), 0.0);
+      int best_idx = -1;
+      ParallelStep(tryvec, &trystates, *futures,
+		   job->start.save, start_memory,
+		   &futuretotals, &best_idx);
+      CHECK(best_idx >= 0);
+
+      if (best_idx == 0) {
+	fprintf(stderr, "The original is still best.\n");
+	fprintf(log, "<li>Kept the original.</li>\n");
+	Emulator::Load(&now_state);
+      } else {
+	fprintf(stderr, "Replacing %zu moves with %s, dropping %zu "
+		"since.\n",
+		nmoves, trysplanations[best_idx].c_str(),
+		movie.size() - (job->start.movenum + nmoves));
+	fprintf(log, "<li>Replaced with %s.</li>\n",
+		trysplanations[best_idx].c_str());
+	Rewind(job->start.movenum);
+	Emulator::Load(&job->start.save);
+	rewound = true;
+	for (int j = 0; j < tryvec[best_idx].size(); j++) {
+	  Commit(tryvec[best_idx][j], trysplanations[best_idx]);
+	}
+
+	const string backtrackfile =
+	  StringPrintf((config.game+ "-playfun-backtrack-%llu.fm2").c_str(),
+		       iters);
+	writer->Enqueue(backtrackfile,
+			new MovieJob(backtrackfile, config, movie, subtitles));
+      }
+      fflush(log);
+    }
+
+    CHECK(0 == pthread_mutex_destroy(&job->mutex));
+    delete job->getanswers;
+    delete job;
+    return rewound;
+  }
+  #endif
+
+  // Returns true if it changed the movie, the current state or the
+  // futures.
+  bool MaybeBacktrack(int iters,
 		      int *rounds_until_backtrack,
 		      vector<Future> *futures) {
     if (!TRY_BACKTRACK)
-      return;
+      return false;
+
+    bool changed = false;
+    #ifdef MARIONET
+    // Merge a background backtrack at the first chance.
+    if (backtrack_job != NULL && BacktrackJobDone()) {
+      changed = FinishBacktrackJob(iters, futures);
+    }
+    #endif
 
     // Now consider backtracking.
     // TODO: We could trigger a backtrack step whenever we feel
@@ -1442,7 +2631,15 @@ struct PlayFun {
     // then we have less opportunity to get it wrong.
     --*rounds_until_backtrack;
     if (*rounds_until_backtrack <= 0) {
-      *rounds_until_backtrack = TRY_BACKTRACK_EVERY / INPUTS_PER_NEXT;
+      #ifdef MARIONET
+      // Only one at a time.
+      if (backtrack_job != NULL) {
+	*rounds_until_backtrack = 1;
+	return changed;
+      }
+      #endif
+
+      *rounds_until_backtrack = RoundsPerBacktrack();
       LOG(" ** backtrack time. **\n");
       uint64 start_time = time(NULL);
 
@@ -1476,7 +2673,7 @@ struct PlayFun {
       if (start_ptr == NULL) {
 	fprintf(stderr, "No checkpoint to try backtracking.\n");
         *rounds_until_backtrack = 1;
-	return;
+	return changed;
       }
       // Copy, because stuff we do in here can resize the
       // checkpoints array and cause disappointment.
@@ -1489,95 +2686,45 @@ struct PlayFun {
 
       vector<uint8> current_state;
       Emulator::Save(&current_state);
+
+      #ifdef MARIONET
+      // If the helpers can be split, the rest happens when the
+      // job finishes.
+      if (StartBacktrackJob(&start, improveme, current_state))
+	return changed;
+      #endif
+
       vector<Replacement> replacements;
       double improvability = 0.0;
       TryImprove(&start, improveme, current_state,
 		 &replacements, &improvability);
-      if (replacements.empty()) {
-	fprintf(stderr,
-		ANSI_GREEN "There were no superior replacements."
-		ANSI_RESET "\n");
-	return;
-      } else if (improvability < 0.05) {
-	fprintf(stderr,
-		"Improvability only " ANSI_GREEN "%.2f%% :)" ANSI_RESET "\n",
-		100.0 * improvability);
-      } else if (improvability > 0.30) {
-	fprintf(stderr,
-		"Improvability high at " ANSI_RED "%.2f%% :(" ANSI_RESET "\n",
-		100.0 * improvability);
-      } else {
-	fprintf(stderr, "Improvability is " ANSI_CYAN "%.2f%%" ANSI_RESET "\n",
-		100.0 * improvability);
-      }
+      if (!ReportReplacements(replacements, improvability, nmoves))
+	return changed;
 
       // Rather than trying to find the best immediate one (we might
       // be hovering above a pit about to die, so we do need to look
       // into the future), use the standard TakeBestAmong to score all
       // the potential improvements, as well as the current best.
-      fprintf(stderr,
-	      "There are %zu+1 possible replacements for last %zu moves...\n",
-	      replacements.size(),
-	      nmoves);
-
-      for (int i = 0; i < replacements.size(); i++) {
-	fprintf(log,
-		"<li>%zu inputs via %s, %.2f</li>\n",
-		replacements[i].inputs.size(),
-		replacements[i].method.c_str(),
-		replacements[i].score);
-      }
-      fflush(log);
 
       // PERF Perhaps movie is already rewound?
       Rewind(start.movenum);
       Emulator::Load(&start.save);
 
-      set< vector<uint8> > tryme;
-      vector< vector<uint8> > tryvec;
+      // End states, so that the candidates aren't replayed
+      // before trying futures from them.
+      vector< vector<uint8> > tryvec, trystates;
       vector<string> trysplanations;
-      // Allow the existing sequence to be chosen if it's
-      // still better despite seeing these alternatives.
-      tryme.insert(improveme);
-      tryvec.push_back(improveme);
-      // XXX better to keep whatever annotations were already there!
-      trysplanations.push_back("original");
-
-      for (int i = 0; i < replacements.size(); i++) {
-	// Currently ignores scores and methods. Make TakeBestAmong
-	// take annotated nexts so it can tell you which one it
-	// preferred. (Consider weights too..?)
-	if (!tryme.count(replacements[i].inputs)) {
-	  tryme.insert(replacements[i].inputs);
-	  tryvec.push_back(replacements[i].inputs);
-	  trysplanations.push_back(replacements[i].method);
-	}
-      }
-
-      // vector< vector<uint8> > tryvec(tryme.begin(), tryme.end());
-      if (tryvec.size() != replacements.size() + 1) {
-	fprintf(stderr, "... but there were %zu duplicates (removed).\n",
-		(replacements.size() + 1) - tryvec.size());
-	fprintf(log, "<li><b>%zu total but there were %zu duplicates (removed)."
-		"</b></li>\n",
-		replacements.size() + 1,
-		(replacements.size() + 1) - tryvec.size());
-	fflush(log);
-      }
+      MakeCandidates(improveme, current_state, replacements,
+		     &tryvec, &trystates, &trysplanations);
 
-      // PERF could be passing along the end state for these, to
-      // avoid the initial replay. If they happen to go back to the
-      // same helper that computed it in the first place, it'd be
-      // cached, at least.
-      TakeBestAmong(tryvec, trysplanations, futures, false);
+      TakeBestAmong(tryvec, &trystates, trysplanations, futures, false);
 
       fprintf(stderr, "Write improvement movie.\n");
-      SimpleFM2::WriteInputsWithSubtitles(
-	  StringPrintf((config.game+ "-playfun-backtrack-%llu.fm2").c_str(), iters),
-	  (config.game+ ".nes").c_str(),
-	  config,
-	  movie,
-	  subtitles);
+      const string backtrackfile =
+	StringPrintf((config.game+ "-playfun-backtrack-%llu.fm2").c_str(),
+		     iters);
+      writer->Enqueue(backtrackfile,
+		      new MovieJob(backtrackfile, config, movie, subtitles));
 
       // What to do about futures? This is simplest, I guess...
       uint64 end_time = time(NULL);
@@ -1589,22 +2736,34 @@ struct PlayFun {
 	      "<li>Backtracking took %llu seconds in total.</li>\n",
 	      end_time - start_time);
       fflush(log);
+      changed = true;
     }
+    return changed;
   }
 
+  // The input log is always current (once flushed), so this only
+  // occasionally snapshots the movie as FM2; that file is written by
+  // the writer thread.
   void SaveMovie(uint64 &iters) {
+    inputlog->Flush();
+    if (iters % SAVE_FM2_EVERY != 0)
+      return;
+
     printf("                     - writing movie -\n");
-    SimpleFM2::WriteInputsWithSubtitles(StringPrintf((config.game+ "-playfun-%llu.fm2").c_str(), iters),
-	(config.game+ ".nes").c_str(),
-	config,
-	movie,
-	subtitles);
+    const string filename =
+      StringPrintf((config.game+ "-playfun-%llu.fm2").c_str(), iters);
+    writer->Enqueue(filename,
+		    new MovieJob(filename, config, movie, subtitles));
     Emulator::PrintCacheStats();
   }
 
+  // The scores, objectives and motifs reports are appended to as
+  // we go (see StartReports), so this only needs to write the
+  // futures and the objectives along the current path. If the
+  // previous ones haven't been written yet, they're skipped, since
+  // these supersede them.
   void SaveDiagnostics(const vector<Future> &futures) {
     printf("                     - writing diagnostics -\n");
-    SaveFuturesHTML(futures, (config.game+ "-playfun-futures.html").c_str());
     #ifdef DEBUGFUTURES
     vector<uint8> fmovie = movie;
     const size_t size = fmovie.size();
@@ -1619,26 +2778,124 @@ struct PlayFun {
     }
     printf("Wrote %zu movie(s).\n", futures.size() + 1);
     #endif
-    SaveDistributionSVG(movie.size(), distributions, (config.game+ "-playfun-scores.svg").c_str());
-    objectives->SaveSVG(memories, (config.game+ "-playfun-futures.svg").c_str());
-    motifs->SaveHTML((config.game+ "-playfun-motifs.html").c_str());
-    printf("                     (wrote)\n");
+    const string filename = config.game + "-playfun-futures.html";
+    writer->Enqueue(filename, new FuturesJob(filename, futures));
+
+    // Bounded, because the history is.
+    const string svgfile = config.game + "-playfun-futures.svg";
+    writer->Enqueue(svgfile,
+		    new ObjectivesJob(svgfile, report_objectives, history));
+  }
+
+  // Most diagnostics grow with the length of the run, so rather
+  // than redraw them every SAVE_EVERY rounds, we append each round's
+  // data to an HTML report that draws itself when viewed.
+  void StartReports() {
+    scores_report =
+      new AppendReport(config.game + "-playfun-scores.html",
+		       config.game + " scores", "",
+		       REPORT_SVG_SCRIPT SCORES_SCRIPT);
+
+    // Like WeightedObjectives::SaveSVG, only draw the first 500.
+    vector< vector<int> > objs = objectives->GetObjectives();
+    if (objs.size() > 500) objs.resize(500);
+    report_objectives.clear();
+    string args;
+    for (int i = 0; i < objs.size(); i++) {
+      report_objectives.push_back(objs[i]);
+      args += (i ? "," : "") + AppendReport::Array(objs[i]);
+    }
+    objectives_report =
+      new AppendReport(config.game + "-playfun-objectives.html",
+		       config.game + " objectives", "",
+		       REPORT_SVG_SCRIPT OBJECTIVES_SCRIPT);
+    objectives_report->Append(StringPrintf("O(%d,[%s]);",
+					   OBSERVE_EVERY, args.c_str()));
+
+    motifs_report =
+      new AppendReport(config.game + "-playfun-motifs.html",
+		       config.game + " motifs", MOTIFS_STYLE,
+		       MOTIFS_SCRIPT);
+    motifs_report->Append(StringPrintf("F(%zu);", movie.size()));
+    for (int i = 0; i < motifvec.size(); i++) {
+      motifs_report->Append(
+	  StringPrintf("I(%s,%f);",
+		       AppendReport::Array(motifvec[i]).c_str(),
+		       *motifs->GetWeightPtr(motifvec[i])));
+    }
+  }
+
+  void ReportObservation(const vector<uint8> &mem) {
+    string args;
+    for (int i = 0; i < report_objectives.size(); i++) {
+      const vector<int> &obj = report_objectives[i];
+      vector<uint8> values(obj.size(), 0);
+      for (int j = 0; j < obj.size(); j++) {
+	values[j] = mem[obj[j]];
+      }
+      args += (i ? "," : "") + AppendReport::Hex(values);
+    }
+    objectives_report->Append("M([" + args + "]);");
+  }
+
+  void ReportMotif(const vector<uint8> &motif, double weight) {
+    // motifvec is in the same (sorted) order that the report
+    // was started with.
+    vector< vector<uint8> >::const_iterator it =
+      lower_bound(motifvec.begin(), motifvec.end(), motif);
+    CHECK(it != motifvec.end() && *it == motif);
+    motifs_report->Append(StringPrintf("W(%d,%f);",
+				       (int)(it - motifvec.begin()),
+				       weight));
   }
 
   // Ports for the helpers.
   vector<int> ports_;
-
-  // For making SVG.
-  vector<Scoredist> distributions;
+  #ifdef MARIONET
+  // The helpers that ParallelStep uses; all of them unless some
+  // are busy with backtrack_job.
+  vector<int> forward_ports_;
+  // Backtrack running in the background, or NULL. Owned.
+  BacktrackJob *backtrack_job;
+  // Describes our game; the master tags its requests with it.
+  TenantProto tenant_;
+  // For helpers, the games that have been asked for recently (see
+  // EvictIdleTenants), by TenantKey. Owned.
+  map<string, Tenant *> tenants_;
+  // The tenant whose ROM is loaded, or NULL.
+  Tenant *loaded_;
+  // Memory locations our objectives look at; see ObservedPositions.
+  vector<int> positions_;
+  // For the master, the observations we've made, compacted to
+  // positions_, that helpers may still need to make.
+  ObservationLog observation_log_;
+  #endif
 
   // Used to ffwd to gameplay.
   vector<uint8> solution;
 
   FILE *log;
+  // Owned. Only the master writes files.
+  AsyncWriter *writer;
+  // The current movie, streamed to disk. Owned; NULL in helpers.
+  InputLogWriter *inputlog;
+  // Appended to as the master runs. Owned; NULL in helpers.
+  AppendReport *scores_report;
+  AppendReport *objectives_report;
+  AppendReport *motifs_report;
+  // The objectives drawn in objectives_report, in order.
+  vector< vector<int> > report_objectives;
   ArcFour rc;
   WeightedObjectives *objectives;
   Motifs *motifs;
   vector< vector<uint8> > motifvec;
+  // Nexts and futures only use the canonical input of each class.
+  InputClasses *classes;
+  // When rollouts give up; see ScoreIntegral. May be NULL.
+  Watch *watch;
+  // Number of inputs in the nexts we make, between min_next_ and
+  // max_next_. See AdaptNextLength.
+  size_t next_length_, min_next_, max_next_;
 };
 
 /**
@@ -1661,6 +2918,7 @@ int main(int argc, char *argv[]) {
     fprintf(stderr, "Starting helper on port %d...\n", config.port);
     pf.Helper(config.port);
   } else {
+    if (config.fork_helpers) pf.ForkHelpers(config.helpers);
     pf.Master(config.helpers);
   }
   #else
@@ -0,0 +1,206 @@
+
+#include "ram-search.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <sstream>
+
+#include "fceu/driver.h"
+
+static const int RAM_SIZE = 0x800;
+
+struct PredicateName {
+  RamSearch::Predicate pred;
+  const char *name;
+  bool value;
+};
+
+static const PredicateName PREDICATES[] = {
+  { RamSearch::EQUAL, "equal", true },
+  { RamSearch::CONSTANT, "constant", false },
+  { RamSearch::CHANGING, "changing", false },
+  { RamSearch::INCREASING, "increasing", false },
+  { RamSearch::DECREASING, "decreasing", false },
+  { RamSearch::NONDECREASING, "nondecreasing", false },
+  { RamSearch::NONINCREASING, "nonincreasing", false },
+  { RamSearch::DELTA, "delta", true },
+};
+
+RamSearch::RamSearch() {
+  memset(keep, 1, sizeof (keep));
+}
+
+bool RamSearch::ParseFilters(const string &query, int num_memories,
+			     vector<Filter> *filters) {
+  stringstream all(query);
+  string part;
+  while (getline(all, part, ',')) {
+    stringstream words(part);
+    string name;
+    if (!(words >> name)) continue;
+
+    const PredicateName *pn = NULL;
+    for (int i = 0; i < sizeof (PREDICATES) / sizeof (PredicateName); i++) {
+      if (name == PREDICATES[i].name) pn = &PREDICATES[i];
+    }
+    if (pn == NULL) {
+      fprintf(stderr, "Unknown RAM search predicate \"%s\".\n", name.c_str());
+      return false;
+    }
+
+    Filter filter;
+    filter.pred = pn->pred;
+    if (pn->value && !(words >> filter.value)) {
+      fprintf(stderr, "RAM search predicate %s needs a value.\n", pn->name);
+      return false;
+    }
+    // Compared with bytes of RAM, so others would silently match
+    // something else or nothing.
+    if (pn->value && (filter.value < 0 || filter.value > 255)) {
+      fprintf(stderr, "RAM search predicate %s needs a value from 0 to "
+	      "255, not %d.\n", pn->name, filter.value);
+      return false;
+    }
+    if (words >> filter.first) {
+      if (!(words >> filter.last)) {
+	fprintf(stderr, "RAM search filter \"%s\" has a first memory "
+		"but no last.\n", part.c_str());
+	return false;
+      }
+    }
+    const int last = filter.last < 0 ? num_memories - 1 : filter.last;
+    if (filter.first < 0 || filter.first > last || last >= num_memories) {
+      fprintf(stderr, "RAM search filter \"%s\" needs memories from 0 "
+	      "to %d, first to last.\n", part.c_str(), num_memories - 1);
+      return false;
+    }
+    filters->push_back(filter);
+  }
+  return true;
+}
+
+void RamSearch::Apply(const Filter &filter,
+		      const vector< vector<uint8> > &memories) {
+  vector<const uint8 *> rows;
+  rows.reserve(memories.size());
+  for (int i = 0; i < memories.size(); i++) {
+    CHECK(memories[i].size() == RAM_SIZE);
+    rows.push_back(&memories[i][0]);
+  }
+  Apply(filter, rows);
+}
+
+void RamSearch::Apply(const Filter &filter,
+		      const vector<uint8> &mems, size_t num) {
+  CHECK(mems.size() >= num * RAM_SIZE);
+  vector<const uint8 *> rows;
+  rows.reserve(num);
+  for (size_t i = 0; i < num; i++) {
+    rows.push_back(&mems[i * RAM_SIZE]);
+  }
+  Apply(filter, rows);
+}
+
+// The loops below are kept simple (one comparison per byte, anded
+// in) so that the compiler turns each into vector instructions.
+// The switch is outside them.
+static void KeepEqual(uint8 *keep, const uint8 *cur, uint8 v) {
+  for (int a = 0; a < RAM_SIZE; a++) keep[a] &= cur[a] == v;
+}
+
+static void KeepStep(uint8 *keep, const uint8 *prev, const uint8 *cur,
+		     RamSearch::Predicate pred, uint8 v) {
+  switch (pred) {
+  case RamSearch::CONSTANT:
+    for (int a = 0; a < RAM_SIZE; a++) keep[a] &= cur[a] == prev[a];
+    break;
+  case RamSearch::CHANGING:
+    for (int a = 0; a < RAM_SIZE; a++) keep[a] &= cur[a] != prev[a];
+    break;
+  case RamSearch::INCREASING:
+    for (int a = 0; a < RAM_SIZE; a++) keep[a] &= cur[a] > prev[a];
+    break;
+  case RamSearch::DECREASING:
+    for (int a = 0; a < RAM_SIZE; a++) keep[a] &= cur[a] < prev[a];
+    break;
+  case RamSearch::NONDECREASING:
+    for (int a = 0; a < RAM_SIZE; a++) keep[a] &= cur[a] >= prev[a];
+    break;
+  case RamSearch::NONINCREASING:
+    for (int a = 0; a < RAM_SIZE; a++) keep[a] &= cur[a] <= prev[a];
+    break;
+  case RamSearch::DELTA:
+    // Same as the cheat search's absolute difference.
+    for (int a = 0; a < RAM_SIZE; a++) {
+      keep[a] &= (cur[a] > prev[a] ? cur[a] - prev[a] : prev[a] - cur[a]) == v;
+    }
+    break;
+  default:
+    CHECK(!"not a step predicate");
+  }
+}
+
+void RamSearch::Apply(const Filter &filter,
+		      const vector<const uint8 *> &rows) {
+  const int last = filter.last < 0 ? (int)rows.size() - 1 : filter.last;
+  CHECK(filter.first >= 0 && last < (int)rows.size());
+
+  // Stop early if nothing's left, but checking after every memory
+  // would cost about as much as the filter itself.
+  if (filter.pred == EQUAL) {
+    for (int i = filter.first; i <= last; i++) {
+      KeepEqual(keep, rows[i], filter.value);
+      if (i % 64 == 0 && NumCandidates() == 0) return;
+    }
+  } else {
+    for (int i = filter.first + 1; i <= last; i++) {
+      KeepStep(keep, rows[i - 1], rows[i], filter.pred, filter.value);
+      if (i % 64 == 0 && NumCandidates() == 0) return;
+    }
+  }
+}
+
+void RamSearch::Matching(const vector< vector<uint8> > &memories, int first,
+			 const vector<uint8> &values) {
+  CHECK(first >= 0 && first + values.size() <= memories.size());
+  for (int i = 0; i < values.size(); i++) {
+    CHECK(memories[first + i].size() == RAM_SIZE);
+    KeepEqual(keep, &memories[first + i][0], values[i]);
+  }
+}
+
+static int CollectCandidate(uint32 a, uint8 last, uint8 current, void *data) {
+  if (a < RAM_SIZE) ((vector<int> *)data)->push_back(a);
+  return 1;
+}
+
+void RamSearch::FromCheatSearch() {
+  vector<int> shown;
+  FCEUI_CheatSearchGet(CollectCandidate, &shown);
+  uint8 was[RAM_SIZE];
+  memcpy(was, keep, sizeof (keep));
+  memset(keep, 0, sizeof (keep));
+  for (int i = 0; i < shown.size(); i++) {
+    keep[shown[i]] = was[shown[i]];
+  }
+}
+
+void RamSearch::ToCheatSearch() const {
+  for (int a = 0; a < RAM_SIZE; a++) {
+    if (!keep[a]) FCEUI_CheatSearchExclude(a);
+  }
+}
+
+vector<int> RamSearch::Candidates() const {
+  vector<int> addrs;
+  for (int a = 0; a < RAM_SIZE; a++) {
+    if (keep[a]) addrs.push_back(a);
+  }
+  return addrs;
+}
+
+int RamSearch::NumCandidates() const {
+  int n = 0;
+  for (int a = 0; a < RAM_SIZE; a++) n += keep[a];
+  return n;
+}
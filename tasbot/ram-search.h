@@ -0,0 +1,93 @@
+/* Searches for the bytes of RAM that behave some way over many
+   memories at once, like the emulator's cheat search but over a
+   whole trace (or a pile of savestates' memories) rather than the
+   live RAM and one earlier snapshot. Useful for finding the bytes
+   behind an objective or a watch condition: which ones only go up
+   between two frames, which one equals the number of lives in every
+   memory, and so on.
+
+   Each filter runs over whole memories at a time, one 0x800-byte
+   row after another, with no branches per byte, so that the
+   compiler can vectorize it. */
+
+#ifndef __RAM_SEARCH_H
+#define __RAM_SEARCH_H
+
+#include <string>
+#include <vector>
+
+#include "fceu/types.h"
+#include "tasbot.h"
+
+using namespace std;
+
+struct RamSearch {
+  // Every byte of RAM is a candidate.
+  RamSearch();
+
+  enum Predicate {
+    // These hold for each memory.
+    EQUAL,
+    // These hold for each memory and the one before it.
+    CONSTANT,
+    CHANGING,
+    INCREASING,
+    DECREASING,
+    NONDECREASING,
+    NONINCREASING,
+    // The absolute difference is value.
+    DELTA,
+  };
+
+  struct Filter {
+    Filter() : pred(EQUAL), value(0), first(0), last(-1) {}
+    Predicate pred;
+    // For EQUAL and DELTA; 0 to 255.
+    int value;
+    // Memories first to last, inclusive. A last of -1 means the
+    // last memory.
+    int first, last;
+  };
+
+  // Parses filters separated by commas, each a predicate name (as
+  // above, but in lowercase), then its value if it takes one, then
+  // optionally the first and last memory, like
+  //   "nondecreasing 100 200, changing 150 151, equal 3"
+  // Returns false, after saying why, if it can't, if some value isn't
+  // a byte, or if some filter's memories aren't among the
+  // num_memories there are.
+  static bool ParseFilters(const string &query, int num_memories,
+                           vector<Filter> *filters);
+
+  // Keeps only the candidates for which the filter holds over
+  // memories, each 0x800 bytes.
+  void Apply(const Filter &filter, const vector< vector<uint8> > &memories);
+  // Same, for num memories stored one after another, as from
+  // RamTrace::Read.
+  void Apply(const Filter &filter, const vector<uint8> &mems, size_t num);
+
+  // Keeps only the candidates that equal values[i] in memory
+  // first + i, for each value. For instance, the number of lives
+  // as it was in each of a list of states.
+  void Matching(const vector< vector<uint8> > &memories, int first,
+                const vector<uint8> &values);
+
+  // With the emulator's cheat search (FCEUI_CheatSearch*), once it
+  // has begun: keeps only candidates that it hasn't excluded, or
+  // excludes addresses that aren't candidates.
+  void FromCheatSearch();
+  void ToCheatSearch() const;
+
+  bool IsCandidate(int addr) const { return keep[addr] != 0; }
+  vector<int> Candidates() const;
+  int NumCandidates() const;
+
+ private:
+  void Apply(const Filter &filter, const vector<const uint8 *> &rows);
+
+  // 1 for each candidate, 0 otherwise. Bytes rather than bits so
+  // that filters can and into them directly.
+  uint8 keep[0x800];
+};
+
+#endif
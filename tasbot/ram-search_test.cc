@@ -0,0 +1,132 @@
+/* Tests for the RamSearch class, on made-up memories. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "tasbot.h"
+#include "fceu/types.h"
+#include "ram-search.h"
+
+// Four memories. Location 0 counts up by one, 1 never changes, 2
+// goes down by two, 3 goes up and then back down, and 4 holds the
+// number of lives, which is 3 until the last memory. Everything
+// else is 0.
+static vector< vector<uint8> > Memories() {
+  static const uint8 kMem[][5] = {
+    {1, 7, 9, 0, 3},
+    {2, 7, 7, 5, 3},
+    {3, 7, 5, 5, 3},
+    {4, 7, 3, 1, 2},
+  };
+  vector< vector<uint8> > memories;
+  for (int i = 0; i < sizeof kMem / sizeof kMem[0]; i++) {
+    vector<uint8> mem(0x800, 0);
+    memcpy(&mem[0], kMem[i], sizeof kMem[i]);
+    memories.push_back(mem);
+  }
+  return memories;
+}
+
+static vector<int> Addrs(int a) {
+  return vector<int>(1, a);
+}
+
+static vector<int> Addrs(int a, int b) {
+  vector<int> v;
+  v.push_back(a);
+  v.push_back(b);
+  return v;
+}
+
+// Candidates after parsing the query, which must be fine, and
+// applying it to the memories.
+static vector<int> Search(const string &query) {
+  const vector< vector<uint8> > memories = Memories();
+  vector<RamSearch::Filter> filters;
+  CHECK(RamSearch::ParseFilters(query, memories.size(), &filters));
+  RamSearch search;
+  for (int i = 0; i < filters.size(); i++) {
+    search.Apply(filters[i], memories);
+  }
+  return search.Candidates();
+}
+
+static void TestApply() {
+  CHECK(Search("increasing") == Addrs(0));
+  CHECK(Search("decreasing") == Addrs(2));
+  CHECK(Search("changing") == Addrs(0, 2));
+  CHECK(Search("delta 1") == Addrs(0));
+  CHECK(Search("delta 2") == Addrs(2));
+  CHECK(Search("equal 7") == Addrs(1));
+  CHECK(Search("equal 3 0 2") == Addrs(4));
+  // 3 goes up and then down, so it's only nonincreasing from 1 on.
+  CHECK(Search("nonincreasing 1 3, delta 4 2 3") == Addrs(3));
+  CHECK(Search("increasing, decreasing").empty());
+  CHECK((int)Search("constant").size() == 0x800 - 4);
+}
+
+static void TestApplyRows() {
+  const vector< vector<uint8> > memories = Memories();
+  vector<uint8> mems;
+  for (int i = 0; i < memories.size(); i++) {
+    mems.insert(mems.end(), memories[i].begin(), memories[i].end());
+  }
+  vector<RamSearch::Filter> filters;
+  CHECK(RamSearch::ParseFilters("changing", memories.size(), &filters));
+  RamSearch search;
+  // Only the first three.
+  search.Apply(filters[0], mems, 3);
+  CHECK(search.Candidates() == Addrs(0, 2));
+  CHECK(search.NumCandidates() == 2);
+  CHECK(search.IsCandidate(2) && !search.IsCandidate(3));
+}
+
+static void TestMatching() {
+  const vector< vector<uint8> > memories = Memories();
+  vector<uint8> lives;
+  lives.push_back(3);
+  lives.push_back(3);
+  lives.push_back(2);
+  RamSearch search;
+  search.Matching(memories, 1, lives);
+  CHECK(search.Candidates() == Addrs(4));
+}
+
+static bool Parses(const string &query) {
+  vector<RamSearch::Filter> filters;
+  return RamSearch::ParseFilters(query, 4, &filters);
+}
+
+static void TestParse() {
+  vector<RamSearch::Filter> filters;
+  CHECK(RamSearch::ParseFilters("nondecreasing 1 2, delta 3", 4, &filters));
+  CHECK(filters.size() == 2);
+  CHECK(filters[0].pred == RamSearch::NONDECREASING);
+  CHECK(filters[0].first == 1 && filters[0].last == 2);
+  CHECK(filters[1].pred == RamSearch::DELTA);
+  CHECK(filters[1].value == 3 && filters[1].last == -1);
+
+  CHECK(Parses("equal 255"));
+  CHECK(!Parses("bigger"));
+  CHECK(!Parses("equal"));
+  // Not bytes.
+  CHECK(!Parses("equal 300"));
+  CHECK(!Parses("delta -1"));
+  // Not among the memories.
+  CHECK(!Parses("changing 1"));
+  CHECK(!Parses("changing 2 1"));
+  CHECK(!Parses("changing 0 4"));
+  CHECK(!Parses("changing -1 2"));
+}
+
+int main(int argc, char *argv[]) {
+  fprintf(stderr, "Testing RAM search.\n");
+
+  TestApply();
+  TestApplyRows();
+  TestMatching();
+  TestParse();
+
+  return 0;
+}
@@ -0,0 +1,236 @@
+
+#include "ram-trace.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "../cc-lib/base/stringprintf.h"
+
+static const size_t RAM_SIZE = 0x800;
+
+// Everything before the block index.
+struct TraceHeader {
+  char magic[16];
+  uint8 romchecksum[16];
+  uint64 moviehash;
+  uint64 start;
+  uint64 frames;
+  uint64 blocks;
+};
+
+static void MakeHeader(const MD5DATA &romchecksum,
+		       uint64 moviehash, uint64 start, uint64 frames,
+		       TraceHeader *header) {
+  memset(header, 0, sizeof (TraceHeader));
+  memcpy(header->magic, TRACE_MAGIC, strlen(TRACE_MAGIC));
+  memcpy(header->romchecksum, romchecksum.data, MD5DATA::size);
+  header->moviehash = moviehash;
+  header->start = start;
+  header->frames = frames;
+  header->blocks = (frames + TRACE_BLOCK_FRAMES - 1) / TRACE_BLOCK_FRAMES;
+}
+
+RamTrace::RamTrace(FILE *f, uint64 frames, const vector<uint64> &offsets)
+  : f(f), frames(frames), offsets(offsets) {}
+
+RamTrace::~RamTrace() {
+  fclose(f);
+}
+
+RamTrace *RamTrace::Open(const string &filename, const MD5DATA &romchecksum,
+			 uint64 moviehash, uint64 start) {
+  FILE *f = fopen(filename.c_str(), "rb");
+  if (f == NULL) return NULL;
+
+  TraceHeader header, expected;
+  if (1 != fread(&header, sizeof (TraceHeader), 1, f)) {
+    fclose(f);
+    return NULL;
+  }
+  MakeHeader(romchecksum, moviehash, start, header.frames, &expected);
+  if (0 != memcmp(&header, &expected, sizeof (TraceHeader))) {
+    fprintf(stderr, "Trace %s is for a different movie; ignoring.\n",
+	    filename.c_str());
+    fclose(f);
+    return NULL;
+  }
+
+  vector<uint64> offsets(header.blocks + 1);
+  if (offsets.size() != fread(&offsets[0], sizeof (uint64),
+			      offsets.size(), f)) {
+    fclose(f);
+    return NULL;
+  }
+
+  // Blocks follow the index in order, each non-empty, and the last
+  // ends within the file. Otherwise it was cut short or garbled.
+  bool ok = offsets[0] == ftell(f) && 0 == fseek(f, 0, SEEK_END);
+  for (uint64 b = 0; ok && b < header.blocks; b++) {
+    ok = offsets[b] < offsets[b + 1];
+  }
+  if (!ok || offsets[header.blocks] > (uint64)ftell(f)) {
+    fprintf(stderr, "Trace %s is damaged; ignoring.\n", filename.c_str());
+    fclose(f);
+    return NULL;
+  }
+  return new RamTrace(f, header.frames, offsets);
+}
+
+void RamTrace::Read(size_t begin, size_t end, vector<uint8> *mems) {
+  CHECK(begin <= end);
+  CHECK(end <= frames);
+  vector<uint8> compressed, block;
+  for (size_t b = begin / TRACE_BLOCK_FRAMES;
+       b * TRACE_BLOCK_FRAMES < end; b++) {
+    const size_t first = b * TRACE_BLOCK_FRAMES;
+    const size_t num =
+      min((size_t)TRACE_BLOCK_FRAMES, (size_t)(frames - first));
+
+    compressed.resize(offsets[b + 1] - offsets[b]);
+    CHECK(0 == fseek(f, offsets[b], SEEK_SET));
+    CHECK(compressed.size() ==
+	  fread(&compressed[0], 1, compressed.size(), f));
+
+    uLongf len = num * RAM_SIZE;
+    block.resize(len);
+    CHECK(Z_OK == uncompress(&block[0], &len,
+			     &compressed[0], compressed.size()));
+    CHECK(len == num * RAM_SIZE);
+
+    // Undo the deltas.
+    for (size_t i = RAM_SIZE; i < block.size(); i++) {
+      block[i] += block[i - RAM_SIZE];
+    }
+
+    for (size_t i = max(begin, first); i < min(end, first + num); i++) {
+      const uint8 *mem = &block[(i - first) * RAM_SIZE];
+      mems[i - begin].assign(mem, mem + RAM_SIZE);
+    }
+  }
+}
+
+void RamTrace::Write(const string &filename, const MD5DATA &romchecksum,
+		     uint64 moviehash, uint64 start,
+		     const vector<uint8> *mems, size_t num) {
+  // Several processes (e.g. playfun helpers) may want the same
+  // trace at once, and the index is filled in last, so write it
+  // elsewhere and then rename it.
+  const string tmpfile = StringPrintf("%s.%d.tmp", filename.c_str(),
+				      (int)getpid());
+  FILE *f = fopen(tmpfile.c_str(), "wb");
+  if (f == NULL) {
+    fprintf(stderr, "Couldn't write trace %s.\n", filename.c_str());
+    return;
+  }
+
+  TraceHeader header;
+  MakeHeader(romchecksum, moviehash, start, num, &header);
+  CHECK(1 == fwrite(&header, sizeof (TraceHeader), 1, f));
+
+  // Come back for the index once we know the offsets.
+  vector<uint64> offsets(header.blocks + 1);
+  const long index = ftell(f);
+  CHECK(offsets.size() ==
+	fwrite(&offsets[0], sizeof (uint64), offsets.size(), f));
+
+  vector<uint8> block, compressed;
+  for (uint64 b = 0; b < header.blocks; b++) {
+    offsets[b] = ftell(f);
+    const size_t first = b * TRACE_BLOCK_FRAMES;
+    const size_t count = min((size_t)TRACE_BLOCK_FRAMES, num - first);
+    block.resize(count * RAM_SIZE);
+    for (size_t i = 0; i < count; i++) {
+      const vector<uint8> &mem = mems[first + i];
+      CHECK(mem.size() == RAM_SIZE);
+      uint8 *out = &block[i * RAM_SIZE];
+      for (size_t j = 0; j < RAM_SIZE; j++) {
+	out[j] = i == 0 ? mem[j] : mem[j] - mems[first + i - 1][j];
+      }
+    }
+
+    uLongf len = compressBound(block.size());
+    compressed.resize(len);
+    CHECK(Z_OK == compress2(&compressed[0], &len, &block[0], block.size(),
+			    Z_DEFAULT_COMPRESSION));
+    CHECK(len == fwrite(&compressed[0], 1, len, f));
+  }
+  offsets[header.blocks] = ftell(f);
+
+  CHECK(0 == fseek(f, index, SEEK_SET));
+  CHECK(offsets.size() ==
+	fwrite(&offsets[0], sizeof (uint64), offsets.size(), f));
+  fclose(f);
+  if (0 != rename(tmpfile.c_str(), filename.c_str())) {
+    fprintf(stderr, "Couldn't rename %s.\n", tmpfile.c_str());
+    remove(tmpfile.c_str());
+  }
+}
+
+uint64 RamTrace::MovieHash(const vector<uint8> &movie) {
+  if (movie.empty()) return 0;
+  return CityHash64((const char *)&movie[0], movie.size());
+}
+
+size_t RamTrace::MovieStart(const vector<uint8> &movie, size_t fastforward) {
+  size_t start = 0;
+  while (start < movie.size() && movie[start] == 0) {
+    start++;
+  }
+  while (start < fastforward && start < movie.size()) {
+    start++;
+  }
+  return start;
+}
+
+string RamTrace::Filename(const string &game, const MD5DATA &romchecksum,
+			  uint64 moviehash, uint64 start) {
+  // The ROM is part of the key, but only the hash of everything is
+  // in the name; the header has the rest.
+  string key((const char *)romchecksum.data, MD5DATA::size);
+  key += StringPrintf("%llu-%llu", moviehash, start);
+  return StringPrintf("%s-%016llx.trace", game.c_str(),
+		      CityHash64(key.c_str(), key.size()));
+}
+
+void RamTrace::GetMemories(const string &game, const MD5DATA &romchecksum,
+			   const vector<uint8> &movie, size_t start,
+			   vector< vector<uint8> > *memories) {
+  CHECK(start < movie.size());
+  const uint64 moviehash = MovieHash(movie);
+  const string filename = Filename(game, romchecksum, moviehash, start);
+  const size_t num = movie.size() - start + 1;
+
+  RamTrace *trace = Open(filename, romchecksum, moviehash, start);
+  if (trace != NULL && trace->Size() == num) {
+    memories->clear();
+    memories->resize(num);
+    trace->Read(0, num, &(*memories)[0]);
+    delete trace;
+    printf("Read %zu memories from %s.\n", num, filename.c_str());
+    return;
+  }
+  delete trace;
+
+  memories->clear();
+  memories->reserve(num);
+  for (int i = 0; i < start; i++) {
+    Emulator::Step(movie[i]);
+  }
+  vector<uint8> mem;
+  Emulator::GetMemory(&mem);
+  memories->push_back(mem);
+  for (int i = start; i < movie.size(); i++) {
+    if (i % 1000 == 0) {
+      printf("  [% 5.1f%%] %6d/%ld\n",
+	     ((100.0 * i) / movie.size()), i, movie.size());
+    }
+    Emulator::Step(movie[i]);
+    Emulator::GetMemory(&mem);
+    memories->push_back(mem);
+  }
+
+  Write(filename, romchecksum, moviehash, start, &(*memories)[0], num);
+  printf("Wrote %zu memories to %s.\n", num, filename.c_str());
+}
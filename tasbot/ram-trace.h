@@ -0,0 +1,75 @@
+/* On-disk cache of the RAM after each frame of a movie, so that tools
+   that want a movie's memories don't each have to replay it from
+   power-on. A trace is keyed by the ROM checksum, a hash of the
+   movie's inputs, and the number of frames skipped at the start.
+
+   Memories are stored in blocks of TRACE_BLOCK_FRAMES. Within a
+   block, each memory is stored as the difference from the previous
+   one (which is mostly zeroes) and the block is compressed with zlib.
+   An index of block offsets follows the header, so reading a range
+   of frames only decompresses the blocks that overlap it. */
+
+#ifndef __RAM_TRACE_H
+#define __RAM_TRACE_H
+
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+#include "fceu/types.h"
+#include "tasbot.h"
+
+using namespace std;
+
+#define TRACE_MAGIC "tasbot-trace-1\n"
+#define TRACE_BLOCK_FRAMES 256
+
+struct RamTrace {
+  // Returns NULL if the file doesn't exist or has a different key.
+  static RamTrace *Open(const string &filename, const MD5DATA &romchecksum,
+                        uint64 moviehash, uint64 start);
+  ~RamTrace();
+
+  // Number of memories in the trace.
+  size_t Size() const { return frames; }
+
+  // Reads memories begin..end-1 into mems[0]..mems[end-begin-1].
+  void Read(size_t begin, size_t end, vector<uint8> *mems);
+
+  // Writes mems[0]..mems[num-1], each 0x800 bytes.
+  static void Write(const string &filename, const MD5DATA &romchecksum,
+                    uint64 moviehash, uint64 start,
+                    const vector<uint8> *mems, size_t num);
+
+  static uint64 MovieHash(const vector<uint8> &movie);
+
+  // The first frame of a movie whose memories are worth looking at:
+  // the first keypress (before that, most games are initializing
+  // RAM), or the fastforward point if that's later. May be
+  // movie.size(). Traces are keyed by their start, so every tool
+  // that shares them has to use this.
+  static size_t MovieStart(const vector<uint8> &movie, size_t fastforward);
+
+  // Where tools look for the trace of this movie.
+  static string Filename(const string &game, const MD5DATA &romchecksum,
+                         uint64 moviehash, uint64 start);
+
+  // Gets the memories after frame start-1 and each frame after it,
+  // replacing the contents of memories, from the cached trace if
+  // there is one. Otherwise, replays the movie (the emulator must be
+  // at power-on) and writes the trace for next time.
+  static void GetMemories(const string &game, const MD5DATA &romchecksum,
+                          const vector<uint8> &movie, size_t start,
+                          vector< vector<uint8> > *memories);
+
+ private:
+  RamTrace(FILE *f, uint64 frames, const vector<uint64> &offsets);
+  FILE *f;
+  const uint64 frames;
+  // Offset of each block in the file, plus the end of the last one.
+  const vector<uint64> offsets;
+
+  NOT_COPYABLE(RamTrace);
+};
+
+#endif
@@ -0,0 +1,209 @@
+/* Renders a movie (like one playfun made) to video and sound, for
+   turning into something people can watch. Writes raw 256x240 RGB
+   frames to <game>-render.rgb and 16-bit mono sound to
+   <game>-render.wav, then says how to have ffmpeg put them together.
+
+   Rendering the picture and sound is many times slower than just
+   emulating, so the movie is split into segments, one per CPU, and
+   each segment is rendered in a worker process (the emulator is
+   global). Workers get to their segments with the movie's index
+   (see MovieIndex). They write their frames straight into place in
+   the video file; their sound goes in a file per segment, which are
+   joined at the end.
+ */
+
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <string.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "tasbot.h"
+
+#include "config.h"
+#include "emulator.h"
+#include "movie-index.h"
+#include "simplefm2.h"
+#include "util.h"
+#include "fceu/driver.h"
+
+#define SOUND_RATE 44100
+#define FRAME_BYTES (256 * 240 * 3)
+
+// Sound from the first frames after loading a state isn't right,
+// since the filters start out empty, so each segment after the first
+// starts rendering this many frames early and throws them away.
+#define RENDER_PREROLL 10
+
+static string SoundFile(const string &base, int w) {
+  return StringPrintf("%s-%d.pcm", base.c_str(), w);
+}
+
+// Renders frames [start, end) of the movie, starting from before
+// frame keyframe.
+static void RenderSegment(const vector<uint8> &movie, MovieIndex *index,
+			  size_t keyframe, size_t start, size_t end,
+			  const string &videofile, const string &soundfile) {
+  index->Seek(keyframe);
+  Emulator::EnableSound(SOUND_RATE);
+
+  FILE *video = fopen(videofile.c_str(), "r+b");
+  CHECK(video != NULL);
+  CHECK(0 == fseeko(video, (off_t)start * FRAME_BYTES, SEEK_SET));
+  FILE *sound = fopen(soundfile.c_str(), "wb");
+  CHECK(sound != NULL);
+
+  vector<uint8> rgb;
+  vector<int16> samples;
+  for (size_t i = keyframe; i < end; i++) {
+    Emulator::StepFull(movie[i], &rgb, &samples);
+    if (i < start) continue;
+    CHECK(rgb.size() == fwrite(&rgb[0], 1, rgb.size(), video));
+    if (!samples.empty()) {
+      CHECK(samples.size() ==
+	    fwrite(&samples[0], sizeof (int16), samples.size(), sound));
+    }
+  }
+
+  CHECK(0 == fclose(video));
+  CHECK(0 == fclose(sound));
+}
+
+static uint32 FileSize(const string &filename) {
+  FILE *f = fopen(filename.c_str(), "rb");
+  CHECK(f != NULL);
+  CHECK(0 == fseek(f, 0, SEEK_END));
+  const long size = ftell(f);
+  fclose(f);
+  return size;
+}
+
+static void WriteLE(FILE *f, uint32 v, int bytes) {
+  for (int i = 0; i < bytes; i++) {
+    fputc((v >> (8 * i)) & 0xFF, f);
+  }
+}
+
+// Joins the segments' sound into one .wav file, and deletes them.
+static void WriteWav(const string &wavfile, const string &base, int workers) {
+  uint32 datasize = 0;
+  for (int w = 0; w < workers; w++) {
+    datasize += FileSize(SoundFile(base, w));
+  }
+
+  FILE *wav = fopen(wavfile.c_str(), "wb");
+  CHECK(wav != NULL);
+  fwrite("RIFF", 1, 4, wav);
+  WriteLE(wav, 36 + datasize, 4);
+  fwrite("WAVEfmt ", 1, 8, wav);
+  WriteLE(wav, 16, 4);
+  // PCM, mono.
+  WriteLE(wav, 1, 2);
+  WriteLE(wav, 1, 2);
+  WriteLE(wav, SOUND_RATE, 4);
+  WriteLE(wav, SOUND_RATE * 2, 4);
+  WriteLE(wav, 2, 2);
+  WriteLE(wav, 16, 2);
+  fwrite("data", 1, 4, wav);
+  WriteLE(wav, datasize, 4);
+
+  vector<uint8> buf(1 << 16);
+  for (int w = 0; w < workers; w++) {
+    const string soundfile = SoundFile(base, w);
+    FILE *f = fopen(soundfile.c_str(), "rb");
+    CHECK(f != NULL);
+    size_t n;
+    while ((n = fread(&buf[0], 1, buf.size(), f)) > 0) {
+      CHECK(n == fwrite(&buf[0], 1, n, wav));
+    }
+    fclose(f);
+    unlink(soundfile.c_str());
+  }
+  CHECK(0 == fclose(wav));
+}
+
+int main(int argc, char *argv[]) {
+  Config config(argc, argv);
+  Emulator::Initialize(config);
+  vector<uint8> movie = SimpleFM2::ReadInputs(config.movie);
+  CHECK(!movie.empty());
+
+  int workers = sysconf(_SC_NPROCESSORS_ONLN);
+  if (workers < 1) workers = 1;
+  if (workers > movie.size()) workers = movie.size();
+
+  vector<size_t> starts;
+  for (int w = 0; w <= workers; w++) {
+    starts.push_back(movie.size() * w / workers);
+  }
+
+  // Where each worker seeks to, a little before its segment starts.
+  // Short segments can share one.
+  vector<size_t> keyframes;
+  keyframes.push_back(0);
+  for (int w = 1; w < workers; w++) {
+    keyframes.push_back(starts[w] > RENDER_PREROLL ?
+			starts[w] - RENDER_PREROLL : 0);
+  }
+
+  // Only built the first time; it's saved next to the movie.
+  MovieIndex *index =
+    MovieIndex::LoadOrCompute(movie, config.romchecksum,
+			      MovieIndex::IndexFile(config.movie));
+
+  const string base = config.game + "-render";
+  const string videofile = base + ".rgb";
+  const string wavfile = base + ".wav";
+
+  // Make the video file its full size now, so that each worker can
+  // write its frames in place.
+  {
+    FILE *video = fopen(videofile.c_str(), "wb");
+    CHECK(video != NULL);
+    CHECK(0 == ftruncate(fileno(video), (off_t)movie.size() * FRAME_BYTES));
+    CHECK(0 == fclose(video));
+  }
+
+  printf("Rendering %zu frames in %d segments...\n",
+	 movie.size(), workers);
+  vector<pid_t> pids;
+  for (int w = 0; w < workers; w++) {
+    fflush(stdout);
+    pid_t pid = fork();
+    CHECK(pid >= 0);
+    if (pid == 0) {
+      RenderSegment(movie, index, keyframes[w], starts[w], starts[w + 1],
+		    videofile, SoundFile(base, w));
+      _exit(0);
+    }
+    pids.push_back(pid);
+  }
+
+  for (int w = 0; w < workers; w++) {
+    int status = 0;
+    CHECK(pids[w] == waitpid(pids[w], &status, 0));
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+      fprintf(stderr, "Worker for frames %zu-%zu failed.\n",
+	      starts[w], starts[w + 1]);
+      abort();
+    }
+  }
+
+  delete index;
+  WriteWav(wavfile, base, workers);
+
+  const double fps = FCEUI_GetDesiredFPS() / 16777216.0;
+  printf("Wrote %s and %s. To make a video:\n"
+	 "  ffmpeg -f rawvideo -pixel_format rgb24 -video_size 256x240 "
+	 "-framerate %.4f -i %s -i %s -c:v libx264 -c:a aac %s.mp4\n",
+	 videofile.c_str(), wavfile.c_str(), fps,
+	 videofile.c_str(), wavfile.c_str(), base.c_str());
+
+  Emulator::Shutdown();
+
+  // exit the infrastructure
+  FCEUI_Kill();
+  return 0;
+}
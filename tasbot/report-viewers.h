@@ -0,0 +1,197 @@
+/* Viewer scripts for the append-only playfun reports (see
+   report.h). Each one defines the functions that the appended data
+   calls, and draws the page on load. */
+
+#ifndef __REPORT_VIEWERS_H
+#define __REPORT_VIEWERS_H
+
+// Shared by the viewers that draw SVG.
+#define REPORT_SVG_SCRIPT \
+"function Ticks(width, maxx, span, tickheight, tickfont) {\n" \
+"  var out = '', longone = true;\n" \
+"  for (var x = 0; x < maxx; x += span) {\n" \
+"    var px = (width * x / maxx).toFixed(2);\n" \
+"    out += '<polyline fill=\"none\" opacity=\"0.5\" stroke=\"#000000\"' +\n" \
+"      ' stroke-width=\"1\" points=\"' + px + ',0.00 ' + px + ',' +\n" \
+"      (longone ? tickheight * 2 : tickheight).toFixed(2) + '\" />';\n" \
+"    if (longone)\n" \
+"      out += '<text x=\"' + (width * x / maxx + 3).toFixed(2) +\n" \
+"        '\" y=\"' + (2 * tickheight + 2).toFixed(2) +\n" \
+"        '\" font-size=\"' + tickfont.toFixed(2) + '\">' + x + '</text>';\n" \
+"    longone = !longone;\n" \
+"  }\n" \
+"  return out;\n" \
+"}\n" \
+"function Show(width, height, body) {\n" \
+"  document.getElementById('report').innerHTML =\n" \
+"    '<svg xmlns=\"http://www.w3.org/2000/svg\" width=\"' + width +\n" \
+"    'px\" height=\"' + height + 'px\">' + body + '</svg>';\n" \
+"}\n"
+
+// Data is S(startframe, chosen_idx, immediates, positives,
+//          negatives, norms), once per round.
+#define SCORES_SCRIPT \
+"var rounds = [];\n" \
+"function S(frame, chosen, immediates, positives, negatives, norms) {\n" \
+"  rounds.push([frame, chosen, [immediates, positives, negatives, norms]]);\n" \
+"}\n" \
+"var COLORS = ['#33A', '#090', '#A33', '#000'];\n" \
+"function Dots(width, height, color, xf, values, minval, maxval, chosen) {\n" \
+"  var sorted = values.slice(0).sort(function(a, b) { return a - b; });\n" \
+"  var size = values.length, out = '';\n" \
+"  for (var i = 0; i < size; i++) {\n" \
+"    var idx = 0;\n" \
+"    while (idx < size && sorted[idx] < values[i]) idx++;\n" \
+"    var opacity;\n" \
+"    if (idx < 0.1 * size || idx > 0.9 * size) opacity = 0.2;\n" \
+"    else if (idx < 0.2 * size || idx > 0.8 * size) opacity = 0.4;\n" \
+"    else if (idx < 0.3 * size || idx > 0.7 * size) opacity = 0.6;\n" \
+"    else if (idx < 0.4 * size || idx > 0.6 * size) opacity = 0.8;\n" \
+"    else opacity = 1.0;\n" \
+"    var yf = (values[i] - minval) / (maxval - minval);\n" \
+"    out += '<circle cx=\"' + (width * xf).toFixed(1) +\n" \
+"      '\" cy=\"' + (height * (1.0 - yf)).toFixed(1) +\n" \
+"      '\" r=\"' + (i == chosen ? 10 : 4) +\n" \
+"      '\" opacity=\"' + opacity.toFixed(1) + '\" fill=\"' + color + '\" />';\n" \
+"  }\n" \
+"  return out;\n" \
+"}\n" \
+"window.onload = function() {\n" \
+"  var totalframes = 1, minval = 1.0, maxval = 0.0;\n" \
+"  for (var r = 0; r < rounds.length; r++) {\n" \
+"    totalframes = Math.max(totalframes, rounds[r][0] + 1);\n" \
+"    // Norms are drawn on the same scale but don't set it.\n" \
+"    for (var s = 0; s < 3; s++) {\n" \
+"      var v = rounds[r][2][s];\n" \
+"      for (var i = 0; i < v.length; i++) {\n" \
+"        minval = Math.min(minval, v[i]);\n" \
+"        maxval = Math.max(maxval, v[i]);\n" \
+"      }\n" \
+"    }\n" \
+"  }\n" \
+"  var WIDTH = totalframes * 2, HEIGHT = 768, out = '';\n" \
+"  for (var r = 0; r < rounds.length; r++) {\n" \
+"    for (var s = 0; s < 4; s++) {\n" \
+"      out += Dots(WIDTH, HEIGHT, COLORS[s], rounds[r][0] / totalframes,\n" \
+"                  rounds[r][2][s], minval, maxval, rounds[r][1]);\n" \
+"    }\n" \
+"  }\n" \
+"  out += Ticks(WIDTH, totalframes, 50, 20, 12);\n" \
+"  Show(WIDTH + 12, HEIGHT + 12, out);\n" \
+"};\n"
+
+// Data is O(observe_every, objectives) once, then M(values) for
+// each observation, with one hex string per objective.
+#define OBJECTIVES_SCRIPT \
+"var every = 1, objectives = [], observations = [];\n" \
+"function O(e, objs) { every = e; objectives = objs; }\n" \
+"function M(values) { observations.push(values); }\n" \
+"function Color(k) {\n" \
+"  return 'hsl(' + ((k * 137) % 360) + ',70%,' + (30 + (k * 7) % 30) + '%)';\n" \
+"}\n" \
+"window.onload = function() {\n" \
+"  var n = observations.length;\n" \
+"  if (n == 0) return;\n" \
+"  var WIDTH = n * 2, HEIGHT = 768, out = '';\n" \
+"  for (var k = 0; k < objectives.length; k++) {\n" \
+"    // All the distinct values this objective takes on, in order.\n" \
+"    // Values are hex strings of the same length, so string order\n" \
+"    // is the lexicographic order on the bytes.\n" \
+"    var seen = {}, values = [];\n" \
+"    for (var i = 0; i < n; i++) {\n" \
+"      var v = observations[i][k];\n" \
+"      if (!seen.hasOwnProperty(v)) {\n" \
+"        seen[v] = true;\n" \
+"        values.push(v);\n" \
+"      }\n" \
+"    }\n" \
+"    values.sort();\n" \
+"    var index = {};\n" \
+"    for (var j = 0; j < values.length; j++) index[values[j]] = j;\n" \
+"\n" \
+"    var points = [], last = -1;\n" \
+"    for (var i = 0; i < n; i++) {\n" \
+"      var vi = index[observations[i][k]];\n" \
+"      // Allow drawing horizontal lines without interstitial points.\n" \
+"      if (vi == last && i < n - 1 && index[observations[i + 1][k]] == vi)\n" \
+"        continue;\n" \
+"      last = vi;\n" \
+"      points.push((WIDTH * i / n).toFixed(2) + ',' +\n" \
+"                  (HEIGHT * (1.0 - vi / values.length)).toFixed(2));\n" \
+"    }\n" \
+"    out += '<polyline fill=\"none\" stroke=\"' + Color(k) +\n" \
+"      '\" stroke-width=\"1\" points=\"' + points.join(' ') + '\" />';\n" \
+"  }\n" \
+"  out += Ticks(WIDTH, n * every, 100, 20, 12);\n" \
+"  Show(WIDTH + 12, HEIGHT + 12, out);\n" \
+"};\n"
+
+// Data is I(inputs, weight) for each motif, then each round
+// F(framenum) and, if a motif was picked, W(index, newweight).
+#define MOTIFS_SCRIPT \
+"var motifs = [], frame = 0;\n" \
+"function I(inputs, weight) {\n" \
+"  motifs.push({inputs: inputs, weight: weight, picked: 0,\n" \
+"               history: [[frame, weight]]});\n" \
+"}\n" \
+"function F(f) { frame = f; }\n" \
+"function W(idx, weight) {\n" \
+"  var m = motifs[idx];\n" \
+"  m.picked++;\n" \
+"  if (m.weight != weight) {\n" \
+"    m.weight = weight;\n" \
+"    m.history.push([frame, weight]);\n" \
+"  }\n" \
+"}\n" \
+"function InputString(input) {\n" \
+"  var COLORS = ['#000', '#000', '#000', '#000',\n" \
+"                '#009', '#009', '#900', '#900'];\n" \
+"  var out = '', color = '';\n" \
+"  for (var j = 0; j < 8; j++) {\n" \
+"    var down = input & (1 << (7 - j));\n" \
+"    var c = down ? COLORS[j] : '#999';\n" \
+"    if (color != c) {\n" \
+"      if (color != '') out += '</span>';\n" \
+"      out += '<span style=\"color:' + c + '\">';\n" \
+"      color = c;\n" \
+"    }\n" \
+"    out += down ? 'RLDUTSBA'.charAt(j) : '.';\n" \
+"  }\n" \
+"  return out + '</span>';\n" \
+"}\n" \
+"function Range(lastframe, val, thisframe) {\n" \
+"  var finframe = thisframe - 1;\n" \
+"  return '<span class=\"range\">' +\n" \
+"    (lastframe == finframe ? lastframe : lastframe + '&ndash;' + finframe) +\n" \
+"    ':&nbsp;<span class=\"value\">' + val.toFixed(2) + '</span></span>';\n" \
+"}\n" \
+"window.onload = function() {\n" \
+"  var sorted = motifs.slice(0).sort(function(a, b) {\n" \
+"    return b.weight - a.weight;\n" \
+"  });\n" \
+"  var out = '';\n" \
+"  for (var r = 0; r < sorted.length; r++) {\n" \
+"    var m = sorted[r];\n" \
+"    out += '<div class=\"motif\"><div class=\"inputs\">';\n" \
+"    var last = '';\n" \
+"    for (var i = 0; i < m.inputs.length; i++) {\n" \
+"      var s = InputString(m.inputs[i]);\n" \
+"      out += '<span class=\"input\">' +\n" \
+"        (s == last ? '&nbsp;&nbsp;&nbsp;&nbsp;&nbsp;&nbsp;&nbsp;&nbsp;' : s) +\n" \
+"        '</span> ';\n" \
+"      last = s;\n" \
+"    }\n" \
+"    out += '</div><div class=\"values\"><span class=\"picked\">' +\n" \
+"      m.picked + '</span>';\n" \
+"    for (var h = 1; h < m.history.length; h++) {\n" \
+"      out += Range(m.history[h - 1][0], m.history[h - 1][1],\n" \
+"                   m.history[h][0]);\n" \
+"    }\n" \
+"    var tail = m.history[m.history.length - 1];\n" \
+"    out += Range(tail[0], tail[1], Math.max(frame, tail[0]) + 1);\n" \
+"    out += '</div></div>';\n" \
+"  }\n" \
+"  document.getElementById('report').innerHTML = out;\n" \
+"};\n"
+
+#endif
@@ -0,0 +1,70 @@
+
+#include "report.h"
+
+#include <stdlib.h>
+
+#include "../cc-lib/base/stringprintf.h"
+
+AppendReport::AppendReport(const string &filename, const string &title,
+			   const string &style, const string &script)
+  : filename(filename) {
+  f = fopen(filename.c_str(), "w");
+  if (f == NULL) {
+    fprintf(stderr, "Couldn't open report %s\n", filename.c_str());
+    abort();
+  }
+
+  // No closing tags; everything after the header is appended.
+  fprintf(f,
+	  "<!DOCTYPE html>\n"
+	  "<meta charset=\"utf-8\">\n"
+	  "<title>%s</title>\n"
+	  "%s"
+	  "<div id=\"report\"></div>\n"
+	  "<script>\n%s</script>\n",
+	  title.c_str(), style.c_str(), script.c_str());
+  fflush(f);
+}
+
+AppendReport::~AppendReport() {
+  fclose(f);
+}
+
+void AppendReport::Append(const string &js) {
+  fprintf(f, "<script>%s</script>\n", js.c_str());
+  fflush(f);
+}
+
+string AppendReport::Array(const vector<double> &v) {
+  string s = "[";
+  for (int i = 0; i < v.size(); i++) {
+    s += StringPrintf("%s%g", (i ? "," : ""), v[i]);
+  }
+  return s + "]";
+}
+
+string AppendReport::Array(const vector<int> &v) {
+  string s = "[";
+  for (int i = 0; i < v.size(); i++) {
+    s += StringPrintf("%s%d", (i ? "," : ""), v[i]);
+  }
+  return s + "]";
+}
+
+string AppendReport::Array(const vector<uint8> &v) {
+  string s = "[";
+  for (int i = 0; i < v.size(); i++) {
+    s += StringPrintf("%s%d", (i ? "," : ""), (int)v[i]);
+  }
+  return s + "]";
+}
+
+string AppendReport::Hex(const vector<uint8> &v) {
+  static const char digits[] = "0123456789abcdef";
+  string s = "'";
+  for (int i = 0; i < v.size(); i++) {
+    s += digits[v[i] >> 4];
+    s += digits[v[i] & 15];
+  }
+  return s + "'";
+}
@@ -0,0 +1,45 @@
+/* Append-only HTML reports, for diagnostics that would otherwise be
+   regenerated from scratch and get slower as a run goes on. The file
+   starts with a viewer script, and each update appends one small
+   <script> element with only the new data. The page draws itself
+   when it's loaded, so it can be viewed at any time during the run. */
+
+#ifndef __REPORT_H
+#define __REPORT_H
+
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+#include "fceu/types.h"
+#include "tasbot.h"
+
+using namespace std;
+
+struct AppendReport {
+  // Truncates the file and writes the page header, which runs the
+  // given viewer script (see report-viewers.h). Aborts on failure.
+  AppendReport(const string &filename, const string &title,
+               const string &style, const string &script);
+  ~AppendReport();
+
+  // Appends a JavaScript statement for the viewer, like "S(1,[2]);",
+  // and flushes it so the file is always viewable.
+  void Append(const string &js);
+
+  // Formatting for the arguments.
+  static string Array(const vector<double> &v);
+  static string Array(const vector<int> &v);
+  static string Array(const vector<uint8> &v);
+  // Quoted string of hex digits, two per byte. Strings made from
+  // vectors of the same length sort like the vectors do.
+  static string Hex(const vector<uint8> &v);
+
+ private:
+  const string filename;
+  FILE *f;
+
+  NOT_COPYABLE(AppendReport);
+};
+
+#endif
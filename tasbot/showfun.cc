@@ -14,18 +14,12 @@
 #include "config.h"
 #include "basis-util.h"
 #include "emulator.h"
+#include "ram-search.h"
+#include "ram-trace.h"
 #include "simplefm2.h"
 #include "objective.h"
 #include "weighted-objectives.h"
 
-static void SaveMemory(vector< vector<uint8> > *memories) {
-  memories->resize(memories->size() + 1);
-  vector<uint8> *v = &memories->back();
-  for (int i = 0; i < 0x800; i++) {
-    v->push_back((uint8)RAM[i]);
-  }
-}
-
 struct MemSpan {
   void Observe(int idx, const vector< vector<uint8> > &memories,
 	       const vector<int> &ordering) {
@@ -73,41 +67,45 @@ int main(int argc, char *argv[]) {
   vector<uint8> movie = SimpleFM2::ReadInputs(config.movie);
 
   vector< vector<uint8> > memories;
-  memories.reserve(movie.size() + 1);
 
   // The very beginning of the game starts with RAM initialization,
   // which we really should ignore for building an objective function.
-  // So skip until there's a button press in the movie.
-  size_t start = 0;
-
-  if (argc == 1) {
-    printf("Skipping frames without argument.\n");
-    while (start < config.fastforward && start < movie.size()) {
-      Emulator::Step(movie[start]);
-      start++;
+  // Same start as learnfun, so that we share its trace.
+  const size_t start = RamTrace::MovieStart(movie, config.fastforward);
+  CHECK(start < movie.size());
+  printf("Skipped %ld frames until first keypress/ffwd.\n"
+	 "Playing %ld frames...\n", start, movie.size() - start);
+
+  // Replays the movie, unless it's been traced before.
+  RamTrace::GetMemories(config.game, config.romchecksum,
+			movie, start, &memories);
+  printf("Recorded %ld memories.\n", memories.size());
+
+  if (!config.search.empty()) {
+    vector<RamSearch::Filter> filters;
+    if (!RamSearch::ParseFilters(config.search, memories.size(), &filters)) {
+      return 1;
     }
-    while (movie[start] == 0 && start < movie.size()) {
-      Emulator::Step(movie[start]);
-      start++;
+    RamSearch search;
+    for (int i = 0; i < filters.size(); i++) {
+      search.Apply(filters[i], memories);
     }
-    printf("Skipped %ld frames until first keypress.\n"
-	   "Playing %ld frames...\n", start, movie.size() - start);
-
-    SaveMemory(&memories);
+    vector<int> found = search.Candidates();
+    printf("%zu bytes match:", found.size());
+    for (int i = 0; i < found.size(); i++) {
+      printf(" %04x", found[i]);
+    }
+    printf("\n");
 
-    for (int i = start; i < movie.size(); i++) {
-      if (i % 1000 == 0) {
-        printf("  [% 3.1f%%] %d/%ld\n", 
-	       ((100.0 * i) / movie.size()), i, movie.size());
-        // exit(0);
+    // Few enough to show their values.
+    if (!found.empty() && found.size() <= 16) {
+      MemSpan m;
+      for (int i = 0; i < memories.size(); i++) {
+	m.Observe(i, memories, found);
       }
-      Emulator::Step(movie[i]);
-      SaveMemory(&memories);
+      m.Flush();
     }
-
-    printf("Recorded %ld memories.\n", memories.size());
-
-
+  } else if (argc == 1) {
     WeightedObjectives *objectives = WeightedObjectives::LoadFromFile(config.game+ ".objectives");
     CHECK(objectives);
 
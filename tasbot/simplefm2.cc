@@ -1,9 +1,17 @@
 
 #include "simplefm2.h"
 
+#include "inputlog.h"
+
 using namespace std;
 
 vector<uint8> SimpleFM2::ReadInputs(const string &filename) {
+  // Binary input logs are read directly, with no parsing.
+  if (InputLogReader::IsInputLog(filename)) {
+    InputLogReader reader(filename);
+    return reader.ToVector();
+  }
+
   vector<string> contents = Util::ReadFileToLines(filename);
   vector<uint8> out;
   for (int i = 0; i < contents.size(); i++) {
@@ -22,6 +22,7 @@
 using namespace std;
 
 struct SimpleFM2 {
+  // Also accepts a binary input log (see inputlog.h).
   static vector<uint8> ReadInputs(const string &filename);
 
   static void WriteInputs(const string &outputfile,
@@ -1,6 +1,8 @@
 /* Searches for solutions to Karate Kid. */
 
 #include "tasbot.h"
+#include "movie-index.h"
+#include "watch.h"
 
 /* Represents a node in the state graph.
 
@@ -143,12 +145,12 @@ inline static bool KarateBattle(uint32 loc) {
 // some optional bonus stage.
 static bool IsBad() {
 
-  // Number of lives
+  // Number of lives (the watch; see main)
   // n.b. this would allow me to get an extra
   // life and then die. Maybe this should be
   // IsBadTransition and compare to the
   // last state?
-  if (RAM[0x07D6] < 3) {
+  if (Emulator::Watched()) {
     return true;
   }
 
@@ -294,19 +296,26 @@ int main(int argc, char *argv[]) {
   config.game = "karate.nes";
   config.movie = "karate.fm2";
   config.fastforward = 0;
+  config.watch = "$07D6 < #3";
   Emulator::Initialize(config);
+  Watch *watch = Watch::Compile(config.watch);
+  CHECK(watch);
+  Emulator::SetWatch(watch);
 
   vector<uint8> start_inputs = SimpleFM2::ReadInputs(config.movie);
+  MovieIndex *index =
+    MovieIndex::LoadOrCompute(start_inputs, config.romchecksum,
+			      MovieIndex::IndexFile(config.movie));
   basis = new vector<uint8>;
-  *basis = BasisUtil::LoadOrComputeBasis(start_inputs, 140, "karate.basis");
+  *basis = BasisUtil::LoadOrComputeBasis(start_inputs, 140, "karate.basis",
+					 index);
 
   // Fast-forward to gameplay.
   // There are 98 frames before the initial battle begins.
   // But the opening whistle goes until about 130.
-  start_inputs.resize(130);
-  for (int i = 0; i < start_inputs.size(); i++) {
-    Emulator::Step(start_inputs[i]);
-  }
+  start_inputs.resize(min((size_t)130, start_inputs.size()));
+  index->Seek(start_inputs.size());
+  delete index;
 
   fprintf(stderr, "Starting...\n");
 
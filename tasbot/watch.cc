@@ -0,0 +1,147 @@
+
+#include "watch.h"
+
+#include <stdio.h>
+
+#include "fceu/conddebug.h"
+
+// RAM is mirrored up to here.
+#define RAM_END 0x2000
+// The most that code can have on the stack.
+#define MAX_DEPTH 64
+
+Watch *Watch::Compile(const string &condition) {
+  Condition *c = generateCondition(condition.c_str());
+  if (c == NULL) {
+    fprintf(stderr, "Couldn't parse the watch condition \"%s\".\n",
+	    condition.c_str());
+    return NULL;
+  }
+
+  Watch *watch = new Watch;
+  watch->text = condition;
+  const bool ok = watch->Emit(c);
+  freeTree(c);
+  if (!ok) {
+    fprintf(stderr, "The watch condition \"%s\" can only use numbers "
+	    "and RAM addresses.\n", condition.c_str());
+    delete watch;
+    return NULL;
+  }
+
+  int height = 0, depth = 0;
+  for (int i = 0; i < watch->code.size(); i++) {
+    switch (watch->code[i].op) {
+    case PUSH:
+    case READ: height++; break;
+    case LOAD: break;
+    case BINARY: height--; break;
+    }
+    depth = max(depth, height);
+  }
+  CHECK(height == 1);
+  if (depth > MAX_DEPTH) {
+    fprintf(stderr, "The watch condition \"%s\" is too deeply nested.\n",
+	    condition.c_str());
+    delete watch;
+    return NULL;
+  }
+  return watch;
+}
+
+// Mirrors debug.cpp's evaluate.
+bool Watch::Emit(const Condition *c) {
+  if (c->lhs != NULL) {
+    if (!Emit(c->lhs)) return false;
+    if (c->type1 == TYPE_ADDR) {
+      code.push_back(Instruction(LOAD, 0));
+    } else if (c->type1 != TYPE_NO) {
+      return false;
+    }
+  } else if (!EmitOperand(c->type1, c->value1)) {
+    return false;
+  }
+
+  if (c->op == OP_NO) return true;
+
+  if (c->rhs != NULL) {
+    if (!Emit(c->rhs)) return false;
+    if (c->type2 == TYPE_ADDR) {
+      code.push_back(Instruction(LOAD, 0));
+    } else if (c->type2 != TYPE_NO) {
+      return false;
+    }
+  } else if (!EmitOperand(c->type2, c->value2)) {
+    return false;
+  }
+  code.push_back(Instruction(BINARY, c->op));
+  return true;
+}
+
+bool Watch::EmitOperand(unsigned int type, unsigned int value) {
+  switch (type) {
+  case TYPE_NUM:
+    code.push_back(Instruction(PUSH, value));
+    return true;
+  case TYPE_ADDR:
+    if (value >= RAM_END) return false;
+    code.push_back(Instruction(READ, value & 0x7FF));
+    return true;
+  default:
+    return false;
+  }
+}
+
+bool Watch::Addresses(vector<int> *addrs) const {
+  addrs->clear();
+  for (int i = 0; i < code.size(); i++) {
+    if (code[i].op == LOAD) return false;
+    if (code[i].op == READ) addrs->push_back(code[i].arg);
+  }
+  return true;
+}
+
+static inline int Apply(int op, int a, int b) {
+  switch (op) {
+  case OP_EQ: return a == b;
+  case OP_NE: return a != b;
+  case OP_GE: return a >= b;
+  case OP_LE: return a <= b;
+  case OP_G: return a > b;
+  case OP_L: return a < b;
+  case OP_MULT: return a * b;
+  // The debugger would crash.
+  case OP_DIV: return b == 0 ? 0 : a / b;
+  case OP_PLUS: return a + b;
+  case OP_MINUS: return a - b;
+  case OP_OR: return a || b;
+  case OP_AND: return a && b;
+  }
+  return a;
+}
+
+bool Watch::Check(const uint8 *ram) const {
+  int stack[MAX_DEPTH];
+  int top = 0;
+  for (int i = 0; i < code.size(); i++) {
+    const Instruction &ins = code[i];
+    switch (ins.op) {
+    case PUSH:
+      stack[top++] = ins.arg;
+      break;
+    case READ:
+      stack[top++] = ram[ins.arg];
+      break;
+    case LOAD: {
+      const int addr = stack[top - 1];
+      stack[top - 1] = (addr >= 0 && addr < RAM_END) ? ram[addr & 0x7FF] : 0;
+      break;
+    }
+    case BINARY:
+      top--;
+      stack[top - 1] = Apply(ins.arg, stack[top - 1], stack[top]);
+      break;
+    }
+  }
+  return stack[0] != 0;
+}
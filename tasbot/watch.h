@@ -0,0 +1,75 @@
+/* A condition on the game's memory that means a rollout is no
+   longer worth playing, like the player having died. Conditions are
+   written in the syntax of FCEUX's conditional breakpoints (see
+   fceu/conddebug.cpp), for example
+
+      $07D6 < #3 || $[#0700 + $0010] == #0
+
+   and compiled to a little stack program, so that checking one after
+   every frame costs about as much as reading the bytes it mentions. */
+
+#ifndef __WATCH_H
+#define __WATCH_H
+
+#include <string>
+#include <vector>
+
+#include "fceu/types.h"
+#include "tasbot.h"
+
+using namespace std;
+
+// From fceu/conddebug.h.
+struct Condition;
+
+struct Watch {
+  // Returns NULL, after saying why, if the condition doesn't parse,
+  // is nested absurdly deep, or uses the CPU's registers, flags or
+  // bank, which mean nothing between frames. Addresses must be in
+  // RAM (or its mirrors).
+  static Watch *Compile(const string &condition);
+
+  // Whether the condition is nonzero for the 0x800 bytes of RAM.
+  bool Check(const uint8 *ram) const;
+
+  // Gets the RAM addresses that Check reads, unless it computes
+  // some of them ($[...]) and so could read any; then returns false.
+  bool Addresses(vector<int> *addrs) const;
+
+  // As given to Compile.
+  const string &Text() const { return text; }
+
+ private:
+  Watch() {}
+
+  enum Opcode {
+    // Pushes arg.
+    PUSH,
+    // Pushes the byte of RAM at arg.
+    READ,
+    // Replaces the top of the stack with the byte of RAM there,
+    // or 0 if that's not in RAM.
+    LOAD,
+    // Replaces the top two with the result of the conddebug
+    // operator (OP_EQ etc.) arg.
+    BINARY,
+  };
+
+  struct Instruction {
+    Instruction(Opcode op, int arg) : op(op), arg(arg) {}
+    Opcode op;
+    int arg;
+  };
+
+  // Append the code for a parsed condition or one of its operands.
+  // False if it can't be compiled.
+  bool Emit(const Condition *c);
+  bool EmitOperand(unsigned int type, unsigned int value);
+
+  string text;
+  vector<Instruction> code;
+
+  NOT_COPYABLE(Watch);
+};
+
+#endif
@@ -0,0 +1,123 @@
+/* Tests for the Watch class, against what FCEUX's debugger
+   (evaluate in fceu/debug.cpp) makes of the same conditions. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "tasbot.h"
+#include "fceu/types.h"
+#include "watch.h"
+
+static uint8 ram[0x800];
+
+// Compiles the condition, which must be fine, and checks it
+// against ram.
+static bool Check(const string &condition) {
+  Watch *watch = Watch::Compile(condition);
+  CHECK(watch != NULL);
+  const bool result = watch->Check(ram);
+  delete watch;
+  return result;
+}
+
+static void TestCompare() {
+  memset(ram, 0, sizeof ram);
+  ram[0x7D6] = 2;
+  CHECK(Check("$07D6 < #3"));
+  ram[0x7D6] = 3;
+  CHECK(!Check("$07D6 < #3"));
+  CHECK(Check("$07D6 >= #3"));
+  CHECK(Check("$07D6 == #3"));
+  CHECK(!Check("$07D6 != #3"));
+
+  Watch *watch = Watch::Compile("$07D6 < #3");
+  vector<int> addrs;
+  CHECK(watch->Addresses(&addrs));
+  CHECK(addrs.size() == 1 && addrs[0] == 0x7D6);
+  delete watch;
+}
+
+static void TestIndirect() {
+  memset(ram, 0, sizeof ram);
+  ram[0x10] = 5;
+  ram[0x705] = 0;
+  CHECK(Check("$[#0700 + $0010] == #0"));
+  ram[0x705] = 1;
+  CHECK(!Check("$[#0700 + $0010] == #0"));
+  ram[0x10] = 6;
+  CHECK(Check("$[#0700 + $0010] == #0"));
+
+  // Could read anything.
+  Watch *watch = Watch::Compile("$[#0700 + $0010] == #0");
+  vector<int> addrs;
+  CHECK(!watch->Addresses(&addrs));
+  delete watch;
+}
+
+static void TestConnect() {
+  memset(ram, 0, sizeof ram);
+  ram[1] = 1;
+  CHECK(Check("$0001 == #1 || $0002 == #1"));
+  CHECK(!Check("$0001 == #1 && $0002 == #1"));
+  ram[2] = 1;
+  CHECK(Check("$0001 == #1 && $0002 == #1"));
+  // Like the debugger, || and && bind equally, from the left.
+  CHECK(!Check("#1 || #0 && #0"));
+  CHECK(Check("#1 || (#0 && #0)"));
+}
+
+static void TestArithmetic() {
+  memset(ram, 0, sizeof ram);
+  ram[3] = 4;
+  CHECK(Check("#8 / $0003 == #2"));
+  CHECK(Check("$0003 * #3 - #2 == #A"));
+  // The debugger would crash; we take it as 0.
+  ram[3] = 0;
+  CHECK(Check("#8 / $0003 == #0"));
+}
+
+static void TestRejected() {
+  // Not RAM.
+  CHECK(Watch::Compile("$2000 == #0") == NULL);
+  CHECK(Watch::Compile("$8000 == #0") == NULL);
+  // Registers and flags mean nothing between frames.
+  CHECK(Watch::Compile("A == #0") == NULL);
+  CHECK(Watch::Compile("$0001 == #0 && C") == NULL);
+  CHECK(Watch::Compile("$0001 ==") == NULL);
+
+  // Mirrors of RAM are fine.
+  memset(ram, 0, sizeof ram);
+  ram[0x7FF] = 9;
+  CHECK(Check("$1FFF == #9"));
+  // Computed addresses outside RAM read as 0.
+  CHECK(Check("$[#2000 + $07FF] == #0"));
+}
+
+// Each level keeps its left operand on the stack.
+static string Nested(int depth) {
+  string s;
+  for (int i = 0; i < depth; i++) s += "#1 + (";
+  s += "#1";
+  for (int i = 0; i < depth; i++) s += ")";
+  return s + " > #0";
+}
+
+static void TestDepth() {
+  memset(ram, 0, sizeof ram);
+  CHECK(Check(Nested(32)));
+  CHECK(Watch::Compile(Nested(100)) == NULL);
+}
+
+int main(int argc, char *argv[]) {
+  fprintf(stderr, "Testing watch conditions.\n");
+
+  TestCompare();
+  TestIndirect();
+  TestConnect();
+  TestArithmetic();
+  TestRejected();
+  TestDepth();
+
+  return 0;
+}
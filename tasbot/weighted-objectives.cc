@@ -1,6 +1,9 @@
 
 #include "weighted-objectives.h"
 
+#include <pthread.h>
+#include <unistd.h>
+
 struct WeightedObjectives::Info {
   explicit Info(double w) : weight(w) {}
   double weight;
@@ -9,14 +12,22 @@ struct WeightedObjectives::Info {
   vector< vector<uint8> > observations;
 };
 
-WeightedObjectives::WeightedObjectives() {}
+WeightedObjectives::WeightedObjectives() : rc("observe"), observations(0) {}
 
-WeightedObjectives::WeightedObjectives(const vector< vector<int> > &objs) {
+WeightedObjectives::WeightedObjectives(const vector< vector<int> > &objs)
+  : rc("observe"), observations(0) {
   for (int i = 0; i < objs.size(); i++) {
     weighted[objs[i]] = new Info(1.0);
   }
 }
 
+WeightedObjectives::~WeightedObjectives() {
+  for (Weighted::iterator it = weighted.begin();
+       it != weighted.end(); ++it) {
+    delete it->second;
+  }
+}
+
 static string ObjectiveToString(const vector<int> &obj) {
   string s;
   for (int i = 0; i < obj.size(); i++) {
@@ -27,8 +38,29 @@ static string ObjectiveToString(const vector<int> &obj) {
   return s;
 }
 
+WeightedObjectives *
+WeightedObjectives::LoadBinary(const string &filename) {
+  MappedFile file(filename);
+  const WeightedPool::Entry *entries;
+  uint32 count;
+  const uint8 *pool;
+  WeightedPool::Read(file, OBJECTIVES_MAGIC, &entries, &count, &pool);
+
+  WeightedObjectives *wo = new WeightedObjectives;
+  for (uint32 i = 0; i < count; i++) {
+    const int32 *locs = (const int32 *)(pool + entries[i].offset);
+    vector<int> obj(locs, locs + entries[i].length / sizeof (int32));
+    wo->weighted.insert(make_pair(obj, new Info(entries[i].weight)));
+  }
+  return wo;
+}
+
 WeightedObjectives *
 WeightedObjectives::LoadFromFile(const string &filename) {
+  if (MappedFile::HasMagic(filename, OBJECTIVES_MAGIC)) {
+    return LoadBinary(filename);
+  }
+
   WeightedObjectives *wo = new WeightedObjectives;
   vector<string> lines = Util::ReadFileToLines(filename);
   for (int i = 0; i < lines.size(); i++) {
@@ -64,10 +96,46 @@ void WeightedObjectives::SaveToFile(const string &filename) const {
   printf("Saved weighted objectives to %s\n", filename.c_str());
 }
 
+void WeightedObjectives::SaveBinary(const string &filename) const {
+  vector<WeightedPool::Entry> entries;
+  string pool;
+  for (Weighted::const_iterator it = weighted.begin();
+       it != weighted.end(); ++it) {
+    if (it->second->weight > 0) {
+      const vector<int> &obj = it->first;
+      WeightedPool::Entry entry;
+      entry.offset = pool.size();
+      entry.length = obj.size() * sizeof (int32);
+      entry.weight = it->second->weight;
+      entries.push_back(entry);
+      for (int i = 0; i < obj.size(); i++) {
+	int32 loc = obj[i];
+	pool.append((const char *)&loc, sizeof (int32));
+      }
+    }
+  }
+  if (!WeightedPool::Write(filename, OBJECTIVES_MAGIC, entries, pool)) {
+    fprintf(stderr, "Couldn't write %s\n", filename.c_str());
+    abort();
+  }
+  printf("Saved %zu weighted objectives to %s\n",
+	 entries.size(), filename.c_str());
+}
+
 size_t WeightedObjectives::Size() const {
   return weighted.size();
 }
 
+vector< vector<int> > WeightedObjectives::GetObjectives() const {
+  vector< vector<int> > objs;
+  objs.reserve(weighted.size());
+  for (Weighted::const_iterator it = weighted.begin();
+       it != weighted.end(); ++it) {
+    objs.push_back(it->first);
+  }
+  return objs;
+}
+
 void WeightedObjectives::Observe(const vector<uint8> &memory) {
   // Isn't it desirable that particular states' values change
   // as more observations are made? We're not observing every
@@ -82,7 +150,9 @@ void WeightedObjectives::Observe(const vector<uint8> &memory) {
   for (Weighted::iterator it = weighted.begin();
        it != weighted.end(); ++it) {
     // PERF Randomly forget observations like a human does.
-    // Assume N=64 should be sufficiently large.
+    // Assume N=64 should be sufficiently large. The randomness is
+    // deterministic, so that copies that make the same observations
+    // stay the same.
     const vector<int> &obj = it->first;
     Info *info = it->second;
     const size_t size = info->observations.size();
@@ -90,7 +160,7 @@ void WeightedObjectives::Observe(const vector<uint8> &memory) {
       info->observations.resize(info->observations.size() + 1);
     }
     vector<uint8> &cur = size >= 64 ?
-      info->observations[rand() % size] :
+      info->observations[RandomInt32(&rc) % size] :
       info->observations.back();
     cur.clear();
     cur.reserve(obj.size());
@@ -108,6 +178,11 @@ void WeightedObjectives::Observe(const vector<uint8> &memory) {
     // lower_bound is doing something kind of funny when there
     // are lots of the same value...
   }
+  observations++;
+}
+
+int64 WeightedObjectives::NumObservations() const {
+  return observations;
 }
 
 static bool LessObjective(const vector<uint8> &mem1, 
@@ -175,6 +250,15 @@ double WeightedObjectives::Evaluate(const vector<uint8> &mem1,
   return score;
 }
 
+double WeightedObjectives::TotalWeight() const {
+  double total = 0.0;
+  for (Weighted::const_iterator it = weighted.begin();
+       it != weighted.end(); ++it) {
+    total += it->second->weight;
+  }
+  return total;
+}
+
 static vector<uint8> GetValues(const vector<uint8> &mem,
 			       const vector<int> &objective) {
   vector<uint8> out;
@@ -238,51 +322,307 @@ double WeightedObjectives::GetNormalizedValue(const vector<uint8> &mem)
 
 void WeightedObjectives::WeightByExamples(const vector< vector<uint8> >
 					  &memories) {
-  for (Weighted::iterator it = weighted.begin();
-       it != weighted.end(); ++it) {
-    const vector<int> &obj = it->first;
-    Info *info = it->second;
+  vector< pair<int, int> > spans;
+  spans.push_back(make_pair(0, (int)memories.size()));
+  WeightByExamples(memories, spans);
+}
+
+// The rank of the objective's value in each memory, among all the
+// values it takes on. Two objectives with the same ranks order the
+// memories the same way, so they're equivalent as far as the
+// examples can tell.
+static vector<int> GetRanks(const vector< vector<uint8> > &memories,
+			    const vector<int> &obj,
+			    const vector< vector<uint8> > &values) {
+  vector<int> ranks;
+  ranks.reserve(memories.size());
+  for (int i = 0; i < memories.size(); i++) {
+    ranks.push_back(GetValueIndex(values, GetValues(memories[i], obj)));
+  }
+  return ranks;
+}
+
+// Weighs a contiguous range of the objectives, on its own thread.
+struct WeighJob {
+  const vector< vector<uint8> > *memories;
+  const vector< pair<int, int> > *spans;
+  // Inputs, and outputs at the same indices.
+  vector<const vector<int> *> objs;
+  vector<double> scores;
+  // Of the ranks; see WeightByExamples.
+  vector<uint128> fingerprints;
+};
+
+static void *WeighThread(void *arg) {
+  WeighJob *job = (WeighJob *)arg;
+  const vector< vector<uint8> > &memories = *job->memories;
+  const vector< pair<int, int> > &spans = *job->spans;
+  job->scores.resize(job->objs.size());
+  job->fingerprints.resize(job->objs.size());
+  for (int o = 0; o < job->objs.size(); o++) {
+    const vector<int> &obj = *job->objs[o];
     // All the distinct values this objective takes on, in order.
     vector< vector<uint8> > values = GetUniqueValues(memories, obj);
+    vector<int> ranks = GetRanks(memories, obj, values);
+    job->fingerprints[o] = CityHash128((const char *)&ranks[0],
+				       ranks.size() * sizeof (int));
+
+    double score = 0.0;
+    int gained = 0;
+    for (int s = 0; s < spans.size(); s++) {
+      const int begin = spans[s].first, end = spans[s].second;
+      CHECK(begin < end);
+      CHECK(end <= memories.size());
+      // Sum of deltas is just very last - very first.
+      double score_end = (double)ranks[end - 1] / values.size();
+      double score_begin = (double)ranks[begin] / values.size();
+      CHECK(score_end >= 0 && score_end <= 1);
+      CHECK(score_begin >= 0 && score_begin <= 1);
+      const double delta = score_end - score_begin;
+      if (spans.size() == 1) {
+	score = delta;
+      } else if (delta > 0.0) {
+	score += delta;
+	gained++;
+      }
+    }
+    if (spans.size() > 1) {
+      score *= (double)gained / spans.size();
+    }
+    job->scores[o] = score;
+  }
+  return NULL;
+}
+
+void WeightedObjectives::WeightByExamples(const vector< vector<uint8> >
+					  &memories,
+					  const vector< pair<int, int> >
+					  &spans) {
+  CHECK(!spans.empty());
+  CHECK(!memories.empty());
+
+  // Split the objectives evenly across the cores.
+  int num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+  num_threads = max(1, min(num_threads, (int)weighted.size()));
+  vector<WeighJob> jobs(num_threads);
+  vector<Info *> infos;
+  {
+    int i = 0;
+    for (Weighted::iterator it = weighted.begin();
+	 it != weighted.end(); ++it, i++) {
+      WeighJob *job = &jobs[(int64)i * num_threads / weighted.size()];
+      job->objs.push_back(&it->first);
+      infos.push_back(it->second);
+    }
+  }
+
+  vector<pthread_t> threads(num_threads);
+  for (int t = 0; t < num_threads; t++) {
+    jobs[t].memories = &memories;
+    jobs[t].spans = &spans;
+    CHECK(0 == pthread_create(&threads[t], NULL, WeighThread, &jobs[t]));
+  }
+  for (int t = 0; t < num_threads; t++) {
+    CHECK(0 == pthread_join(threads[t], NULL));
+  }
+
+  // Objectives with the same ranks in every memory are equivalent.
+  // Keep the shortest of each (the first, in map order, if tied).
+  // The ranks are only compared by a 128-bit fingerprint, since
+  // computing them again here would take as long as weighing did,
+  // on one thread. A false match is vanishingly unlikely.
+  map<uint128, const vector<int> *> kept;
+  vector<const vector<int> *> dupes;
+  int i = 0;
+  for (int t = 0; t < num_threads; t++) {
+    const WeighJob &job = jobs[t];
+    for (int o = 0; o < job.objs.size(); o++, i++) {
+      const vector<int> &obj = *job.objs[o];
+      const double score = job.scores[o];
+      infos[i]->weight = score > 0.0 ? score : 0.0;
+      if (score <= 0.0) {
+	printf("Bad objective lost more than gained: %f / [ %s ]\n",
+	       score, ObjectiveToString(obj).c_str());
+	continue;
+      }
+
+      const vector<int> *&same = kept[job.fingerprints[o]];
+      if (same == NULL) {
+	same = &obj;
+      } else if (obj.size() < same->size()) {
+	dupes.push_back(same);
+	same = &obj;
+      } else {
+	dupes.push_back(&obj);
+      }
+    }
+  }
+
+  // Copy, since the keys are about to be erased.
+  vector< vector<int> > remove;
+  for (int d = 0; d < dupes.size(); d++) {
+    remove.push_back(*dupes[d]);
+  }
+  for (int d = 0; d < remove.size(); d++) {
+    Weighted::iterator it = weighted.find(remove[d]);
+    CHECK(it != weighted.end());
+    delete it->second;
+    weighted.erase(it);
+  }
+  printf("Removed %zu objectives equivalent to others.\n", remove.size());
+}
 
+// At most this many transitions are considered when pruning; they're
+// sampled evenly if there are more.
+static const int PRUNE_TRANSITIONS = 2048;
 
-    // Sum of deltas is just very last - very first.
-    CHECK(memories.size() > 0);
-    double score_end =
-      GetValueFrac(values, GetValues(memories[memories.size() - 1], obj));
-    double score_begin = 
-      GetValueFrac(values, GetValues(memories[0], obj));
-    CHECK(score_end >= 0 && score_end <= 1);
-    CHECK(score_begin >= 0 && score_begin <= 1);
-    double score = score_end - score_begin;
-
-    /*
-    int lastvaluefrac = 0.0;
-    for (int i = 0; i < memories.size(); i++) {
-      vector<uint8> now = GetValues(memories[i], obj);
-      double valuefrac = GetValueFrac(values, now);
-      CHECK(valuefrac >= 0);
-      CHECK(valuefrac <= 1);
-      score += (valuefrac - lastvaluefrac);
-      lastvaluefrac = valuefrac;
+static inline int Sign(double d) {
+  return (d > 1e-9) - (d < -1e-9);
+}
+
+// Merge plan for Prune, given the objectives in descending weight
+// order and their Order on each transition. Sets into[o] to the
+// objective that o is merged into (o itself if it's kept), and
+// returns the fraction of transitions where the pruned Evaluate
+// has a different sign than the original.
+static double PlanPrune(const vector<double> &weights,
+			const vector< vector<float> > &orders,
+			const vector<double> &original,
+			int max_disagree,
+			vector<int> *into) {
+  const int num = weights.size();
+  const int trans = original.size();
+  into->resize(num);
+  vector<int> kept;
+  for (int o = 0; o < num; o++) {
+    (*into)[o] = o;
+    for (int k = 0; k < kept.size(); k++) {
+      const vector<float> &a = orders[o], &b = orders[kept[k]];
+      int disagree = 0;
+      for (int t = 0; t < trans && disagree <= max_disagree; t++) {
+	if (Sign(a[t]) != Sign(b[t])) disagree++;
+      }
+      if (disagree <= max_disagree) {
+	(*into)[o] = kept[k];
+	break;
+      }
     }
-    */
+    if ((*into)[o] == o) kept.push_back(o);
+  }
 
-    if (score <= 0.0) {
-      printf("Bad objective lost more than gained: %f / [ %s ]\n",
-	     score, ObjectiveToString(obj).c_str());
-      info->weight = 0.0;
+  vector<double> merged(num, 0.0);
+  for (int o = 0; o < num; o++) {
+    merged[(*into)[o]] += weights[o];
+  }
+  int wrong = 0;
+  for (int t = 0; t < trans; t++) {
+    double score = 0.0;
+    for (int k = 0; k < kept.size(); k++) {
+      score += merged[kept[k]] * orders[kept[k]][t];
+    }
+    if (Sign(score) != Sign(original[t])) wrong++;
+  }
+  return trans == 0 ? 0.0 : (double)wrong / trans;
+}
+
+double WeightedObjectives::Prune(const vector< vector<uint8> > &memories,
+				 const vector< pair<int, int> > &spans,
+				 double tolerance) {
+  // Transitions where something changed.
+  vector< pair<int, int> > all;
+  for (int s = 0; s < spans.size(); s++) {
+    for (int i = spans[s].first; i + 1 < spans[s].second; i++) {
+      if (memories[i] != memories[i + 1]) all.push_back(make_pair(i, i + 1));
+    }
+  }
+  vector< pair<int, int> > transitions;
+  const int trans = min((int)all.size(), PRUNE_TRANSITIONS);
+  for (int t = 0; t < trans; t++) {
+    transitions.push_back(all[(int64)t * all.size() / trans]);
+  }
+
+  // Heaviest first, so that's what lighter ones merge into.
+  vector< pair<double, const vector<int> *> > byweight;
+  vector< vector<int> > zero;
+  for (Weighted::const_iterator it = weighted.begin();
+       it != weighted.end(); ++it) {
+    if (it->second->weight > 0.0) {
+      byweight.push_back(make_pair(-it->second->weight, &it->first));
     } else {
-      info->weight = score;
+      zero.push_back(it->first);
     }
   }
+  stable_sort(byweight.begin(), byweight.end());
+
+  const int num = byweight.size();
+  vector<double> weights(num);
+  vector< vector<float> > orders(num, vector<float>(trans));
+  vector<double> original(trans, 0.0);
+  for (int o = 0; o < num; o++) {
+    weights[o] = -byweight[o].first;
+    const vector<int> &obj = *byweight[o].second;
+    for (int t = 0; t < trans; t++) {
+      orders[o][t] = Order(memories[transitions[t].first],
+			   memories[transitions[t].second], obj);
+      original[t] += weights[o] * orders[o][t];
+    }
+  }
+
+  // Tighten the pairwise threshold until the aggregate is close
+  // enough. At zero, only objectives that always agree are merged,
+  // but magnitudes can still differ; then give up.
+  vector<int> into;
+  int max_disagree = (int)(tolerance * trans);
+  double wrong = PlanPrune(weights, orders, original, max_disagree, &into);
+  while (wrong > tolerance && max_disagree > 0) {
+    max_disagree /= 2;
+    wrong = PlanPrune(weights, orders, original, max_disagree, &into);
+  }
+  if (wrong > tolerance) {
+    for (int o = 0; o < num; o++) into[o] = o;
+    wrong = 0.0;
+  }
+
+  // Apply it. Copy keys, since they're about to be erased.
+  vector< vector<int> > remove = zero;
+  for (int o = 0; o < num; o++) {
+    if (into[o] != o) {
+      weighted[*byweight[into[o]].second]->weight += weights[o];
+      remove.push_back(*byweight[o].second);
+    }
+  }
+  for (int r = 0; r < remove.size(); r++) {
+    Weighted::iterator it = weighted.find(remove[r]);
+    CHECK(it != weighted.end());
+    delete it->second;
+    weighted.erase(it);
+  }
+  printf("Pruned %zu objectives (%zu with no weight) to %zu, over %d "
+	 "transitions. Evaluate differs on %.2f%% of them.\n",
+	 remove.size(), zero.size(), weighted.size(), trans, 100.0 * wrong);
+  return wrong;
+}
+
+void WeightedObjectives::SaveSVG(const vector< vector<uint8> > &memories,
+				 const string &filename) const {
+  // Five units per memory on the x axis.
+  vector<size_t> xs;
+  for (int i = 0; i < memories.size(); i++) {
+    xs.push_back(i * 5);
+  }
+  SaveSVG(memories, xs, filename);
 }
 
 void WeightedObjectives::SaveSVG(const vector< vector<uint8> > &memories,
+				 const vector<size_t> &xs,
 				 const string &filename) const {
-  const double SPAN = 50;
+  CHECK(memories.size() == xs.size());
   const double WIDTH = memories.size() * 2; // 1024.0
   const double HEIGHT = 768.0;
+  const double MAXX = xs.empty() ? 1.0 : xs.back() + 1.0;
+  // About one tickmark every 20 pixels.
+  double span = 50;
+  while (MAXX / span > WIDTH / 20.0) span *= 2;
 
   // Add slop since other SVG does.
   string out = TextSVG::Header(WIDTH+12, HEIGHT+12);
@@ -338,7 +678,7 @@ void WeightedObjectives::SaveSVG(const vector< vector<uint8> > &memories,
 
       // Fraction in [0, 1]
       double yf = (double)valueindex / values.size();
-      double xf = (double)i / memories.size();
+      double xf = xs[i] / MAXX;
       out += Coords(WIDTH * xf, HEIGHT * (1.0 - yf)) + " ";
       if (numleft-- == 0) {
 	out += endpolyline;
@@ -353,7 +693,7 @@ void WeightedObjectives::SaveSVG(const vector< vector<uint8> > &memories,
   }
 
   // XXX args?
-  out += SVGTickmarks(WIDTH, memories.size() * 5, SPAN, 20.0, 12.0);
+  out += SVGTickmarks(WIDTH, MAXX, span, 20.0, 12.0);
 
   out += TextSVG::Footer();
   Util::WriteFile(filename, out);
@@ -16,27 +16,66 @@
 #include "../cc-lib/arcfour.h"
 #include "../cc-lib/textsvg.h"
 #include "fceu/types.h"
+#include "mapped-file.h"
 #include "motifs.h"
 #include "tasbot.h"
 #include "util.h"
 
 using namespace std;
 
+#define OBJECTIVES_MAGIC "tasbot-objs-1\n"
+
 struct WeightedObjectives {
   explicit WeightedObjectives(const std::vector< vector<int> > &objs);
+  // Reads either the text or the binary format. Binary files are
+  // mapped rather than parsed, which is much faster for helpers.
   static WeightedObjectives *LoadFromFile(const std::string &filename);
+  ~WeightedObjectives();
 
   void WeightByExamples(const vector< vector<uint8> > &memories);
 
-  // Does not save observations.
+  // Same, for memories from several movies, where spans gives the
+  // [begin, end) of each one. An objective's weight is its progress
+  // summed over the movies where it made some, scaled by the fraction
+  // of movies where it did, so objectives that hold across all of
+  // them count the most.
+  void WeightByExamples(const vector< vector<uint8> > &memories,
+                        const vector< pair<int, int> > &spans);
+
+  // Does not save observations. Text, one objective per line.
   void SaveToFile(const std::string &filename) const;
+  // Same, in the binary format: a WeightedPool of int32 locations.
+  void SaveBinary(const std::string &filename) const;
 
   // XXX version that uses observations?
   void SaveSVG(const vector< vector<uint8> > &memories,
                const string &filename) const;
 
+  // Same, but each memory is drawn at the given x position (like a
+  // frame number) rather than evenly spaced. xs must be ascending.
+  void SaveSVG(const vector< vector<uint8> > &memories,
+               const vector<size_t> &xs,
+               const string &filename) const;
+
+  // Merges objectives that almost always agree about which way
+  // the transitions between consecutive memories (within each span)
+  // go. An objective's weight is added to the heavier one it agrees
+  // with on all but a tolerance fraction of transitions. Objectives
+  // with no weight are dropped, since they don't affect Evaluate.
+  // If this would make Evaluate disagree in sign with the unpruned
+  // set on more than a tolerance fraction of transitions, the
+  // pairwise threshold is tightened until it doesn't. Returns that
+  // fraction. Observations of merged objectives are lost.
+  double Prune(const vector< vector<uint8> > &memories,
+               const vector< pair<int, int> > &spans,
+               double tolerance);
+
   size_t Size() const;
 
+  // Returns the objectives themselves, without weights or
+  // observations. Enough to construct a copy for SaveSVG.
+  vector< vector<int> > GetObjectives() const;
+
   // Scoring function which is just the sum of the weights of
   // objectives where mem1 < mem2.
   double WeightedLess(const vector<uint8> &mem1,
@@ -47,6 +86,10 @@ struct WeightedObjectives {
   double Evaluate(const vector<uint8> &mem1,
                   const vector<uint8> &mem2) const;
 
+  // Sum of the objectives' weights, which bounds the magnitude of
+  // Evaluate.
+  double TotalWeight() const;
+
   // Observe a game state. This informs us about the values that
   // the objective functions can take on, which lets us score the
   // magnitude of their changes. Not necessary for GetNumLess() or
@@ -60,6 +103,10 @@ struct WeightedObjectives {
   // exploration, not each step of speculative search.
   void Observe(const vector<uint8> &memory);
 
+  // Number of calls to Observe. Two copies of the same objectives
+  // that observe the same memories in the same order agree.
+  int64 NumObservations() const;
+
   // Get the (current) value of the memory in terms of observations.
   // The value is the unweighted average of the value of each objective
   // function relative to the values we've seen before for it; 1 means
@@ -71,9 +118,13 @@ struct WeightedObjectives {
 
  private:
   WeightedObjectives();
+  static WeightedObjectives *LoadBinary(const std::string &filename);
   struct Info;
   typedef std::map< std::vector<int>, Info* > Weighted;
   Weighted weighted;
+  // For forgetting observations.
+  ArcFour rc;
+  int64 observations;
 
   NOT_COPYABLE(WeightedObjectives);
 };
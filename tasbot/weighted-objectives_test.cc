@@ -10,7 +10,109 @@
 #include "../cc-lib/arcfour.h"
 #include "weighted-objectives.h"
 
+// Location 0 counts up and 1 never changes, so [0], [0 1] and
+// [1 0] all order these the same way. 2 goes down.
+static const uint8 kMem0[][3] = {
+  {1, 5, 9},
+  {2, 5, 8},
+  {3, 5, 7},
+  {3, 5, 6},
+};
+
+static vector<int> Obj(int a) {
+  return vector<int>(1, a);
+}
+
+static vector<int> Obj(int a, int b) {
+  vector<int> v;
+  v.push_back(a);
+  v.push_back(b);
+  return v;
+}
+
+static void TestDeduplicate() {
+  vector< vector<uint8> > memories;
+  for (int i = 0; i < sizeof kMem0 / sizeof kMem0[0]; i++) {
+    memories.push_back(vector<uint8>(kMem0[i], kMem0[i] + 3));
+  }
+
+  vector< vector<int> > objs;
+  objs.push_back(Obj(0, 1));
+  objs.push_back(Obj(1, 0));
+  objs.push_back(Obj(0));
+  objs.push_back(Obj(2));
+  WeightedObjectives weighted(objs);
+  weighted.WeightByExamples(memories);
+
+  // The equivalent ones collapse to the shortest. [2] is kept, but
+  // with zero weight.
+  vector< vector<int> > left = weighted.GetObjectives();
+  CHECK(left.size() == 2);
+  CHECK(left[0] == Obj(0));
+  CHECK(left[1] == Obj(2));
+  CHECK(weighted.Evaluate(memories[0], memories[1]) > 0.0);
+  CHECK(weighted.Evaluate(memories[2], memories[3]) == 0.0);
+}
+
+// Location 2 is a copy of 0, and 1 goes down once.
+static const uint8 kMem1[][3] = {
+  {1, 9, 1},
+  {2, 9, 2},
+  {2, 8, 2},
+  {4, 8, 4},
+};
+
+static void TestPrune() {
+  vector< vector<uint8> > memories;
+  for (int i = 0; i < sizeof kMem1 / sizeof kMem1[0]; i++) {
+    memories.push_back(vector<uint8>(kMem1[i], kMem1[i] + 3));
+  }
+  vector< pair<int, int> > spans;
+  spans.push_back(make_pair(0, (int)memories.size()));
+
+  vector< vector<int> > objs;
+  objs.push_back(Obj(0));
+  objs.push_back(Obj(2));
+  objs.push_back(Obj(1));
+  WeightedObjectives weighted(objs);
+
+  vector<double> before;
+  for (int i = 0; i + 1 < memories.size(); i++) {
+    before.push_back(weighted.Evaluate(memories[i], memories[i + 1]));
+  }
+
+  // [0] and [2] always agree, so one absorbs the other's weight.
+  // [1] disagrees with both on every transition where it moves.
+  CHECK(0.0 == weighted.Prune(memories, spans, 0.0));
+  CHECK(weighted.Size() == 2);
+  for (int i = 0; i + 1 < memories.size(); i++) {
+    CHECK(before[i] == weighted.Evaluate(memories[i], memories[i + 1]));
+  }
+}
+
+static void TestBinary() {
+  vector< vector<int> > objs;
+  objs.push_back(Obj(0, 1));
+  objs.push_back(Obj(2));
+  WeightedObjectives weighted(objs);
+  const string filename = "weighted-objectives_test.objectives";
+  weighted.SaveBinary(filename);
+  CHECK(MappedFile::HasMagic(filename, OBJECTIVES_MAGIC));
+
+  WeightedObjectives *loaded = WeightedObjectives::LoadFromFile(filename);
+  CHECK(loaded->GetObjectives() == weighted.GetObjectives());
+  vector<uint8> a(kMem1[0], kMem1[0] + 3), b(kMem1[3], kMem1[3] + 3);
+  CHECK(loaded->Evaluate(a, b) == weighted.Evaluate(a, b));
+  delete loaded;
+  remove(filename.c_str());
+}
+
 int main(int argc, char *argv[]) {
+  fprintf(stderr, "Testing weighted objectives.\n");
+
+  TestDeduplicate();
+  TestPrune();
+  TestBinary();
 
   return 0;
 }